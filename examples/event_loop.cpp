@@ -0,0 +1,176 @@
+#include "event_loop.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+#include "log.h"
+
+namespace m = mikado;
+
+Event_loop::Session::Session(Socket_connection &_conn, mikado::mikado_sm &_sm,
+                             size_t read_buffer_size) : conn(_conn), sm(_sm),
+                                                        read_buffer(read_buffer_size),
+                                                        reader{conn, read_buffer}
+{
+}
+
+Event_loop::Event_loop(close_handler_t _on_close) : epoll_fd{epoll_create1(EPOLL_CLOEXEC)},
+                                                     wheel{std::chrono::milliseconds(1), clock::now()},
+                                                     on_close{_on_close}
+{
+    if (epoll_fd < 0)
+    {
+        throw std::runtime_error(std::string("Could not create epoll instance: ") + strerror(errno));
+    }
+}
+
+Event_loop::~Event_loop()
+{
+    // The mikado_sm outlive the loop, detach them from the wheel and from
+    // their sessions
+    for (const auto &s : sessions)
+    {
+        s->sm.set_timer_wheel(nullptr);
+    }
+    ::close(epoll_fd);
+}
+
+void Event_loop::add(Socket_connection &conn, mikado::mikado_sm &sm,
+                     size_t read_buffer_size)
+{
+    conn.sock.set_nonblocking();
+
+    std::unique_ptr<Session> s{new Session{conn, sm, read_buffer_size}};
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = s.get();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.sock.s, &ev) < 0)
+    {
+        throw std::runtime_error(std::string("Could not register socket: ") + strerror(errno));
+    }
+
+    const auto session = s.get();
+    sm.set_timer_wheel(&wheel, [this, session]() { check(*session); });
+    sessions.push_back(std::move(s));
+}
+
+void Event_loop::remove(Socket_connection &conn)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.sock.s, nullptr);
+
+    const auto removed = std::stable_partition(sessions.begin(), sessions.end(),
+                                               [&conn](const std::unique_ptr<Session> &s) { return &s->conn != &conn; });
+    std::for_each(removed, sessions.end(),
+                  [](const std::unique_ptr<Session> &s) { s->sm.set_timer_wheel(nullptr); });
+    sessions.erase(removed, sessions.end());
+}
+
+void Event_loop::run_once(std::chrono::milliseconds max_wait)
+{
+    auto now = clock::now();
+    const auto wake = std::min(now + max_wait, wheel.next_expiry());
+    // round up, so we do not wake just before a deadline
+    const auto timeout = std::max<long long>(
+                0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                    wake - now + std::chrono::milliseconds(1) - clock::duration(1)).count());
+
+    constexpr int max_events = 64;
+    epoll_event events[max_events];
+    const auto n = epoll_wait(epoll_fd, events, max_events, static_cast<int>(timeout));
+    if (n < 0 && errno != EINTR)
+    {
+        throw std::runtime_error(std::string("epoll_wait failed: ") + strerror(errno));
+    }
+
+    now = clock::now();
+    for (int i = 0; i < n; ++i)
+    {
+        auto &s = *static_cast<Session *>(events[i].data.ptr);
+        handle_read(s);
+    }
+
+    wheel.expire(now);
+    sweep();
+}
+
+void Event_loop::run()
+{
+    stopped = false;
+    while (!stopped && !sessions.empty())
+    {
+        run_once();
+    }
+}
+
+void Event_loop::stop()
+{
+    stopped = true;
+}
+
+size_t Event_loop::size() const
+{
+    return sessions.size();
+}
+
+void Event_loop::handle_read(Session &s)
+{
+    if (s.closed)
+    {
+        return;
+    }
+
+    const auto ret = s.reader.drain([&s](m::cbuf_t p) {
+        s.sm.process_packet(p);
+    });
+
+    if (ret == m::read_result::read_error)
+    {
+        LOG << "Closing session on socket " << s.conn.sock.s << endl;
+        close(s);
+        return;
+    }
+
+    s.sm.poll();
+    check(s);
+}
+
+void Event_loop::check(Session &s)
+{
+    if (!s.closed && s.sm.session() == m::session_t::error)
+    {
+        LOG << "Closing session on socket " << s.conn.sock.s
+            << (s.sm.ping_pending() ? ", keep-alive timeout" : "") << endl;
+        close(s);
+    }
+}
+
+void Event_loop::close(Session &s)
+{
+    s.closed = true;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s.conn.sock.s, nullptr);
+    s.sm.set_timer_wheel(nullptr);
+}
+
+void Event_loop::sweep()
+{
+    const auto first_closed = std::stable_partition(
+                sessions.begin(), sessions.end(),
+                [](const std::unique_ptr<Session> &s) { return !s->closed; });
+
+    // move them out first, so on_close may add or remove sessions
+    std::vector<std::unique_ptr<Session>> closed;
+    std::move(first_closed, sessions.end(), std::back_inserter(closed));
+    sessions.erase(first_closed, sessions.end());
+
+    for (const auto &s : closed)
+    {
+        on_close(s->conn, s->sm);
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "mikado.h"
+#include "mikado_util.h"
+
+/// epoll based loop driving many mikado_sm sessions, each on its own
+/// non-blocking Socket_connection. Linux only.
+///
+/// Reads are dispatched as data arrives: one read per readable socket, and
+/// all complete packets from it are passed to the session's mikado_sm.
+/// Deadlines of all sessions are kept in one timer_wheel. Between events the
+/// loop sleeps in epoll_wait() until the wheel's next expiry, so idle
+/// sessions cost no wakeups, and only sessions which are due get polled.
+///
+/// Keep-alive is up to each mikado_sm, as requested in request_connect().
+/// Sessions whose PINGRESP does not arrive in time go into error and are
+/// closed.
+class Event_loop
+{
+public:
+    typedef std::chrono::steady_clock clock;
+    typedef std::function<void(Socket_connection &, mikado::mikado_sm &)> close_handler_t;
+
+    /// on_close is called for sessions the loop closes due to read errors,
+    /// protocol errors or a keep-alive timeout. They are deregistered
+    /// already.
+    explicit Event_loop(close_handler_t on_close = [](Socket_connection &, mikado::mikado_sm &) {});
+    /// Detaches the sessions still registered, their conn and sm may be
+    /// used on without the loop.
+    ~Event_loop();
+
+    Event_loop(const Event_loop &) = delete;
+    void operator=(const Event_loop &) = delete;
+
+    /// Register a session. conn and sm must stay alive while registered.
+    void add(Socket_connection &conn, mikado::mikado_sm &sm,
+             size_t read_buffer_size = 64 * 1024);
+    void remove(Socket_connection &conn);
+
+    /// Wait at most max_wait for events, then handle them and poll all
+    /// sessions which are due.
+    void run_once(std::chrono::milliseconds max_wait = std::chrono::milliseconds(1000));
+
+    /// run_once() until stop() is called or no session is left
+    void run();
+    void stop();
+
+    size_t size() const;
+
+private:
+    struct Session
+    {
+        Session(Socket_connection &_conn, mikado::mikado_sm &_sm, size_t read_buffer_size);
+
+        Socket_connection &conn;
+        mikado::mikado_sm &sm;
+
+        std::vector<mikado::byte> read_buffer;
+        mikado::Batch_reader reader;
+
+        bool closed = false;
+    };
+
+    int epoll_fd;
+    mikado::timer_wheel wheel;
+    std::vector<std::unique_ptr<Session>> sessions;
+    bool stopped = false;
+    close_handler_t on_close;
+
+    void handle_read(Session &);
+    /// Close s if its mikado_sm failed
+    void check(Session &s);
+    void close(Session &);
+
+    /// Deregister closed sessions. Deferred until all events of one
+    /// epoll_wait() are handled, as they point to sessions.
+    void sweep();
+};
+
+#endif // EVENT_LOOP_H
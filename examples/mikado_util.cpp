@@ -1,6 +1,10 @@
 #include "mikado_util.h"
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cerrno>
+#include <cstring>
 
 #include "log.h"
 
@@ -15,6 +19,23 @@ int Socket_connection::send(mikado::cbuf_t msg)
     return ::send(sock.s, msg.data(), msg.size_bytes(), 0);
 }
 
+int Socket_connection::send_vectored(mikado::cbuf_t head, mikado::cbuf_t tail)
+{
+    LOG << "Sending " << head.size_bytes() << " + " << tail.size_bytes()
+        << " bytes." << endl;
+
+    iovec iov[2];
+    iov[0].iov_base = const_cast<m::byte *>(head.data());
+    iov[0].iov_len = head.size_bytes();
+    iov[1].iov_base = const_cast<m::byte *>(tail.data());
+    iov[1].iov_len = tail.size_bytes();
+
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    return ::sendmsg(sock.s, &msg, 0);
+}
+
 int Socket_connection::read(mikado::buf_t b)
 {
     auto p = b.data();
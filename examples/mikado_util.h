@@ -9,6 +9,7 @@ struct Socket_connection : public mikado::Connection, mikado::Packet_reader::Rec
     Socket_connection(my_socket&& _sock);
 
     virtual int send(mikado::cbuf_t msg) override;
+    virtual int send_vectored(mikado::cbuf_t head, mikado::cbuf_t tail) override;
 
     virtual int read(mikado::buf_t b) override;
 
@@ -1,9 +1,13 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <cstring>
+#include <stdexcept>
+
 
 #include "log.h"
 #include "net_util.h"
@@ -85,10 +89,13 @@ addr_info::~addr_info()
 std::string hostinfo(const sockaddr *sa)
 {
     char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-    const auto r = getnameinfo(sa, sa->sa_len, hbuf, sizeof(hbuf), sbuf,
+    // not every platform has sa_len
+    const socklen_t sa_len = (sa->sa_family == AF_INET6) ? sizeof(sockaddr_in6)
+                                                         : sizeof(sockaddr_in);
+    const auto r = getnameinfo(sa, sa_len, hbuf, sizeof(hbuf), sbuf,
                                sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
     if (r < 0) {
-        throw std::runtime_error{gai_strerror(r)};
+        throw std::runtime_error(gai_strerror(r));
     }
 
     return std::string{hbuf} + "(" + sbuf + ")";
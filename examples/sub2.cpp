@@ -1,9 +1,9 @@
-#include <thread>
 #include <chrono>
 
 #include "mikado.h"
 #include "net_util.h"
 #include "mikado_util.h"
+#include "event_loop.h"
 #include "log.h"
 
 namespace m = mikado;
@@ -26,63 +26,33 @@ void logging_cb(m::cbuf_t _t, m::cbuf_t _v)
 int main(int argc, char**argv)
 {
     Socket_connection conn{tcp_connect("localhost", "1883")};
-    conn.sock.set_nonblocking();
 
     // construct a mikado
     auto mi = m::mikado_sm{conn, logging_cb};
 
-    // connect the mikado
-    mi.request_connect("test_client");
-    mi.process_packet(recv_packet(conn));
-    assert(mi.state() == m::state_t::connected);
-    LOG << "Connected" << endl;
+    Event_loop loop{[](Socket_connection &, m::mikado_sm &) {
+            LOG << "Session closed" << endl;
+        }};
+    loop.add(conn, mi);
 
+    // connect and subscribe in one go, then wait for all acknowledgements
+    mi.request_connect("test_client", 5);
     mi.subscribe("/testtopic/#");
-    const auto sub_response = recv_packet(conn);
-    mi.process_packet(sub_response);
-    assert(mi.state() == m::state_t::connected);
-    LOG << "Subscribe successful" << endl;
-
-    constexpr std::chrono::duration<double> timeout{5};
-    auto last_read = std::chrono::system_clock::now();
-
-    while(true)
+    while (loop.size() > 0 && (mi.state() == m::state_t::connection_requested ||
+                               mi.state() == m::state_t::subscribe_requested))
     {
-
-        m::Packet_reader reader{conn, conn.recv_buf};
-        m::read_result ret;
-        auto now = std::chrono::system_clock::now();
-        do
-        {
-            now = std::chrono::system_clock::now();
-            if ((now - last_read) > timeout)
-            {
-                LOG << "No packet for " << timeout.count() << " seconds." << endl;
-                last_read = now;
-            }
-
-            ret = reader.read_packet();
-            std::this_thread::sleep_for(std::chrono::milliseconds(200));
-        }while (ret == m::read_result::more_to_read);
-
-        if (ret == m::read_result::success)
-        {
-            const auto p = reader.content();
-            LOG << "Packet complete. Packet is " << p.size() << " bytes." << endl;
-            mi.process_packet(p);
-            last_read = now;
-        }
-
-        if (ret == m::read_result::read_error)
-        {
-            LOG << "Caught read error. " << strerror(errno) << endl;
-            break;
-        }
+        loop.run_once();
     }
-    LOG << "Exited packet loop" << endl;
+    if (mi.state() != m::state_t::connected)
+    {
+        LOG << "Could not connect and subscribe" << endl;
+        return 1;
+    }
+    LOG << "Connected, subscribe successful" << endl;
 
-    LOG << "disconnecting" << endl;
-    mi.send_disconnect();
+    // dispatches packets as they arrive, until the session dies
+    loop.run();
+    LOG << "Exited packet loop" << endl;
 
     return 0;
 }
@@ -1,7 +1,7 @@
-#include <thread>
 #include <chrono>
 
 #include "mikado_util.h"
+#include "event_loop.h"
 #include "log.h"
 
 namespace m = mikado;
@@ -21,64 +21,45 @@ struct execution_context{
     Socket_connection conn{tcp_connect("localhost", "1883")};
     m::mikado_sm mi{conn, logging_cb};
 
+    Event_loop events{[](Socket_connection &, m::mikado_sm &) {
+            throw std::runtime_error("Session closed");
+        }};
+
+    static constexpr std::chrono::seconds keep_alive{5};
+
+    /// Run the event loop until the mikado leaves state s
+    void await(m::state_t s)
+    {
+        while (mi.state() == s)
+        {
+            events.run_once();
+        }
+    }
 
     void setup()
     {
         LOG << "Setup" << endl;
 
-        conn.sock.set_nonblocking();
-
-        mi.request_connect("logging_client");
-        const auto p = recv_packet(conn);
-        mi.process_packet(p);
-        if (mi.state() != m::state_t::connected)
-        {
-            throw std::runtime_error("Could not connect mikado");
-        }
+        events.add(conn, mi);
 
+        // pipelined, the SUBSCRIBE does not wait for the CONNACK
+        mi.request_connect("logging_client", keep_alive.count());
         mi.subscribe("#");
-        mi.process_packet(recv_packet(conn));
+        await(m::state_t::connection_requested);
+        await(m::state_t::subscribe_requested);
         if (mi.state() != m::state_t::connected)
         {
-            throw std::runtime_error("Could not subscribe mikado");
+            throw std::runtime_error("Could not connect and subscribe mikado");
         }
     }
 
-
-    m::Packet_reader reader{conn, conn.recv_buf};
-
-    static constexpr std::chrono::duration<double> timeout{5.0};
-
     void loop()
     {
-        static auto last_read = std::chrono::system_clock::now();
-
-        const auto ret = reader.read_packet();
-        const auto now = std::chrono::system_clock::now();
-
-        if (ret == m::read_result::success)
-        {
-            mi.process_packet(reader.content());
-            last_read = now;
-            reader.reset();
-        }
-        if (ret == m::read_result::read_error)
-        {
-            throw std::runtime_error("Read error");
-        }
-
-
-        if (now - last_read > timeout)
-        {
-            LOG << "No packet for " << timeout.count() << " seconds." << endl;
-            last_read = now;
-        }
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        events.run_once();
     }
 }; // Execution_context
 
-constexpr std::chrono::duration<double> execution_context::timeout;
+constexpr std::chrono::seconds execution_context::keep_alive;
 
 int main(int argc, char *argv[])
 {
@@ -0,0 +1,546 @@
+#include "uring_connection.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "log.h"
+
+namespace m = mikado;
+
+namespace
+{
+
+int io_uring_setup(unsigned entries, io_uring_params *p)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                                    flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+template <class T>
+T *at_offset(void *base, unsigned offset)
+{
+    return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+unsigned load_acquire(const unsigned *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void store_release(unsigned *p, unsigned v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+} // namespace
+
+std::unique_ptr<Uring> Uring::create(unsigned max_connections, size_t recv_buffer_size, unsigned entries)
+{
+    std::unique_ptr<Uring> u{new Uring};
+
+    io_uring_params p{};
+    u->ring_fd = io_uring_setup(entries, &p);
+    if (u->ring_fd < 0)
+    {
+        LOG << "io_uring not available: " << strerror(errno) << endl;
+        return nullptr;
+    }
+    u->sq_entries = p.sq_entries;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        u->sq_ring_size = u->cq_ring_size = std::max(u->sq_ring_size, u->cq_ring_size);
+    }
+
+    u->sq_ring = mmap(nullptr, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+    {
+        u->sq_ring = nullptr;
+        return nullptr;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        u->cq_ring = u->sq_ring;
+    }
+    else
+    {
+        u->cq_ring = mmap(nullptr, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+        {
+            u->cq_ring = nullptr;
+            return nullptr;
+        }
+    }
+
+    const auto sqes = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    u->sqes = static_cast<io_uring_sqe *>(sqes);
+
+    u->sq_head = at_offset<unsigned>(u->sq_ring, p.sq_off.head);
+    u->sq_tail = at_offset<unsigned>(u->sq_ring, p.sq_off.tail);
+    u->sq_mask = at_offset<unsigned>(u->sq_ring, p.sq_off.ring_mask);
+    u->sq_array = at_offset<unsigned>(u->sq_ring, p.sq_off.array);
+    u->cq_head = at_offset<unsigned>(u->cq_ring, p.cq_off.head);
+    u->cq_tail = at_offset<unsigned>(u->cq_ring, p.cq_off.tail);
+    u->cq_mask = at_offset<unsigned>(u->cq_ring, p.cq_off.ring_mask);
+    u->cqes = at_offset<io_uring_cqe>(u->cq_ring, p.cq_off.cqes);
+
+    // one registered region, a slice per connection
+    u->recv_slice_size = recv_buffer_size;
+    u->recv_region.resize(max_connections * recv_buffer_size);
+    iovec region{u->recv_region.data(), u->recv_region.size()};
+    if (io_uring_register(u->ring_fd, IORING_REGISTER_BUFFERS, &region, 1) < 0)
+    {
+        LOG << "Could not register receive buffers: " << strerror(errno) << endl;
+        return nullptr;
+    }
+    for (unsigned i = max_connections; i > 0; --i)
+    {
+        u->free_slices.push_back(i - 1);
+    }
+
+    return u;
+}
+
+Uring::~Uring()
+{
+    if (sqes)
+    {
+        munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+    }
+    if (cq_ring && cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring)
+    {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0)
+    {
+        close(ring_fd);
+    }
+}
+
+const std::vector<Uring_connection *> &Uring::run_once(bool wait)
+{
+    std::vector<Uring_connection *> retry;
+    retry.swap(stalled);
+    for (const auto conn : retry)
+    {
+        conn->resume();
+    }
+
+    enter(wait && reaped.empty() ? 1 : 0);
+    reap();
+
+    // hand out what was reaped, completions from now on collect for the
+    // next call
+    ready.swap(reaped);
+    reaped.clear();
+    return ready;
+}
+
+size_t Uring::enter_count() const
+{
+    return enters;
+}
+
+io_uring_sqe *Uring::get_sqe()
+{
+    auto tail = *sq_tail;
+    if (tail - load_acquire(sq_head) == sq_entries)
+    {
+        enter(0);
+        reap();
+        if (tail - load_acquire(sq_head) == sq_entries)
+        {
+            // still full, handing out an entry would overwrite one which
+            // was not submitted
+            return nullptr;
+        }
+    }
+
+    const auto index = tail & *sq_mask;
+    auto sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    store_release(sq_tail, tail + 1);
+    ++queued;
+    return sqe;
+}
+
+void Uring::enter(unsigned min_complete)
+{
+    if (queued == 0 && min_complete == 0)
+    {
+        return;
+    }
+
+    const auto r = io_uring_enter(ring_fd, queued, min_complete,
+                                  min_complete ? IORING_ENTER_GETEVENTS : 0);
+    ++enters;
+    if (r < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            LOG << "io_uring_enter failed: " << strerror(errno) << endl;
+        }
+        return;
+    }
+    queued -= static_cast<unsigned>(r);
+}
+
+void Uring::reap()
+{
+    auto head = *cq_head;
+    const auto tail = load_acquire(cq_tail);
+    while (head != tail)
+    {
+        const auto &cqe = cqes[head & *cq_mask];
+        const auto data = cqe.user_data;
+        const auto res = cqe.res;
+        ++head;
+        store_release(cq_head, head);
+
+        auto conn = reinterpret_cast<Uring_connection *>(data & ~uint64_t{3});
+        switch (data & 3)
+        {
+        case Uring_connection::op_recv:
+            conn->on_recv_complete(res);
+            reaped.push_back(conn);
+            break;
+        case Uring_connection::op_send:
+            conn->on_send_complete(res);
+            break;
+        default:
+            // cancel results carry no information we need
+            break;
+        }
+    }
+}
+
+void Uring::stall(Uring_connection *conn)
+{
+    if (std::find(stalled.begin(), stalled.end(), conn) == stalled.end())
+    {
+        stalled.push_back(conn);
+    }
+}
+
+void Uring::forget(Uring_connection *conn)
+{
+    stalled.erase(std::remove(stalled.begin(), stalled.end(), conn), stalled.end());
+    reaped.erase(std::remove(reaped.begin(), reaped.end(), conn), reaped.end());
+}
+
+m::buf_t Uring::acquire_slice()
+{
+    if (free_slices.empty())
+    {
+        return m::buf_t{};
+    }
+    const auto i = free_slices.back();
+    free_slices.pop_back();
+    return m::buf_t{recv_region.data() + i * recv_slice_size, recv_slice_size};
+}
+
+void Uring::release_slice(m::buf_t slice)
+{
+    if (slice.empty())
+    {
+        return;
+    }
+    free_slices.push_back(static_cast<unsigned>((slice.data() - recv_region.data()) / recv_slice_size));
+}
+
+Uring_connection::Uring_connection(my_socket &&_sock, Uring *_ring, size_t send_buffer_size) : sock{std::move(_sock)}, ring{_ring}
+{
+    for (auto &s : staging)
+    {
+        s.resize(send_buffer_size);
+    }
+
+    if (ring)
+    {
+        recv_slice = ring->acquire_slice();
+        if (!recv_slice.empty())
+        {
+            // The socket stays blocking: io_uring would hand back EAGAIN on
+            // a non-blocking one instead of waiting for data.
+            start_recv();
+            return;
+        }
+        LOG << "No receive slice left, falling back to plain socket calls" << endl;
+        ring = nullptr;
+    }
+    sock.set_nonblocking();
+}
+
+Uring_connection::~Uring_connection()
+{
+    if (!ring)
+    {
+        return;
+    }
+
+    if (send_stalled)
+    {
+        // never submitted, nothing to wait for
+        send_pending = send_stalled = false;
+    }
+
+    // completions refer to this, so wait until none is outstanding
+    for (const auto o : {op_recv, op_send})
+    {
+        if ((o == op_recv) ? recv_pending : send_pending)
+        {
+            auto sqe = ring->get_sqe();
+            while (sqe == nullptr)
+            {
+                ring->enter(1);
+                ring->reap();
+                sqe = ring->get_sqe();
+            }
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = user_data(o);
+            sqe->user_data = user_data(op_cancel);
+        }
+    }
+    while (recv_pending || send_pending)
+    {
+        ring->enter(1);
+        ring->reap();
+    }
+    ring->forget(this);
+    ring->release_slice(recv_slice);
+}
+
+m::buf_t Uring_connection::get_send_buf()
+{
+    auto &s = staging[filling];
+    return m::buf_t{s.data() + staged[filling], s.size() - staged[filling]};
+}
+
+int Uring_connection::send(m::cbuf_t msg)
+{
+    if (!ring)
+    {
+        // serialized into staging, the plain way sends it from there
+        return ::send(sock.s, msg.data(), msg.size_bytes(), MSG_NOSIGNAL);
+    }
+    if (send_failed)
+    {
+        return -1;
+    }
+
+    const auto free = get_send_buf();
+    if (msg.data() != free.data())
+    {
+        // not serialized in place, copy it behind the staged packets
+        if (msg.size() > free.size())
+        {
+            return -1;
+        }
+        m::copy(msg, free);
+    }
+    staged[filling] += msg.size();
+
+    if (!send_pending)
+    {
+        start_send();
+    }
+    return static_cast<int>(msg.size());
+}
+
+int Uring_connection::read(m::buf_t b)
+{
+    if (!ring)
+    {
+        const auto r = ::recv(sock.s, b.data(), b.size_bytes(), 0);
+        if (r > 0)
+        {
+            return static_cast<int>(r);
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        return -1;
+    }
+
+    if (recv_begin == recv_end)
+    {
+        if (recv_failed)
+        {
+            return -1;
+        }
+        if (!recv_pending)
+        {
+            start_recv();
+        }
+        return 0;
+    }
+
+    const auto n = m::copy(recv_slice.begin() + recv_begin, recv_slice.begin() + recv_end,
+                           b.begin(), b.end());
+    recv_begin += n;
+    if (recv_begin == recv_end)
+    {
+        // all handed out, the slice can take the next receive
+        recv_begin = recv_end = 0;
+        start_recv();
+    }
+    return static_cast<int>(n);
+}
+
+bool Uring_connection::readable() const
+{
+    return recv_begin != recv_end || recv_failed;
+}
+
+void Uring_connection::start_recv()
+{
+    if (recv_pending || recv_failed)
+    {
+        return;
+    }
+
+    auto sqe = ring->get_sqe();
+    if (sqe == nullptr)
+    {
+        ring->stall(this);
+        return;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = sock.s;
+    sqe->addr = reinterpret_cast<uintptr_t>(recv_slice.data());
+    sqe->len = static_cast<unsigned>(recv_slice.size());
+    sqe->buf_index = 0;
+    sqe->user_data = user_data(op_recv);
+    recv_pending = true;
+}
+
+void Uring_connection::start_send()
+{
+    if (staged[filling] == 0)
+    {
+        return;
+    }
+
+    // switch buffers, packets staged from now on go with the next write
+    filling ^= 1;
+    written = 0;
+    queue_send();
+}
+
+void Uring_connection::queue_send()
+{
+    const auto writing = filling ^ 1;
+    send_pending = true;
+
+    auto sqe = ring->get_sqe();
+    if (sqe == nullptr)
+    {
+        send_stalled = true;
+        ring->stall(this);
+        return;
+    }
+    send_stalled = false;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock.s;
+    sqe->addr = reinterpret_cast<uintptr_t>(staging[writing].data() + written);
+    sqe->len = static_cast<unsigned>(staged[writing] - written);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data(op_send);
+}
+
+void Uring_connection::resume()
+{
+    if (recv_begin == recv_end)
+    {
+        start_recv();
+    }
+    if (send_stalled)
+    {
+        queue_send();
+    }
+}
+
+void Uring_connection::on_recv_complete(int res)
+{
+    recv_pending = false;
+    if (res <= 0)
+    {
+        if (res == -EAGAIN || res == -EINTR)
+        {
+            start_recv();
+            return;
+        }
+        // 0 is an orderly shutdown by the peer
+        recv_failed = true;
+        return;
+    }
+    recv_begin = 0;
+    recv_end = static_cast<size_t>(res);
+}
+
+void Uring_connection::on_send_complete(int res)
+{
+    send_pending = false;
+    const auto writing = filling ^ 1;
+    if (res < 0)
+    {
+        if (res == -EAGAIN || res == -EINTR)
+        {
+            res = 0;
+        }
+        else
+        {
+            send_failed = true;
+            return;
+        }
+    }
+
+    written += static_cast<size_t>(res);
+    if (written < staged[writing])
+    {
+        // partial write, queue the remainder
+        queue_send();
+        return;
+    }
+
+    staged[writing] = 0;
+    start_send();
+}
+
+uint64_t Uring_connection::user_data(op o) const
+{
+    return reinterpret_cast<uintptr_t>(this) | o;
+}
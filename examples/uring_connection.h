@@ -0,0 +1,171 @@
+#ifndef URING_CONNECTION_H
+#define URING_CONNECTION_H
+
+#include <linux/io_uring.h>
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include "mikado.h"
+#include "net_util.h"
+
+class Uring_connection;
+
+/// An io_uring instance shared by many Uring_connections. Linux only.
+///
+/// Connections only queue their operations. run_once() submits everything
+/// queued across all connections with a single io_uring_enter() and
+/// dispatches the completions, so at high fan-in many PUBLISH writes and
+/// receives share one syscall.
+///
+/// Receives go into one region registered with the kernel
+/// (IORING_REGISTER_BUFFERS), cut into a slice per connection, which saves
+/// the kernel mapping the pages on every read.
+class Uring
+{
+public:
+    /// Returns nullptr if io_uring is not available, e.g. on old kernels,
+    /// when disabled by sysctl or seccomp, or if the receive region cannot be
+    /// registered. Uring_connection falls back to plain recv()/send() then.
+    static std::unique_ptr<Uring> create(unsigned max_connections,
+                                         size_t recv_buffer_size = 64 * 1024,
+                                         unsigned entries = 256);
+    ~Uring();
+
+    Uring(const Uring &) = delete;
+    void operator=(const Uring &) = delete;
+
+    /// Submit all queued operations and handle completions. If wait is
+    /// set, block until at least one operation completed, unless some
+    /// completed already.
+    /// Returns the connections which have received data or failed since
+    /// the last call, including completions handled in between, e.g. when
+    /// the submission queue ran full. The list stays valid until the next
+    /// call, sending while iterating it is fine.
+    const std::vector<Uring_connection *> &run_once(bool wait);
+
+    /// Number of io_uring_enter() calls so far
+    size_t enter_count() const;
+
+private:
+    friend class Uring_connection;
+
+    Uring() = default;
+
+    int ring_fd = -1;
+    unsigned sq_entries = 0;
+
+    // mapped ring memory
+    void *sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void *cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    unsigned queued = 0;
+    size_t enters = 0;
+
+    // registered receive region
+    std::vector<mikado::byte> recv_region;
+    size_t recv_slice_size = 0;
+    std::vector<unsigned> free_slices;
+
+    /// returned by run_once()
+    std::vector<Uring_connection *> ready;
+    /// readiness reaped since, reported by the next run_once()
+    std::vector<Uring_connection *> reaped;
+    /// connections which found the submission queue full, run_once()
+    /// queues their operations again
+    std::vector<Uring_connection *> stalled;
+
+    /// Next free submission queue entry, submitting queued ones if full.
+    /// nullptr if the kernel did not take any of them, e.g. with EBUSY
+    /// while its completion queue is full.
+    io_uring_sqe *get_sqe();
+    void enter(unsigned min_complete);
+    void reap();
+
+    void stall(Uring_connection *);
+    /// Drop a connection going away from the lists above
+    void forget(Uring_connection *);
+
+    mikado::buf_t acquire_slice();
+    void release_slice(mikado::buf_t);
+};
+
+/// Connection on a socket, driven by a Uring. Without a Uring (nullptr), it
+/// makes the socket non-blocking and does plain recv()/send() on it.
+///
+/// Data may remain buffered after a read(), so keep reading while
+/// readable() or until read() returns 0.
+///
+/// Outbound packets are serialized directly into a staging buffer returned
+/// by get_send_buf(). send() only queues them; while one write is in flight,
+/// further packets collect in a second staging buffer and go out together
+/// with the next write.
+///
+/// Note that get_send_buf() moves on as packets are staged, so this does not
+/// combine with mikado_sm::set_batching(), which it makes redundant anyway.
+class Uring_connection : public mikado::Connection, public mikado::Packet_reader::Receiving_Connection
+{
+public:
+    Uring_connection(my_socket &&_sock, Uring *_ring, size_t send_buffer_size = 64 * 1024);
+    ~Uring_connection();
+
+    Uring_connection(const Uring_connection &) = delete;
+    void operator=(const Uring_connection &) = delete;
+
+    virtual mikado::buf_t get_send_buf() override;
+    virtual int send(mikado::cbuf_t msg) override;
+    virtual int read(mikado::buf_t b) override;
+
+    /// Received data or an error is waiting to be read()
+    bool readable() const;
+
+    my_socket sock;
+
+private:
+    friend class Uring;
+
+    Uring *ring;
+
+    // receive state, recv_slice is ours in the registered region
+    mikado::buf_t recv_slice;
+    size_t recv_begin = 0, recv_end = 0;
+    bool recv_pending = false;
+    bool recv_failed = false;
+
+    // two staging buffers, one being filled, one being written
+    std::array<std::vector<mikado::byte>, 2> staging;
+    std::array<size_t, 2> staged{{0, 0}};
+    unsigned filling = 0;
+    size_t written = 0;
+    bool send_pending = false;
+    /// the write is pending, but could not be queued yet
+    bool send_stalled = false;
+    bool send_failed = false;
+
+    void start_recv();
+    void start_send();
+    /// Queue writing the rest of the buffer being written
+    void queue_send();
+    /// Queue the operations which found the submission queue full
+    void resume();
+    void on_recv_complete(int res);
+    void on_send_complete(int res);
+
+    enum op : uintptr_t
+    {
+        op_recv = 0,
+        op_send = 1,
+        op_cancel = 2
+    };
+    uint64_t user_data(op) const;
+};
+
+#endif // URING_CONNECTION_H
@@ -0,0 +1,75 @@
+#ifndef MIKADO_FUNCTION_REF_H
+#define MIKADO_FUNCTION_REF_H
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace mikado
+{
+
+template <class Signature>
+class function_ref;
+
+/// Non-owning reference to a callable, the counterpart of std::function
+/// that never allocates: it holds a pointer to the callable and one to a
+/// function invoking it. Cheap to copy and to assign.
+///
+/// The callable is not copied, it must outlive the function_ref. Binding
+/// a temporary, e.g. a lambda written in the call to a function storing the
+/// function_ref, leaves it dangling.
+template <class R, class... Args>
+class function_ref<R(Args...)>
+{
+public:
+    function_ref() = default;
+
+    template <class F, class = typename std::enable_if<
+                           !std::is_same<typename std::decay<F>::type, function_ref>::value &&
+                           !std::is_function<typename std::remove_reference<F>::type>::value &&
+                           !std::is_pointer<typename std::decay<F>::type>::value>::type>
+    function_ref(F &&f) : invoke{&call_object<typename std::remove_reference<F>::type>}
+    {
+        target.object = const_cast<void *>(static_cast<const void *>(std::addressof(f)));
+    }
+
+    function_ref(R (*f)(Args...)) : invoke{&call_function}
+    {
+        target.function = f;
+    }
+
+    R operator()(Args... args) const
+    {
+        return invoke(target, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const
+    {
+        return invoke != nullptr;
+    }
+
+private:
+    union storage
+    {
+        void *object;
+        R (*function)(Args...);
+    };
+
+    template <class F>
+    static R call_object(storage s, Args... args)
+    {
+        return (*static_cast<F *>(s.object))(std::forward<Args>(args)...);
+    }
+
+    static R call_function(storage s, Args... args)
+    {
+        return s.function(std::forward<Args>(args)...);
+    }
+
+    storage target{nullptr};
+    R (*invoke)(storage, Args...) = nullptr;
+};
+
+} // namespace mikado
+
+#endif // MIKADO_FUNCTION_REF_H
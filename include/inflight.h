@@ -0,0 +1,101 @@
+#ifndef MIKADO_INFLIGHT_H
+#define MIKADO_INFLIGHT_H
+
+#include <vector>
+
+#include <gsl-lite/gsl-lite.hpp>
+
+#include <utils.h>
+
+namespace mikado
+{
+
+/// Allocator for packet identifiers (1-65535), one bit per identifier.
+///
+/// The bitmap takes 8 KiB and is allocated on first use, so clients which
+/// never need identifiers do not pay for it.
+class packet_ids
+{
+public:
+    /// Take any free identifier. Returns 0 if all are in use.
+    uint16_t acquire();
+
+    /// Take a specific identifier. Returns false if it is in use.
+    bool acquire(uint16_t id);
+
+    void release(uint16_t id);
+
+    bool in_use(uint16_t id) const;
+
+    /// Number of identifiers in use
+    size_t size() const;
+
+private:
+    void allocate();
+
+    std::vector<uint64_t> used;
+    /// word to start the search for a free identifier at
+    size_t cursor = 0;
+    size_t count = 0;
+};
+
+/// Outgoing messages waiting for their acknowledgement, kept as serialized
+/// packets in one preallocated arena of fixed size slots.
+///
+/// Identifiers are assigned so the slot of a message follows from its
+/// identifier, hence an acknowledgement releases a slot in O(1). Free slots
+/// are tracked by a bitmap.
+class inflight_store
+{
+public:
+    struct slot
+    {
+        uint16_t packet_identifier = 0;
+        /// order of acquisition, to resend in the original order
+        uint32_t sequence = 0;
+        /// QoS 2: PUBREC arrived, packet holds the PUBREL now
+        bool released = false;
+        /// the stored packet, a part of the arena
+        gsl::span<byte> packet;
+    };
+
+    /// Drop all messages and preallocate window slots of max_packet_size
+    /// bytes each. Identifiers of messages dropped are released to ids.
+    void reserve(size_t window, size_t max_packet_size, packet_ids &ids);
+
+    /// Maximum number of messages in flight
+    size_t capacity() const;
+    /// Number of messages in flight
+    size_t size() const;
+    bool full() const;
+
+    /// Claim a slot and an identifier for it from ids. slot::packet spans the
+    /// whole slot, shrink it to the packet stored. Returns nullptr if all
+    /// slots are in use or no suitable identifier is free.
+    slot *acquire(packet_ids &ids);
+
+    /// The slot of the message with packet_identifier, or nullptr if there
+    /// is none in flight.
+    slot *find(uint16_t packet_identifier);
+
+    /// Release the slot of packet_identifier and the identifier.
+    /// Returns false if no message with it is in flight.
+    bool release(uint16_t packet_identifier, packet_ids &ids);
+
+    /// Messages in flight in the order they were acquired
+    std::vector<slot *> in_order();
+
+private:
+    std::vector<byte> arena;
+    std::vector<slot> slots;
+    /// per slot, the generation of identifiers it hands out next
+    std::vector<uint16_t> rounds;
+    std::vector<uint64_t> free_slots;
+    size_t slot_size = 0;
+    size_t used = 0;
+    uint32_t next_sequence = 0;
+};
+
+} // namespace mikado
+
+#endif // MIKADO_INFLIGHT_H
@@ -0,0 +1,170 @@
+#ifndef MIKADO_METRICS_H
+#define MIKADO_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <utils.h>
+
+/// Instrumentation is compiled in unless MIKADO_METRICS is defined as 0.
+/// Without it, set_metrics() is accepted and nothing is counted.
+#ifndef MIKADO_METRICS
+#define MIKADO_METRICS 1
+#endif
+
+namespace mikado
+{
+
+/// Counter values of a metrics at one point in time
+struct metrics_snapshot
+{
+    /// Packets by type, indexed by the high nibble of their first byte,
+    /// e.g. packets_in[packet_type::publish >> 4]
+    std::array<uint64_t, 16> packets_in{};
+    std::array<uint64_t, 16> packets_out{};
+    uint64_t bytes_in = 0;
+    /// Bytes of packets handed to the connection, batched ones included
+    uint64_t bytes_out = 0;
+
+    /// PUBLISH and SUBACK callbacks, and the time spent in them
+    uint64_t callbacks = 0;
+    std::chrono::nanoseconds callback_time{};
+
+    /// Connection::read() calls of the readers, and the packets they yielded
+    uint64_t reads = 0;
+    uint64_t packets_read = 0;
+    /// Readers failing on a broken connection, oversized or malformed packet
+    uint64_t read_errors = 0;
+
+    /// Transitions of the session into session_t::error, from a protocol
+    /// error or a keep-alive timeout
+    uint64_t errors = 0;
+
+    uint64_t packets_total_in() const;
+    uint64_t packets_total_out() const;
+    /// Connection::read() calls per packet, 0 if no packet was read
+    double reads_per_packet() const;
+};
+
+/// Counters of what a mikado_sm and its reader went through.
+///
+/// Attach one with set_metrics() to any number of mikado_sm, Packet_reader
+/// and Batch_reader. Counters are relaxed atomics: cheap enough to stay on
+/// in production, and snapshot() may be called from any thread while they
+/// count. A snapshot is consistent per counter, not across counters.
+class metrics
+{
+public:
+    metrics() = default;
+    metrics(const metrics &) = delete;
+    void operator=(const metrics &) = delete;
+
+    metrics_snapshot snapshot() const;
+    void reset();
+
+    void packet_in(byte first_byte, size_t size)
+    {
+        add(packets_in[first_byte >> 4], 1);
+        add(bytes_in, size);
+    }
+
+    void packet_out(byte first_byte, size_t size)
+    {
+        add(packets_out[first_byte >> 4], 1);
+        add(bytes_out, size);
+    }
+
+    void callback(std::chrono::steady_clock::duration d)
+    {
+        add(callbacks, 1);
+        add(callback_ns, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+    }
+
+    void read()
+    {
+        add(reads, 1);
+    }
+
+    void packet_read()
+    {
+        add(packets_read, 1);
+    }
+
+    void read_error()
+    {
+        add(read_errors, 1);
+    }
+
+    void error()
+    {
+        add(errors, 1);
+    }
+
+    /// Times a callback from construction to destruction, if m is set
+    class callback_scope
+    {
+    public:
+        explicit callback_scope(metrics *_m) : m{_m}
+        {
+#if MIKADO_METRICS
+            if (m != nullptr)
+            {
+                start = std::chrono::steady_clock::now();
+            }
+#endif
+        }
+
+        ~callback_scope()
+        {
+#if MIKADO_METRICS
+            if (m != nullptr)
+            {
+                m->callback(std::chrono::steady_clock::now() - start);
+            }
+#endif
+        }
+
+    private:
+        metrics *m;
+        std::chrono::steady_clock::time_point start{};
+    };
+
+private:
+    typedef std::atomic<uint64_t> counter;
+
+    std::array<counter, 16> packets_in{};
+    std::array<counter, 16> packets_out{};
+    counter bytes_in{0}, bytes_out{0};
+    counter callbacks{0}, callback_ns{0};
+    counter reads{0}, packets_read{0}, read_errors{0};
+    counter errors{0};
+
+    static void add(counter &c, uint64_t n)
+    {
+        c.fetch_add(n, std::memory_order_relaxed);
+    }
+};
+
+} // namespace mikado
+
+/// Count on metrics pointer m, if attached: MIKADO_COUNT(m, read()).
+/// Expands to nothing with MIKADO_METRICS 0.
+#if MIKADO_METRICS
+#define MIKADO_COUNT(m, call) \
+    do                        \
+    {                         \
+        if ((m) != nullptr)   \
+        {                     \
+            (m)->call;        \
+        }                     \
+    } while (0)
+#else
+#define MIKADO_COUNT(m, call) \
+    do                        \
+    {                         \
+    } while (0)
+#endif
+
+#endif // MIKADO_METRICS_H
@@ -3,14 +3,29 @@
 
 #include <gsl-lite/gsl-lite.hpp>
 
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <function_ref.h>
+#include <inflight.h>
+#include <metrics.h>
 #include <packets.h>
+#include <router.h>
+#include <timer_wheel.h>
+#include <topic_table.h>
+#include <tracing.h>
 #include <utils.h>
+#include <vbi.h>
 
 namespace mikado
 {
     typedef gsl::span<const byte> cbuf_t;
     typedef gsl::span<byte> buf_t;
 
+    /// Combined view of session and outstanding requests, see
+    /// mikado_sm::state()
     enum class state_t
     {
         disconnected,
@@ -21,6 +36,16 @@ namespace mikado
         error
     };
 
+    /// State of the MQTT session itself, independent of requests awaiting
+    /// an answer
+    enum class session_t
+    {
+        disconnected,
+        connection_requested,
+        connected,
+        error
+    };
+
     enum class receiver_state
     {
         init,
@@ -39,11 +64,13 @@ namespace mikado
     /// start is the start of the parsed packet
     /// cursor is the position for the next byte to read
     /// read_until is how far to read in the next step. This is the end of the
-    /// fixed heard (2 bytes) until msg_incomplete, where it becomes the end of
-    /// the message.
+    /// fixed header until msg_incomplete, where it becomes the end of the
+    /// message. The remaining length in the fixed header is a variable byte
+    /// integer of 1-4 bytes, so while in got_type, read_until advances one
+    /// byte at a time until the last length byte is seen.
     ///
     /// We do not keep a separate marker for the beginning of the mqtt variable
-    /// header, as it is always start+2.
+    /// header, the packet parsers find it by decoding the fixed header again.
     /// Payload start (as beginning of packet payload) belongs into packet parser
     /// (part of mikado_sm), if ever needed.
     class receiver
@@ -58,6 +85,9 @@ namespace mikado
         receiver_state state() const;
         void advance();
         void advance(size_t count);
+
+        /// Lex all bytes up to target. Header bytes are consumed one by one,
+        /// the body is skipped in a single step once its length is known.
         void advance_until(cbuf_t::iterator);
 
         // Parse result
@@ -77,6 +107,7 @@ namespace mikado
         // just a shorthand for buf.begin()
         const cbuf_t::const_iterator start;
         cbuf_t::const_iterator cursor, read_until;
+        vbi_decoder remaining_length;
 
         void consume_byte(byte b);
     }; // class receiver
@@ -88,24 +119,34 @@ namespace mikado
         read_error
     };
 
+    /// Transport the readers read from
+    struct Receiving_Connection
+    {
+        // read should return a tri-state:
+        // - on success, the number of bytes read
+        // - 0 - when no data is available (i.e. timeout)
+        // - < 0 - on error
+        //
+        // by shifting this to the read() function, we can be ignorant of
+        // the error handling of the underlying system.
+        virtual int read(buf_t) = 0;
+    };
+
     /// Logic to drive a receiver with incremental reading.
-    class Packet_reader
+    ///
+    /// Conn is anything with a read() like Receiving_Connection. With a
+    /// concrete transport type, reads are bound at compile time and may be
+    /// inlined. Packet_reader is the instantiation for the virtual
+    /// Receiving_Connection.
+    template <class Conn>
+    class basic_packet_reader
     {
     public:
-        struct Receiving_Connection
-        {
-            // read should return a tri-state:
-            // - on success, the number of bytes read
-            // - 0 - when no data is available (i.e. timeout)
-            // - < 0 - on error
-            //
-            // by shifting this to the read() function, we can be ignorant of
-            // the error handling of the underlying system.
-            virtual int read(buf_t) = 0;
-        };
-
-        Packet_reader(Receiving_Connection &_conn, buf_t _read_buffer) : conn(_conn), read_buffer{_read_buffer}, cursor{read_buffer.begin()},
-                                                                         rec(read_buffer)
+        /// Transports derive from Packet_reader::Receiving_Connection
+        typedef mikado::Receiving_Connection Receiving_Connection;
+
+        basic_packet_reader(Conn &_conn, buf_t _read_buffer) : conn(_conn), read_buffer{_read_buffer}, cursor{read_buffer.begin()},
+                                                               rec(read_buffer)
         {
         }
 
@@ -114,13 +155,91 @@ namespace mikado
 
         void reset();
 
+        /// Count reads and packets read on m, nullptr stops counting
+        void set_metrics(metrics *m);
+        /// Note on t when a packet is read completely
+        void set_tracer(tracer *t);
+
     private:
-        Receiving_Connection &conn;
+        Conn &conn;
         buf_t read_buffer;
         buf_t::iterator cursor;
         receiver rec;
+        metrics *m_metrics = nullptr;
+        tracer *m_tracer = nullptr;
     };
 
+    typedef basic_packet_reader<Receiving_Connection> Packet_reader;
+
+    /// Reads as much as the connection has available and yields every
+    /// complete packet from it, so a single read() can deliver many packets.
+    ///
+    /// Unconsumed data lives in read_buffer between head (start of the first
+    /// packet not yet yielded) and tail (end of the data read so far). A
+    /// partial packet at the tail stays in place while there is space behind
+    /// it. Only when tail hits the end of the buffer, the partial packet is
+    /// moved to the front.
+    ///
+    /// Packets returned by next() point into read_buffer and stay valid until
+    /// the next call to fill().
+    ///
+    /// Conn as in basic_packet_reader, Batch_reader reads from a
+    /// Receiving_Connection.
+    template <class Conn>
+    class basic_batch_reader
+    {
+    public:
+        basic_batch_reader(Conn &_conn, buf_t _read_buffer) : conn(_conn), read_buffer{_read_buffer},
+                                                              head{read_buffer.begin()}, tail{head}
+        {
+        }
+
+        /// Read once, as much as fits behind the buffered data.
+        /// Returns more_to_read if no data was available, read_error if the
+        /// connection failed or a packet does not fit into the buffer.
+        read_result fill();
+
+        /// Yield the next complete packet buffered. Returns more_to_read if
+        /// the buffer holds no complete packet, read_error on malformed data.
+        read_result next(cbuf_t &packet);
+
+        /// fill() once and pass every complete packet to f.
+        template <class F>
+        read_result drain(F f)
+        {
+            const auto r = fill();
+            if (r == read_result::read_error)
+            {
+                return r;
+            }
+
+            cbuf_t packet;
+            read_result n;
+            while ((n = next(packet)) == read_result::success)
+            {
+                f(packet);
+            }
+            return n;
+        }
+
+        void reset();
+
+        /// Count reads and packets read on m, nullptr stops counting
+        void set_metrics(metrics *m);
+        /// Note on t when a read brings data, the packets it completes
+        /// are yielded after it
+        void set_tracer(tracer *t);
+
+    private:
+        Conn &conn;
+        buf_t read_buffer;
+        buf_t::iterator head, tail;
+        metrics *m_metrics = nullptr;
+        tracer *m_tracer = nullptr;
+    };
+
+    typedef basic_batch_reader<Receiving_Connection> Batch_reader;
+
     class Connection
     {
     public:
@@ -132,9 +251,65 @@ namespace mikado
         virtual buf_t get_send_buf() = 0;
 
         virtual int send(cbuf_t) = 0;
+
+        /// Send a packet given as two segments, head and tail, as if they
+        /// were one contiguous buffer. This allows sending a payload directly
+        /// from the caller's memory.
+        ///
+        /// The default implementation is send_copied(). Transports capable
+        /// of gather I/O should override it to avoid the copy.
+        virtual int send_vectored(cbuf_t head, cbuf_t tail);
     };
 
+    /// send_vectored() for transports without gather I/O: copy tail behind
+    /// head in conn's send buffer and send() both at once.
+    template <class Conn>
+    int send_copied(Conn &conn, cbuf_t head, cbuf_t tail);
+
     typedef std::function<void(cbuf_t topic, cbuf_t payload)> callback_t;
+    /// Non-owning callback, see mikado_sm::set_callback_ref()
+    typedef function_ref<void(cbuf_t topic, cbuf_t payload)> callback_ref;
+    typedef std::function<void(const suback::Packet &)> suback_callback_t;
+
+    /// Source of monotonic time for the time based parts of mikado_sm.
+    ///
+    /// Pluggable, so tests can control time and platforms can provide their
+    /// own tick source.
+    struct Clock
+    {
+        typedef std::chrono::steady_clock::duration duration;
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        virtual time_point now() = 0;
+    };
+
+    struct Steady_clock : public Clock
+    {
+        virtual time_point now() override;
+    };
+
+    /// The Steady_clock mikado_sm uses unless set_clock() is called
+    Clock &default_clock();
+
+    /// Counters on how well publish batching works
+    struct batch_stats
+    {
+        size_t flushes = 0;
+        size_t packets = 0;
+        size_t bytes = 0;
+        size_t max_packets_per_flush = 0;
+    };
+
+    /// Counters on keep-alive pings
+    struct keep_alive_stats
+    {
+        size_t pings = 0;
+        size_t pongs = 0;
+        /// pings which got no PINGRESP in time
+        size_t timeouts = 0;
+        Clock::duration last_rtt{};
+        Clock::duration max_rtt{};
+    };
 
     /// MQTT state machine.
     ///
@@ -143,48 +318,238 @@ namespace mikado
     ///
     /// Has two ways of causing actions: when a packet is to be sent, it will do it
     /// by conn.send(). When a publish() packet is processed, it will call the
-    /// callback cb.
-    class mikado_sm
+    /// handlers routed for its topic, or the callback cb if there are none.
+    ///
+    /// Conn is the transport, anything with get_send_buf(), send() and
+    /// send_vectored() like Connection. With a concrete transport type, the
+    /// compiler sees through the whole serialize and send path. mikado_sm is
+    /// the instantiation for the virtual Connection. For other transports,
+    /// include mikado_impl.h.
+    template <class Conn>
+    class basic_mikado_sm
     {
     public:
-        mikado_sm(
-            Connection &, callback_t = [](cbuf_t, cbuf_t) {});
+        basic_mikado_sm(
+            Conn &, callback_t = [](cbuf_t, cbuf_t) {});
+
+        /// Connect with keep_alive in seconds, 0 disables it. With keep-alive,
+        /// poll() sends a PINGREQ when nothing was sent for keep_alive, and
+        /// puts the session into error when its PINGRESP does not arrive
+        /// within the ping timeout.
+        ///
+        /// Returns false if the CONNECT does not fit the send buffer.
+        bool request_connect(string_ref clientID, uint16_t keep_alive = 0);
 
-        void request_connect(const std::string &clientID);
-        void subscribe(const std::string topic);
-        void publish(const std::string &topic, const std::string &payload,
-                     bool retain = false);
-        void publish(cbuf_t topic, cbuf_t payload,
-                     bool retain = false);
+        /// Subscribe to topic filter. May be called right after
+        /// request_connect(), without waiting for the CONNACK, and several
+        /// times in a row: state() is subscribe_requested until all SUBACKs
+        /// arrived, so startup costs about one round trip.
+        ///
+        /// Returns the packet identifier of the SUBSCRIBE, which its SUBACK
+        /// passed to the suback callback carries, or 0 if nothing was sent.
+        uint16_t subscribe(string_ref topic);
+
+        /// Subscribe to all topics with a single SUBACK, returning one code
+        /// per filter.
+        uint16_t subscribe(gsl::span<const string_ref> topics);
+        /// Compatibility, allocates a string_ref per topic
+        uint16_t subscribe(const std::vector<std::string> &topics);
+
+        /// Subscribe to topic filter and route matching PUBLISH messages to
+        /// handler. The handler is not added if the subscription fails.
+        uint16_t subscribe(string_ref topic, callback_t handler);
+
+        /// Publish with QoS 0, 1 or 2. QoS 1 and 2 messages are kept until
+        /// their PUBACK or PUBCOMP arrives, up to the in-flight window set by
+        /// set_inflight_window(). After the next CONNACK, unacknowledged
+        /// messages are sent again with DUP set, released QoS 2 messages
+        /// get their PUBREL again.
+        ///
+        /// Returns false if the message could not be sent: it does not fit
+        /// the send buffer or a window slot, the window is full or QoS is
+        /// invalid.
+        bool publish(string_ref topic, string_ref payload,
+                     bool retain = false, uint8_t QoS = 0);
+        bool publish(cbuf_t topic, cbuf_t payload,
+                     bool retain = false, uint8_t QoS = 0);
 
         void process_packet(cbuf_t packet);
-        void send_ping();
-        void send_disconnect();
+        /// Both return false if the packet does not fit the send buffer.
+        bool send_ping();
+        bool send_disconnect();
+
+        /// Collect published packets in the send buffer and send them with a
+        /// single conn.send(). A batch is sent when flush() is called, when
+        /// the next packet would exceed max_bytes, or on publish() or poll()
+        /// once its first packet waited for max_delay. Other packets flush
+        /// the batch before they are sent, so ordering is kept.
+        ///
+        /// Requires get_send_buf() to return the same buffer on each call.
+        /// max_bytes is capped to its size. 0 disables batching.
+        void set_batching(size_t max_bytes, Clock::duration max_delay);
+        void flush();
+        const batch_stats &batching_stats() const;
+
+        /// Do time based work: flush a batch which waited long enough, send
+        /// keep-alive pings and detect missing PINGRESPs. To be called
+        /// regularly by the event loop, at the latest at next_deadline().
+        void poll();
+
+        /// When poll() has work to do next, time_point::max() if nothing is
+        /// scheduled.
+        Clock::time_point next_deadline() const;
+
+        /// Have wheel call poll() at next_deadline(), followed by on_expiry,
+        /// instead of polling each mikado_sm in the event loop. The timer is
+        /// moved only when the deadline gets earlier. A later one, as with
+        /// every packet sent pushing the keep-alive back, costs one early
+        /// poll() instead of a reschedule per packet.
+        ///
+        /// nullptr detaches from the wheel. While attached, the mikado_sm
+        /// must not be moved.
+        void set_timer_wheel(timer_wheel *wheel, std::function<void()> on_expiry = nullptr);
+
+        /// How long to wait for a PINGRESP. 0, the default, waits for the
+        /// keep-alive interval.
+        void set_ping_timeout(Clock::duration);
+        const keep_alive_stats &keep_alive_statistics() const;
+
+        /// Allow up to window QoS 1 and 2 messages of up to max_packet_size
+        /// bytes each awaiting acknowledgement. Storage is allocated here,
+        /// once. Returns false while messages are in flight.
+        bool set_inflight_window(size_t window, size_t max_packet_size);
+        /// Number of QoS 1 and 2 messages awaiting acknowledgement
+        size_t inflight() const;
 
         void set_callback(callback_t);
+        /// Call handler for PUBLISH messages not otherwise routed, instead of
+        /// the callback. handler is referenced, not copied: nothing is
+        /// allocated, and it must outlive the mikado_sm or the next call to
+        /// set_callback() or set_callback_ref().
+        void set_callback_ref(callback_ref handler);
+
+        /// Called for each SUBACK, with the return code of every filter.
+        /// Refused filters do not end the session.
+        void set_suback_callback(suback_callback_t);
+        void set_clock(Clock &);
+
+        /// Count packets and bytes in and out, callbacks and errors on m,
+        /// which must outlive the mikado_sm or the next call. nullptr stops
+        /// counting.
+        void set_metrics(metrics *m);
+        /// Record latencies of PUBLISH messages up to their callback on t,
+        /// which must outlive the mikado_sm or the next call. Attach the
+        /// reader feeding process_packet() to the same tracer.
+        void set_tracer(tracer *t);
+
+        /// Handlers for PUBLISH messages by topic filter. Messages matching
+        /// no filter go to the callback.
+        router &routes();
+
+        /// Dispatch PUBLISH messages whose topic is in index to
+        /// handlers[i], i being the topic's position in index. Checked
+        /// before routes() and the callback, at the cost of one hash and one
+        /// compare per message. index and handlers are not copied and must
+        /// outlive the mikado_sm or the next call. Returns false if their
+        /// sizes differ.
+        bool set_topic_handlers(topic_index index, gsl::span<const callback_t> handlers);
 
         void reset();
 
+        /// Compatibility view: while connected, subscribe_requested if
+        /// SUBACKs are pending, else ping_await if a PINGRESP is pending.
+        /// Neither blocks the processing of other packets.
         state_t state() const;
 
+        session_t session() const;
+        /// Number of SUBSCRIBEs awaiting their SUBACK
+        size_t pending_subscribes() const;
+        /// Whether a PINGREQ awaits its PINGRESP
+        bool ping_pending() const;
+
     private:
-        Connection &conn;
+        Conn &conn;
         callback_t cb; // publish callback
+        /// takes precedence over cb if set
+        callback_ref m_cb_ref;
+        suback_callback_t suback_cb;
+        router m_routes;
+        topic_index m_topics;
+        gsl::span<const callback_t> m_topic_handlers;
+        Clock *clock;
+        metrics *m_metrics = nullptr;
+        tracer *m_tracer = nullptr;
+
+        session_t m_session = session_t::disconnected;
+
+        // requests outstanding
+        /// identifiers of SUBSCRIBEs sent and not yet acknowledged
+        std::vector<uint16_t> m_pending_subscribes;
+        bool ping_outstanding = false;
+
+        struct
+        {
+            size_t max_bytes = 0;
+            Clock::duration max_delay{};
 
-        buf_t send_buf;
-        state_t m_state = state_t::disconnected;
+            size_t size = 0;
+            size_t packets = 0;
+            Clock::time_point started{};
+        } batch;
+        batch_stats m_batch_stats;
 
-        // we implement the state machine by having functions for each state we're in
-        // they will parse incoming packets and change the state machine state accordingly
+        struct
+        {
+            Clock::duration interval{};
+            Clock::duration timeout{};
+
+            Clock::time_point last_sent{};
+            Clock::time_point ping_sent{};
+        } keepalive;
+        keep_alive_stats m_keep_alive_stats;
+
+        timer_wheel *m_wheel = nullptr;
+        std::unique_ptr<timer> m_timer;
+
+        packet_ids m_packet_ids;
+        inflight_store m_inflight;
+        /// identifiers of QoS 2 messages received and not yet released
+        packet_ids m_received;
+
+        /// Buffer for a packet sent on its own. Pending batched packets
+        /// share this buffer, so they are flushed first.
+        buf_t unbatched_send_buf();
+        /// conn.send(), noting the time for keep-alive
+        int transmit(cbuf_t data);
+        Clock::duration ping_timeout() const;
+        /// Arm the wheel's timer if next_deadline() is before it
+        void schedule();
+
+        void drop_pending_subscribes();
+
+        /// Send a packet serialized elsewhere, batched if batching is on
+        void send_packet(cbuf_t packet);
+        /// Send the messages still in flight again, after reconnecting
+        void resend_inflight();
+
+        // we implement the state machine by having functions for each session state
+        // they will parse incoming packets and change the session state accordingly
         void process_packet_conn_requested(cbuf_t packet_buf);
-        void process_packet_subscribe_requested(cbuf_t packet_buf);
         void process_packet_connected(cbuf_t packet_buf);
-        void process_packet_ping_await(cbuf_t packet_buf);
 
         /// factored out function to deal with publish, used in several states
         bool handle_publish(cbuf_t packet_buf);
+        /// PUBACK, PUBREC, PUBREL and PUBCOMP
+        bool handle_ack(cbuf_t packet_buf);
+        bool handle_suback(cbuf_t packet_buf);
     };
 
+    typedef basic_mikado_sm<Connection> mikado_sm;
+
+    extern template class basic_packet_reader<Receiving_Connection>;
+    extern template class basic_batch_reader<Receiving_Connection>;
+    extern template class basic_mikado_sm<Connection>;
+
 }; // namespace mikado
 
 #endif //MIKADO_H_INCLUDED
@@ -0,0 +1,960 @@
+#ifndef MIKADO_IMPL_H
+#define MIKADO_IMPL_H
+
+// Definitions of the templates in mikado.h. The library instantiates them
+// for the virtual Connection and Receiving_Connection. Include this to
+// instantiate them for a transport of your own.
+
+#include <mikado.h>
+
+#include <algorithm>
+#include <array>
+
+namespace mikado
+{
+
+template <class Conn>
+int send_copied(Conn &conn, cbuf_t head, cbuf_t tail)
+{
+    const auto out = conn.get_send_buf();
+    const auto length = head.size() + tail.size();
+    if (length > out.size())
+    {
+        return -1;
+    }
+
+    if (head.data() != out.data())
+    {
+        copy(head, out);
+    }
+    copy(tail, out.subspan(head.size()));
+    return conn.send(out.first(length));
+}
+
+template <class Conn>
+basic_mikado_sm<Conn>::basic_mikado_sm(Conn &_conn, callback_t _cb) : conn(_conn), cb{_cb}, suback_cb{[](const suback::Packet &) {}},
+                                                                       clock{&default_clock()}
+{
+    // room for the usual startup subscriptions, so subscribe() does not
+    // allocate
+    m_pending_subscribes.reserve(8);
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::request_connect(string_ref client, uint16_t keep_alive)
+{
+    const auto msg = connect::Packet{client, keep_alive}.to_span(unbatched_send_buf());
+    if (msg.empty())
+    {
+        // could not encode the packet
+        return false;
+    }
+    transmit(msg);
+    MIKADO_COUNT(m_metrics, packet_out(msg[0], msg.size()));
+    keepalive.interval = std::chrono::seconds(keep_alive);
+    m_session = session_t::connection_requested;
+    ping_outstanding = false;
+    drop_pending_subscribes();
+    return true;
+}
+
+template <class Conn>
+uint16_t basic_mikado_sm<Conn>::subscribe(string_ref topic)
+{
+    return subscribe(gsl::span<const string_ref>(&topic, 1));
+}
+
+template <class Conn>
+uint16_t basic_mikado_sm<Conn>::subscribe(const std::vector<std::string> &topics)
+{
+    const std::vector<string_ref> refs(topics.begin(), topics.end());
+    return subscribe(gsl::span<const string_ref>(refs));
+}
+
+template <class Conn>
+uint16_t basic_mikado_sm<Conn>::subscribe(gsl::span<const string_ref> topics)
+{
+    const auto id = m_packet_ids.acquire();
+    if (id == 0)
+    {
+        return 0;
+    }
+    const auto msg = subscribe::Packet{id, topics}.to_span(unbatched_send_buf());
+    if (msg.empty())
+    {
+        m_packet_ids.release(id);
+        return 0;
+    }
+    transmit(msg);
+    MIKADO_COUNT(m_metrics, packet_out(msg[0], msg.size()));
+    // Subscribing right behind the CONNECT is fine, the broker handles
+    // packets in order.
+    m_pending_subscribes.push_back(id);
+    return id;
+}
+
+template <class Conn>
+uint16_t basic_mikado_sm<Conn>::subscribe(string_ref topic, callback_t handler)
+{
+    const auto id = subscribe(topic);
+    if (id != 0)
+    {
+        // no PUBLISH can arrive before this returns
+        m_routes.add(topic.str(), handler);
+    }
+    return id;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::drop_pending_subscribes()
+{
+    for (const auto id : m_pending_subscribes)
+    {
+        m_packet_ids.release(id);
+    }
+    m_pending_subscribes.clear();
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::publish(string_ref topic, string_ref payload,
+                                    bool retain, uint8_t QoS)
+{
+    return publish(topic.bytes(), payload.bytes(), retain, QoS);
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::publish(gsl::span<const byte> topic, gsl::span<const byte> payload, bool retain, uint8_t QoS)
+{
+    auto p = publish::Packet{topic, payload, retain};
+
+    if (QoS == 1 || QoS == 2)
+    {
+        // Serialize into the window slot, which keeps it for resending
+        p.QoS = QoS;
+        const auto s = m_inflight.acquire(m_packet_ids);
+        if (s == nullptr)
+        {
+            return false;
+        }
+        p.packet_identifier = s->packet_identifier;
+        const auto size = p.size();
+        if (size == 0 || size > s->packet.size())
+        {
+            m_inflight.release(s->packet_identifier, m_packet_ids);
+            return false;
+        }
+        s->packet = p.to_span(s->packet);
+        send_packet(s->packet);
+        return true;
+    }
+    if (QoS != 0)
+    {
+        return false;
+    }
+
+    const auto size = p.size();
+    if (size == 0)
+    {
+        // could not encode the packet
+        return false;
+    }
+    if (size <= batch.max_bytes)
+    {
+        if (batch.size + size > batch.max_bytes)
+        {
+            flush();
+        }
+        if (batch.packets == 0)
+        {
+            batch.started = clock->now();
+        }
+
+        p.to_span(conn.get_send_buf().subspan(batch.size));
+        batch.size += size;
+        ++batch.packets;
+        MIKADO_COUNT(m_metrics, packet_out(packet_type::publish, size));
+
+        poll();
+        return true;
+    }
+
+    // Not batched: the payload goes out straight from the caller's buffer
+    const auto header = p.header_to_span(unbatched_send_buf());
+    if (header.empty())
+    {
+        // could not encode the packet
+        return false;
+    }
+    if (conn.send_vectored(header, payload) < 0)
+    {
+        // does not fit the send buffer, or the transport failed
+        return false;
+    }
+    keepalive.last_sent = clock->now();
+    MIKADO_COUNT(m_metrics, packet_out(header[0], header.size() + payload.size()));
+    return true;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::send_packet(cbuf_t packet)
+{
+    const auto size = static_cast<size_t>(packet.size());
+    MIKADO_COUNT(m_metrics, packet_out(packet[0], size));
+    if (size > batch.max_bytes)
+    {
+        flush();
+        transmit(packet);
+        return;
+    }
+
+    if (batch.size + size > batch.max_bytes)
+    {
+        flush();
+    }
+    if (batch.packets == 0)
+    {
+        batch.started = clock->now();
+    }
+    copy(packet, conn.get_send_buf().subspan(batch.size));
+    batch.size += size;
+    ++batch.packets;
+
+    poll();
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::resend_inflight()
+{
+    for (const auto s : m_inflight.in_order())
+    {
+        if (!s->released)
+        {
+            s->packet[0] |= publish::flags::dup;
+        }
+        send_packet(s->packet);
+    }
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::process_packet(gsl::span<const byte> packet_buf)
+{
+    MIKADO_COUNT(m_tracer, entered(tracer::clock::now()));
+    MIKADO_COUNT(m_metrics, packet_in(packet_buf[0], packet_buf.size()));
+    const auto before = m_session;
+
+    switch (m_session)
+    {
+    case session_t::connection_requested:
+        process_packet_conn_requested(packet_buf);
+        break;
+    case session_t::connected:
+        process_packet_connected(packet_buf);
+        break;
+    default:
+        // no state where we expect a packet
+        m_session = session_t::error;
+        break;
+    }
+    if (m_session == session_t::error && before != session_t::error)
+    {
+        MIKADO_COUNT(m_metrics, error());
+    }
+    schedule();
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::send_ping()
+{
+    const auto msg = pingreq::Packet{}.to_span(unbatched_send_buf());
+    if (msg.empty())
+    {
+        // could not encode the packet
+        return false;
+    }
+    transmit(msg);
+    MIKADO_COUNT(m_metrics, packet_out(msg[0], msg.size()));
+    ping_outstanding = true;
+    keepalive.ping_sent = keepalive.last_sent;
+    ++m_keep_alive_stats.pings;
+    schedule();
+    return true;
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::send_disconnect()
+{
+    const auto msg = disconnect::Packet{}.to_span(unbatched_send_buf());
+    if (msg.empty())
+    {
+        // could not encode the packet
+        return false;
+    }
+    transmit(msg);
+    MIKADO_COUNT(m_metrics, packet_out(msg[0], msg.size()));
+    m_session = session_t::disconnected;
+    ping_outstanding = false;
+    drop_pending_subscribes();
+    return true;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::set_batching(size_t max_bytes, Clock::duration max_delay)
+{
+    flush();
+    batch.max_bytes = std::min(max_bytes, conn.get_send_buf().size());
+    batch.max_delay = max_delay;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::flush()
+{
+    if (batch.packets == 0)
+    {
+        return;
+    }
+
+    transmit(conn.get_send_buf().first(batch.size));
+
+    ++m_batch_stats.flushes;
+    m_batch_stats.packets += batch.packets;
+    m_batch_stats.bytes += batch.size;
+    m_batch_stats.max_packets_per_flush = std::max(
+                m_batch_stats.max_packets_per_flush, batch.packets);
+
+    batch.size = 0;
+    batch.packets = 0;
+}
+
+template <class Conn>
+const batch_stats &basic_mikado_sm<Conn>::batching_stats() const
+{
+    return m_batch_stats;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::poll()
+{
+    const bool keeping_alive = (keepalive.interval > Clock::duration{} && m_session == session_t::connected);
+    if (batch.packets == 0 && !keeping_alive)
+    {
+        return;
+    }
+
+    const auto now = clock->now();
+    if (batch.packets > 0 && now - batch.started >= batch.max_delay)
+    {
+        flush();
+    }
+
+    if (!keeping_alive)
+    {
+        schedule();
+        return;
+    }
+    if (ping_outstanding)
+    {
+        if (now - keepalive.ping_sent >= ping_timeout())
+        {
+            // the broker or the path to it is gone
+            ++m_keep_alive_stats.timeouts;
+            m_session = session_t::error;
+            MIKADO_COUNT(m_metrics, error());
+        }
+    }
+    else if (now - keepalive.last_sent >= keepalive.interval)
+    {
+        // Only an idle connection needs a ping, any other packet sent
+        // keeps the session alive as well
+        send_ping();
+    }
+    schedule();
+}
+
+template <class Conn>
+Clock::time_point basic_mikado_sm<Conn>::next_deadline() const
+{
+    auto deadline = Clock::time_point::max();
+    if (batch.packets > 0)
+    {
+        deadline = batch.started + batch.max_delay;
+    }
+    if (keepalive.interval > Clock::duration{} && m_session == session_t::connected)
+    {
+        deadline = std::min(deadline, ping_outstanding ? keepalive.ping_sent + ping_timeout()
+                                                       : keepalive.last_sent + keepalive.interval);
+    }
+    return deadline;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::set_timer_wheel(timer_wheel *wheel, std::function<void()> on_expiry)
+{
+    if (m_wheel != nullptr)
+    {
+        // keep the callback, this may be called from within it
+        m_wheel->cancel(*m_timer);
+    }
+    m_wheel = wheel;
+    if (m_wheel == nullptr)
+    {
+        return;
+    }
+
+    if (!m_timer)
+    {
+        m_timer.reset(new timer);
+    }
+    m_timer->callback = [this, on_expiry]() {
+        poll();
+        if (on_expiry)
+        {
+            on_expiry();
+        }
+    };
+    schedule();
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::schedule()
+{
+    if (m_wheel == nullptr)
+    {
+        return;
+    }
+    const auto deadline = next_deadline();
+    if (deadline == Clock::time_point::max())
+    {
+        // a timer still armed costs a spare poll() at most
+        return;
+    }
+    if (!m_timer->scheduled() || deadline < m_timer->expiry())
+    {
+        m_wheel->schedule(*m_timer, deadline);
+    }
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::set_ping_timeout(Clock::duration timeout)
+{
+    keepalive.timeout = timeout;
+    schedule();
+}
+
+template <class Conn>
+Clock::duration basic_mikado_sm<Conn>::ping_timeout() const
+{
+    return (keepalive.timeout > Clock::duration{}) ? keepalive.timeout : keepalive.interval;
+}
+
+template <class Conn>
+const keep_alive_stats &basic_mikado_sm<Conn>::keep_alive_statistics() const
+{
+    return m_keep_alive_stats;
+}
+
+template <class Conn>
+buf_t basic_mikado_sm<Conn>::unbatched_send_buf()
+{
+    flush();
+    return conn.get_send_buf();
+}
+
+template <class Conn>
+int basic_mikado_sm<Conn>::transmit(cbuf_t data)
+{
+    keepalive.last_sent = clock->now();
+    return conn.send(data);
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::set_callback(callback_t _cb)
+{
+    cb = _cb;
+    m_cb_ref = callback_ref{};
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::set_callback_ref(callback_ref handler)
+{
+    m_cb_ref = handler;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::set_suback_callback(suback_callback_t _cb)
+{
+    suback_cb = _cb;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::set_clock(Clock &_clock)
+{
+    clock = &_clock;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::set_metrics(metrics *m)
+{
+    m_metrics = m;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::set_tracer(tracer *t)
+{
+    m_tracer = t;
+}
+
+template <class Conn>
+router &basic_mikado_sm<Conn>::routes()
+{
+    return m_routes;
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::set_topic_handlers(topic_index index, gsl::span<const callback_t> handlers)
+{
+    if (index.size() != handlers.size())
+    {
+        return false;
+    }
+    m_topics = index;
+    m_topic_handlers = handlers;
+    return true;
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::set_inflight_window(size_t window, size_t max_packet_size)
+{
+    if (m_inflight.size() > 0)
+    {
+        return false;
+    }
+    m_inflight.reserve(window, max_packet_size, m_packet_ids);
+    return true;
+}
+
+template <class Conn>
+size_t basic_mikado_sm<Conn>::inflight() const
+{
+    return m_inflight.size();
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::reset()
+{
+    m_session = session_t::disconnected;
+    ping_outstanding = false;
+    drop_pending_subscribes();
+
+    // batched packets belong to the connection we lost
+    batch.size = 0;
+    batch.packets = 0;
+}
+
+template <class Conn>
+state_t basic_mikado_sm<Conn>::state() const
+{
+    switch (m_session)
+    {
+    case session_t::disconnected:
+        return state_t::disconnected;
+    case session_t::connection_requested:
+        return state_t::connection_requested;
+    case session_t::connected:
+        if (!m_pending_subscribes.empty())
+        {
+            return state_t::subscribe_requested;
+        }
+        return ping_outstanding ? state_t::ping_await : state_t::connected;
+    default:
+        return state_t::error;
+    }
+}
+
+template <class Conn>
+session_t basic_mikado_sm<Conn>::session() const
+{
+    return m_session;
+}
+
+template <class Conn>
+size_t basic_mikado_sm<Conn>::pending_subscribes() const
+{
+    return m_pending_subscribes.size();
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::ping_pending() const
+{
+    return ping_outstanding;
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::process_packet_conn_requested(gsl::span<const byte> packet_buf)
+{
+    const auto packet_type = packet_buf[0];
+
+    switch (packet_type)
+    {
+    case packet_type::connack:
+    {
+        auto p = connack::Packet{};
+        const auto r = p.from_span(packet_buf);
+        if (r && p.return_code == connack::result_t::accepted)
+        {
+            m_session = session_t::connected;
+            resend_inflight();
+        }
+        else
+        {
+            m_session = session_t::error;
+        }
+    }
+        break;
+
+    default:
+        m_session = session_t::error;
+        break;
+    }
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::handle_suback(gsl::span<const byte> packet_buf)
+{
+    suback::Packet p{};
+    if (!p.from_span(packet_buf))
+    {
+        return false;
+    }
+
+    const auto it = std::find(m_pending_subscribes.begin(), m_pending_subscribes.end(), p.packet_identifier);
+    if (it == m_pending_subscribes.end())
+    {
+        // not ours (any more), e.g. from before a reset()
+        return true;
+    }
+    m_pending_subscribes.erase(it);
+    m_packet_ids.release(p.packet_identifier);
+    // refused filters are reported, the session carries on
+    metrics::callback_scope timed{m_metrics};
+    suback_cb(p);
+    return true;
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::handle_publish(gsl::span<const byte> packet_buf)
+{
+    publish::Packet p{};
+    auto const r = p.from_span(packet_buf);
+    if (!r)
+    {
+        return false;
+    }
+
+    // For QoS 2, a message is delivered once until its PUBREL clears the
+    // identifier, redeliveries in between are only acknowledged
+    const bool deliver = (p.QoS < 2) || m_received.acquire(p.packet_identifier);
+    if (deliver)
+    {
+        MIKADO_COUNT(m_tracer, delivering(p.payload));
+        metrics::callback_scope timed{m_metrics};
+        const auto i = m_topics.find(p.topic);
+        if (i != topic_index::npos)
+        {
+            m_topic_handlers[i](p.topic, p.payload);
+        }
+        else if (m_routes.dispatch(p.topic, p.payload) == 0)
+        {
+            if (m_cb_ref)
+            {
+                m_cb_ref(p.topic, p.payload);
+            }
+            else
+            {
+                cb(p.topic, p.payload);
+            }
+        }
+    }
+
+    std::array<byte, 4> answer;
+    if (p.QoS == 1)
+    {
+        send_packet(puback::Packet{p.packet_identifier}.to_span(answer));
+    }
+    else if (p.QoS == 2)
+    {
+        send_packet(pubrec::Packet{p.packet_identifier}.to_span(answer));
+    }
+    return true;
+}
+
+template <class Conn>
+bool basic_mikado_sm<Conn>::handle_ack(gsl::span<const byte> packet_buf)
+{
+    // answers are small, they join the batch like publishes
+    std::array<byte, 4> answer;
+
+    switch (packet_buf[0])
+    {
+    case packet_type::puback:
+    {
+        puback::Packet p{};
+        if (!p.from_span(packet_buf))
+        {
+            return false;
+        }
+        // An acknowledgement for a message we no longer track is a late
+        // duplicate
+        m_inflight.release(p.packet_identifier, m_packet_ids);
+        return true;
+    }
+
+    case packet_type::pubrec:
+    {
+        pubrec::Packet p{};
+        if (!p.from_span(packet_buf))
+        {
+            return false;
+        }
+        auto rel = pubrel::Packet{p.packet_identifier};
+        const auto s = m_inflight.find(p.packet_identifier);
+        if (s != nullptr && !s->released)
+        {
+            // The receiver owns the message now, what is left to resend
+            // is the PUBREL
+            s->released = true;
+            s->packet = rel.to_span(s->packet);
+        }
+        send_packet(rel.to_span(answer));
+        return true;
+    }
+
+    case packet_type::pubrel | 0x2:
+    {
+        pubrel::Packet p{};
+        if (!p.from_span(packet_buf))
+        {
+            return false;
+        }
+        m_received.release(p.packet_identifier);
+        send_packet(pubcomp::Packet{p.packet_identifier}.to_span(answer));
+        return true;
+    }
+
+    case packet_type::pubcomp:
+    {
+        pubcomp::Packet p{};
+        if (!p.from_span(packet_buf))
+        {
+            return false;
+        }
+        const auto s = m_inflight.find(p.packet_identifier);
+        if (s != nullptr && s->released)
+        {
+            m_inflight.release(p.packet_identifier, m_packet_ids);
+        }
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+template <class Conn>
+void basic_mikado_sm<Conn>::process_packet_connected(gsl::span<const byte> packet_buf)
+{
+    // Packets are handled independent of the requests outstanding, so
+    // PUBLISH messages keep flowing while a SUBACK or PINGRESP is pending.
+    bool r = true;
+    switch (packet_buf[0] & 0xF0)
+    {
+    case packet_type::publish:
+        r = handle_publish(packet_buf);
+        break;
+    case packet_type::puback:
+    case packet_type::pubrec:
+    case packet_type::pubrel:
+    case packet_type::pubcomp:
+        r = handle_ack(packet_buf);
+        break;
+    case packet_type::suback:
+        r = handle_suback(packet_buf);
+        break;
+    case packet_type::pingresp:
+        // a PINGRESP nobody waits for is harmless
+        r = (packet_buf[0] == packet_type::pingresp && packet_buf[1] == 0);
+        if (r && ping_outstanding)
+        {
+            const auto rtt = clock->now() - keepalive.ping_sent;
+            m_keep_alive_stats.last_rtt = rtt;
+            m_keep_alive_stats.max_rtt = std::max(m_keep_alive_stats.max_rtt, rtt);
+            ++m_keep_alive_stats.pongs;
+            ping_outstanding = false;
+        }
+        break;
+    default:
+        // a server does not send these, or a second CONNACK
+        r = false;
+        break;
+    }
+
+    if (!r)
+    {
+        m_session = session_t::error;
+    }
+}
+
+template <class Conn>
+read_result basic_packet_reader<Conn>::read_packet()
+{
+    if (rec.bytes_to_read() > read_buffer.end() - cursor)
+    {
+        // packet does not fit into the read buffer
+        MIKADO_COUNT(m_metrics, read_error());
+        return read_result::read_error;
+    }
+
+    const auto r = conn.read(
+                buf_t{cursor, static_cast<unsigned long>(rec.bytes_to_read())});
+    MIKADO_COUNT(m_metrics, read());
+    if (r < 0)
+    {
+        MIKADO_COUNT(m_metrics, read_error());
+        return read_result::read_error;
+    }
+
+    // if r > 0 -> we have read something and we're okay
+    // if r ==0 -> timeout, we still can continue scanning and check the
+    // state of rec
+
+    cursor += r;
+    rec.advance_until(cursor);
+
+    if (rec.state() == receiver_state::msg_complete)
+    {
+        MIKADO_COUNT(m_metrics, packet_read());
+        MIKADO_COUNT(m_tracer, arrived(tracer::clock::now()));
+        return read_result::success;
+    }
+    else
+    {
+        return read_result::more_to_read;
+    }
+}
+
+template <class Conn>
+cbuf_t basic_packet_reader<Conn>::content() const
+{
+    return rec.content();
+}
+
+template <class Conn>
+void basic_packet_reader<Conn>::reset()
+{
+    cursor = read_buffer.begin();
+    rec.reset();
+}
+
+template <class Conn>
+void basic_packet_reader<Conn>::set_metrics(metrics *m)
+{
+    m_metrics = m;
+}
+
+template <class Conn>
+void basic_packet_reader<Conn>::set_tracer(tracer *t)
+{
+    m_tracer = t;
+}
+
+template <class Conn>
+read_result basic_batch_reader<Conn>::fill()
+{
+    if (head == tail)
+    {
+        // everything consumed, start over at the front for free
+        head = tail = read_buffer.begin();
+    }
+    else if (tail == read_buffer.end())
+    {
+        if (head == read_buffer.begin())
+        {
+            // packet does not fit into the read buffer
+            MIKADO_COUNT(m_metrics, read_error());
+            return read_result::read_error;
+        }
+
+        const auto pending = tail - head;
+        copy(head, tail, read_buffer.begin(), read_buffer.end());
+        head = read_buffer.begin();
+        tail = head + pending;
+    }
+
+    const auto r = conn.read(buf_t{tail, read_buffer.end()});
+    MIKADO_COUNT(m_metrics, read());
+    if (r < 0)
+    {
+        MIKADO_COUNT(m_metrics, read_error());
+        return read_result::read_error;
+    }
+
+    if (r == 0)
+    {
+        return read_result::more_to_read;
+    }
+    tail += r;
+    MIKADO_COUNT(m_tracer, arrived(tracer::clock::now()));
+    return read_result::success;
+}
+
+template <class Conn>
+read_result basic_batch_reader<Conn>::next(cbuf_t &packet)
+{
+    // lex against the whole rest of the buffer, so a packet which is not
+    // complete yet shows as msg_incomplete rather than as error
+    receiver rec{cbuf_t{head, read_buffer.end()}};
+    cbuf_t::iterator until = head;
+    while (rec && until < tail)
+    {
+        until += std::min(rec.bytes_to_read(), tail - until);
+        rec.advance_until(until);
+    }
+
+    switch (rec.state())
+    {
+    case receiver_state::msg_complete:
+        packet = rec.content();
+        head += packet.size();
+        MIKADO_COUNT(m_metrics, packet_read());
+        return read_result::success;
+
+    case receiver_state::error:
+        MIKADO_COUNT(m_metrics, read_error());
+        return read_result::read_error;
+
+    default:
+        return read_result::more_to_read;
+    }
+}
+
+template <class Conn>
+void basic_batch_reader<Conn>::reset()
+{
+    head = tail = read_buffer.begin();
+}
+
+template <class Conn>
+void basic_batch_reader<Conn>::set_metrics(metrics *m)
+{
+    m_metrics = m;
+}
+
+template <class Conn>
+void basic_batch_reader<Conn>::set_tracer(tracer *t)
+{
+    m_tracer = t;
+}
+
+} // namespace mikado
+
+#endif // MIKADO_IMPL_H
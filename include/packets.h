@@ -1,6 +1,9 @@
 #ifndef MIKADO_PACKETS_H_INCLUDED
 #define MIKADO_PACKETS_H_INCLUDED
 
+#include <string>
+#include <vector>
+
 #include <gsl-lite/gsl-lite.hpp>
 #include <utils.h>
 
@@ -12,6 +15,10 @@ namespace packet_type
 constexpr byte connect   { 1 << 4};
 constexpr byte connack   { 2 << 4};
 constexpr byte publish   { 3 << 4};
+constexpr byte puback    { 4 << 4};
+constexpr byte pubrec    { 5 << 4};
+constexpr byte pubrel    { 6 << 4};
+constexpr byte pubcomp   { 7 << 4};
 constexpr byte subscribe { 8 << 4};
 constexpr byte suback    { 9 << 4};
 constexpr byte pingreq   {12 << 4};
@@ -19,6 +26,28 @@ constexpr byte pingresp  {13 << 4};
 constexpr byte disconnect{14 << 4};
 }; // namespace packet_type
 
+/// Fixed header of a received packet.
+///
+/// The remaining length is a variable byte integer of 1-4 bytes, so the
+/// variable header starts at an offset of size, which is 2-5.
+struct fixed_header
+{
+    byte type;
+    uint32_t remaining_length;
+    size_t size;
+
+    bool from_span(gsl::span<const byte>);
+};
+
+/// Number of bytes a packet with the given remaining length takes on the
+/// wire, fixed header included. 0 if the remaining length exceeds vbi_max.
+///
+/// The packets' size() report what their to_span() produces, 0 if they
+/// cannot be encoded. to_span() checks the buffer against that once, and
+/// returns an empty span rather than a truncated packet when it is too
+/// small.
+size_t packet_size(size_t remaining_length);
+
 namespace connect {
 
 constexpr byte mqtt_protocol_version {4};
@@ -40,20 +69,24 @@ constexpr byte clean_start  {1 << 1};
 } // namespace flags
 
 
+/// CONNECT. clientID is referenced, not copied, and must outlive the
+/// Packet.
 struct Packet
 {
 public:
-    Packet(const std::string _clientID="",
+    Packet(string_ref _clientID = "",
            const uint16_t _keep_alive = 0,
            const byte _flags = connect::flags::clean_start);
     gsl::span<byte> to_span(gsl::span<byte>);
+    /// 0 if clientID is longer than 65535 bytes
+    size_t size() const;
 
     constexpr static auto type = packet_type::connect;
 
     constexpr static byte protocol_name[] {'M', 'Q', 'T', 'T'};
     byte flags;
     uint16_t keep_alive;
-    const std::string clientID;
+    string_ref clientID;
 };
 
 } // namespace connect
@@ -84,14 +117,33 @@ public:
 namespace subscribe
 {
 
+/// SUBSCRIBE to one or more topic filters, all with the same QoS.
+///
+/// The filters are referenced, not copied, and must outlive the Packet.
+/// Packets are not copied either, as after from_span() the filters live in
+/// the Packet.
 struct Packet
 {
-    Packet(uint16_t _packet_identifier, const std::string& _topic_filter, byte _QoS=0);
+    Packet();
+    Packet(uint16_t _packet_identifier, gsl::span<const string_ref> _topic_filters, byte _QoS=0);
+    Packet(Packet &&) = default;
+    Packet &operator=(Packet &&) = default;
     gsl::span<byte> to_span(gsl::span<byte>);
+    /// 0 without filters or if one is longer than 65535 bytes
+    size_t size() const;
 
-    uint16_t packet_identifier;
-    std::string topic_filter;
+    /// Parse a SUBSCRIBE, as a broker would. With differing QoS per filter,
+    /// QoS is the highest requested. The filters point into the data
+    /// parsed.
+    bool from_span(gsl::span<const byte>);
+
+    uint16_t packet_identifier = 0;
+    gsl::span<const string_ref> topic_filters;
     byte QoS{0};
+
+private:
+    /// filters found by from_span()
+    std::vector<string_ref> parsed;
 };
 
 } // namespace subscribe
@@ -109,15 +161,27 @@ enum class result_t : byte
 struct Packet
 {
     uint16_t packet_identifier;
-    result_t result;
+
+    /// Return code for the i-th topic filter of the SUBSCRIBE
+    result_t result(size_t i = 0) const;
+    /// Number of return codes, one per topic filter
+    size_t size() const;
 
     bool from_span(gsl::span<const byte>);
+
+private:
+    /// return codes, validated, in the packet parsed
+    gsl::span<const byte> return_codes;
 };
 
 } // namespace suback
 
 namespace publish {
 
+namespace flags {
+constexpr byte dup {1 << 3};
+} // namespace flags
+
 struct Packet
 {
     Packet();
@@ -125,8 +189,20 @@ struct Packet
            bool retain=false);
     gsl::span<byte> to_span(gsl::span<byte>);
 
+    /// Serialize everything but the payload, which is expected to be sent
+    /// right behind the returned span.
+    gsl::span<byte> header_to_span(gsl::span<byte>);
+
+    /// Number of bytes to_span() produces, 0 if the topic is longer than
+    /// 65535 bytes or the packet exceeds the maximum remaining length
+    size_t size() const;
+
     bool retain = false;
     uint8_t QoS = 0;
+    /// set on redelivery of a QoS > 0 message
+    bool dup = false;
+    /// only present with QoS > 0
+    uint16_t packet_identifier = 0;
     gsl::span<const byte> topic;
     gsl::span<const byte> payload;
 
@@ -135,11 +211,43 @@ struct Packet
 
 } // namespace publish
 
+/// PUBACK, PUBREC, PUBREL and PUBCOMP carry nothing but a packet
+/// identifier. header is their complete first byte.
+template <byte header>
+struct ack_packet
+{
+    gsl::span<byte> to_span(gsl::span<byte>);
+    bool from_span(gsl::span<const byte>);
+    constexpr static size_t size()
+    {
+        return 4;
+    }
+
+    uint16_t packet_identifier;
+};
+
+namespace puback {
+typedef ack_packet<packet_type::puback> Packet;
+} // namespace puback
+
+namespace pubrec {
+typedef ack_packet<packet_type::pubrec> Packet;
+} // namespace pubrec
+
+namespace pubrel {
+typedef ack_packet<packet_type::pubrel | 0x2> Packet;
+} // namespace pubrel
+
+namespace pubcomp {
+typedef ack_packet<packet_type::pubcomp> Packet;
+} // namespace pubcomp
+
 namespace pingreq {
 
 struct Packet
 {
     gsl::span<byte> to_span(gsl::span<byte>);
+    size_t size() const;
 };
 
 } // namespace pingreq
@@ -148,6 +256,7 @@ namespace disconnect {
 struct Packet
 {
     gsl::span<byte> to_span(gsl::span<byte>);
+    size_t size() const;
 };
 
 } // namespace mikado::disconnect
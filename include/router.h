@@ -0,0 +1,58 @@
+#ifndef MIKADO_ROUTER_H
+#define MIKADO_ROUTER_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gsl-lite/gsl-lite.hpp>
+
+#include <utils.h>
+
+namespace mikado
+{
+
+/// Dispatches PUBLISH messages to the handlers of all topic filters matching
+/// their topic. Filters may use the MQTT wildcards '+' (exactly one level)
+/// and '#' (any number of remaining levels, including none).
+///
+/// Filters are stored as a trie of topic levels, so matching a topic costs
+/// proportional to its depth rather than to the number of filters. Lookup
+/// compares levels in place and does not allocate.
+class router
+{
+public:
+    typedef std::function<void(gsl::span<const byte> topic, gsl::span<const byte> payload)> handler_t;
+
+    router();
+    router(router &&);
+    router &operator=(router &&);
+    ~router();
+
+    /// Add a handler for filter. Several handlers may share a filter.
+    /// Returns false if filter is not a valid topic filter.
+    bool add(const std::string &filter, handler_t handler);
+
+    /// Remove all handlers for filter. Returns false if there were none.
+    bool remove(const std::string &filter);
+
+    /// Call all handlers whose filter matches topic.
+    /// Returns the number of handlers called.
+    size_t dispatch(gsl::span<const byte> topic, gsl::span<const byte> payload) const;
+
+    bool empty() const;
+
+    static bool valid_filter(const std::string &filter);
+
+    /// Trie node, opaque outside of router.cpp
+    struct node;
+
+private:
+    std::unique_ptr<node> root;
+    size_t filter_count = 0;
+};
+
+} // namespace mikado
+
+#endif // MIKADO_ROUTER_H
@@ -0,0 +1,133 @@
+#ifndef MIKADO_TIMER_WHEEL_H
+#define MIKADO_TIMER_WHEEL_H
+
+#include <array>
+#include <chrono>
+#include <functional>
+
+#include <utils.h>
+
+namespace mikado
+{
+
+class timer_wheel;
+
+/// A deadline in a timer_wheel, running callback when it expires.
+///
+/// Timers are linked into the wheel intrusively, so scheduling takes no
+/// allocation. A timer is removed from its wheel when destroyed.
+class timer
+{
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    timer() = default;
+    explicit timer(std::function<void()> _callback) : callback{_callback}
+    {
+    }
+    ~timer();
+
+    timer(const timer &) = delete;
+    void operator=(const timer &) = delete;
+
+    bool scheduled() const;
+    /// When the timer was scheduled for
+    time_point expiry() const;
+
+    std::function<void()> callback;
+
+private:
+    friend class timer_wheel;
+
+    timer_wheel *wheel = nullptr;
+    timer *prev = nullptr, *next = nullptr;
+    time_point at{};
+    uint64_t tick = 0;
+    /// level * slots_per_level + slot
+    uint16_t bucket = 0;
+};
+
+/// Hierarchical timer wheel, for many deadlines of which few expire.
+///
+/// Time is counted in ticks of resolution. Level 0 has a slot for each of
+/// the next 64 ticks, every further level a slot for 64 slots of the level
+/// below. A timer goes to the lowest level whose range covers its expiry,
+/// and moves down a level when time reaches the slot it is in. Eight levels
+/// cover 2^48 ticks from start, later expiries are treated as the last of
+/// them.
+///
+/// schedule() and cancel() are O(1). expire() skips empty stretches of time
+/// using a bitmap of occupied slots per level, so it costs O(levels) plus
+/// the timers it moves or runs, no matter how long the loop slept.
+///
+/// Timers never run early: one scheduled for t runs in the first expire()
+/// whose now is at or after t, rounded up to the next tick. Timers due
+/// already run in the next expire(), which includes those a callback
+/// schedules for up to now of the expire() running it. So a callback
+/// rescheduling itself runs at most once per expire(), and a periodic timer
+/// behind by several periods catches up one period per expire().
+class timer_wheel
+{
+public:
+    typedef timer::time_point time_point;
+    typedef std::chrono::steady_clock::duration duration;
+
+    /// Ticks are counted from start
+    explicit timer_wheel(duration resolution = std::chrono::milliseconds(1),
+                         time_point start = time_point{});
+    ~timer_wheel();
+
+    timer_wheel(const timer_wheel &) = delete;
+    void operator=(const timer_wheel &) = delete;
+
+    /// Schedule t for at, moving it if it is scheduled already, possibly in
+    /// another wheel. Timers due already run in the next expire().
+    void schedule(timer &t, time_point at);
+    void cancel(timer &t);
+
+    /// Run the callbacks of all timers due at now, in order of expiry.
+    /// Callbacks may schedule and cancel timers, including their own.
+    /// Returns the number of callbacks run.
+    size_t expire(time_point now);
+
+    /// No timer expires before this, time_point::max() if none is
+    /// scheduled. Exact for timers within the next 64 ticks, a lower bound
+    /// for timers further ahead, which are sorted in on the way.
+    time_point next_expiry() const;
+
+    /// Number of timers scheduled
+    size_t size() const;
+
+private:
+    static constexpr size_t slot_bits = 6;
+    static constexpr size_t slots_per_level = size_t{1} << slot_bits;
+    static constexpr size_t levels = 8;
+
+    duration resolution;
+    time_point origin;
+    /// The last tick representable, both in the wheel and as time_point
+    uint64_t max_tick;
+    uint64_t current = 0;
+    /// The tick expire() runs timers up to. Timers scheduled by its
+    /// callbacks go behind it.
+    uint64_t expiring = 0;
+    size_t count = 0;
+
+    std::array<timer *, levels * slots_per_level> buckets{};
+    std::array<uint64_t, levels> occupied{};
+
+    /// Ticks of t, rounded up or down, at most max_tick
+    uint64_t tick_of(time_point t, bool round_up) const;
+    /// Where the next timer is due, or could be due, in ticks.
+    /// uint64_t max if there is none.
+    uint64_t next_tick() const;
+
+    void link(timer &t);
+    void unlink(timer &t);
+    /// Move all timers of level's slot at current to lower levels
+    void cascade(size_t level);
+};
+
+} // namespace mikado
+
+#endif // MIKADO_TIMER_WHEEL_H
@@ -0,0 +1,374 @@
+#ifndef MIKADO_TOPIC_TABLE_H
+#define MIKADO_TOPIC_TABLE_H
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <gsl-lite/gsl-lite.hpp>
+
+#include <utils.h>
+
+// Building a table at compile time needs the relaxed constexpr rules of
+// C++14. With C++11, the same code builds tables at runtime.
+#if __cplusplus >= 201402L
+#define MIKADO_CONSTEXPR14 constexpr
+#else
+#define MIKADO_CONSTEXPR14 inline
+#endif
+
+namespace mikado
+{
+
+/// A topic known in advance, as a view into storage outliving the table
+struct topic_ref
+{
+    const char *data;
+    size_t size;
+};
+
+namespace topic_hash
+{
+
+/// FNV-1a, the one pass over the topic bytes a lookup makes
+template <class Byte>
+MIKADO_CONSTEXPR14 uint32_t fnv1a(const Byte *s, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i)
+    {
+        h = (h ^ static_cast<uint8_t>(s[i])) * 16777619u;
+    }
+    return h;
+}
+
+/// Scramble the topic hash with a per-bucket seed to find its slot
+MIKADO_CONSTEXPR14 uint32_t mix(uint32_t h, uint32_t seed)
+{
+    h ^= seed;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+constexpr size_t pow2_at_least(size_t n, size_t p = 1)
+{
+    return (p >= n) ? p : pow2_at_least(n, 2 * p);
+}
+
+constexpr size_t bucket_count(size_t topics)
+{
+    return pow2_at_least((topics + 1) / 2);
+}
+
+constexpr size_t slot_count(size_t topics)
+{
+    return pow2_at_least(2 * topics);
+}
+
+constexpr size_t bucket_of(uint32_t h, size_t buckets)
+{
+    return (h >> 16) & (buckets - 1);
+}
+
+/// Seeds tried per bucket before giving up. Only duplicate topics get here.
+constexpr uint32_t max_seed = 1 << 16;
+
+/// Hash and displace: topics are grouped into buckets by their hash. For each
+/// bucket, largest first, a seed is searched which places all of its topics
+/// into free slots.
+///
+/// Table provides topics, seeds, slots and their sizes, Scratch provides hash
+/// and order (per topic) and start (per bucket + 1) as working memory.
+template <class Table, class Scratch>
+MIKADO_CONSTEXPR14 bool build(Table &t, Scratch &s)
+{
+    const size_t n = t.topic_count();
+    const size_t buckets = t.bucket_count();
+    const size_t slots = t.slot_count();
+
+    // group topics by bucket (counting sort)
+    for (size_t b = 0; b <= buckets; ++b)
+    {
+        s.start[b] = 0;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        s.hash[i] = fnv1a(t.topics[i].data, t.topics[i].size);
+        ++s.start[bucket_of(s.hash[i], buckets) + 1];
+    }
+    size_t largest = 0;
+    for (size_t b = 0; b < buckets; ++b)
+    {
+        largest = (s.start[b + 1] > largest) ? s.start[b + 1] : largest;
+        s.start[b + 1] += s.start[b];
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        s.order[s.start[bucket_of(s.hash[i], buckets)]++] = static_cast<uint16_t>(i);
+    }
+    // placing advanced each start to the next bucket's, shift them back
+    for (size_t b = buckets; b > 0; --b)
+    {
+        s.start[b] = s.start[b - 1];
+    }
+    s.start[0] = 0;
+
+    for (size_t k = 0; k < slots; ++k)
+    {
+        t.slots[k] = 0;
+    }
+
+    for (size_t size = largest; size > 0; --size)
+    {
+        for (size_t b = 0; b < buckets; ++b)
+        {
+            const auto first = s.start[b];
+            const auto last = s.start[b + 1];
+            if (last - first != size)
+            {
+                continue;
+            }
+
+            uint32_t seed = 0;
+            for (; seed < max_seed; ++seed)
+            {
+                size_t placed = first;
+                for (; placed < last; ++placed)
+                {
+                    const auto slot = mix(s.hash[s.order[placed]], seed) & (slots - 1);
+                    if (t.slots[slot] != 0)
+                    {
+                        break;
+                    }
+                    t.slots[slot] = static_cast<uint16_t>(s.order[placed] + 1);
+                }
+                if (placed == last)
+                {
+                    break;
+                }
+
+                // collision, take back what this seed placed
+                for (size_t i = first; i < placed; ++i)
+                {
+                    t.slots[mix(s.hash[s.order[i]], seed) & (slots - 1)] = 0;
+                }
+            }
+            if (seed == max_seed)
+            {
+                return false;
+            }
+            t.seeds[b] = seed;
+        }
+    }
+    return true;
+}
+
+/// Array usable in C++14 constant expressions, unlike std::array before
+/// C++17.
+template <class T, size_t N>
+struct carray
+{
+    T v[N];
+
+    MIKADO_CONSTEXPR14 T &operator[](size_t i)
+    {
+        return v[i];
+    }
+
+    constexpr const T &operator[](size_t i) const
+    {
+        return v[i];
+    }
+};
+
+} // namespace topic_hash
+
+/// Non-owning view of a perfect hash table over a set of exact topics.
+///
+/// find() resolves a topic with one hash over its bytes and one compare.
+class topic_index
+{
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    constexpr topic_index() : topics{nullptr}, seeds{nullptr}, slots{nullptr},
+                              n{0}, buckets{0}, slot_mask{0}
+    {
+    }
+
+    constexpr topic_index(const topic_ref *_topics, size_t _n,
+                          const uint32_t *_seeds, size_t _buckets,
+                          const uint16_t *_slots, size_t _slot_count) : topics{_topics}, seeds{_seeds}, slots{_slots},
+                                                                        n{_n}, buckets{_buckets}, slot_mask{_slot_count - 1}
+    {
+    }
+
+    /// Position of topic in the list the table was built from, or npos
+    size_t find(gsl::span<const byte> topic) const
+    {
+        if (n == 0)
+        {
+            return npos;
+        }
+
+        const auto h = topic_hash::fnv1a(topic.data(), topic.size());
+        const auto seed = seeds[topic_hash::bucket_of(h, buckets)];
+        const auto entry = slots[topic_hash::mix(h, seed) & slot_mask];
+        if (entry == 0)
+        {
+            return npos;
+        }
+
+        const auto &t = topics[entry - 1];
+        if (t.size != topic.size() || std::memcmp(t.data, topic.data(), t.size) != 0)
+        {
+            return npos;
+        }
+        return entry - 1;
+    }
+
+    size_t size() const
+    {
+        return n;
+    }
+
+private:
+    const topic_ref *topics;
+    const uint32_t *seeds;
+    const uint16_t *slots;
+    size_t n, buckets, slot_mask;
+};
+
+/// Perfect hash table over N topics fixed at compile time. Build it with
+/// make_topic_table(), which is constexpr with C++14.
+///
+/// Check valid(): building fails only for duplicate topics.
+template <size_t N>
+class static_topic_table
+{
+public:
+    MIKADO_CONSTEXPR14 explicit static_topic_table(const topic_ref (&_topics)[N]) : topics{}, seeds{}, slots{}, ok{false}
+    {
+        for (size_t i = 0; i < N; ++i)
+        {
+            topics[i] = _topics[i];
+        }
+
+        struct
+        {
+            topic_hash::carray<uint32_t, N> hash;
+            topic_hash::carray<uint16_t, N> order;
+            topic_hash::carray<size_t, topic_hash::bucket_count(N) + 1> start;
+        } scratch{};
+        ok = topic_hash::build(*this, scratch);
+    }
+
+    constexpr bool valid() const
+    {
+        return ok;
+    }
+
+    constexpr topic_index index() const
+    {
+        return topic_index{&topics[0], N, &seeds[0], bucket_count(), &slots[0], slot_count()};
+    }
+
+    constexpr size_t topic_count() const
+    {
+        return N;
+    }
+
+    constexpr size_t bucket_count() const
+    {
+        return topic_hash::bucket_count(N);
+    }
+
+    constexpr size_t slot_count() const
+    {
+        return topic_hash::slot_count(N);
+    }
+
+    topic_hash::carray<topic_ref, N> topics;
+    topic_hash::carray<uint32_t, topic_hash::bucket_count(N)> seeds;
+    topic_hash::carray<uint16_t, topic_hash::slot_count(N)> slots;
+
+private:
+    bool ok;
+};
+
+template <size_t... L>
+MIKADO_CONSTEXPR14 static_topic_table<sizeof...(L)> make_topic_table(const char (&... topics)[L])
+{
+    const topic_ref refs[] = {topic_ref{topics, L - 1}...};
+    return static_topic_table<sizeof...(L)>{refs};
+}
+
+/// Perfect hash table over topics known at runtime. Topic strings are copied.
+class topic_table
+{
+public:
+    explicit topic_table(const std::vector<std::string> &_topics) : names(_topics), ok{false}
+    {
+        for (const auto &t : names)
+        {
+            topics.push_back(topic_ref{t.data(), t.size()});
+        }
+        seeds.resize(bucket_count());
+        slots.resize(slot_count());
+
+        struct
+        {
+            std::vector<uint32_t> hash;
+            std::vector<uint16_t> order;
+            std::vector<size_t> start;
+        } scratch{std::vector<uint32_t>(names.size()), std::vector<uint16_t>(names.size()),
+                  std::vector<size_t>(bucket_count() + 1)};
+        ok = topic_hash::build(*this, scratch);
+    }
+
+    // topics point into names
+    topic_table(const topic_table &) = delete;
+    void operator=(const topic_table &) = delete;
+
+    bool valid() const
+    {
+        return ok;
+    }
+
+    topic_index index() const
+    {
+        return topic_index{topics.data(), topics.size(), seeds.data(), bucket_count(),
+                           slots.data(), slot_count()};
+    }
+
+    size_t topic_count() const
+    {
+        return names.size();
+    }
+
+    size_t bucket_count() const
+    {
+        return topic_hash::bucket_count(names.size());
+    }
+
+    size_t slot_count() const
+    {
+        return topic_hash::slot_count(names.size());
+    }
+
+    std::vector<topic_ref> topics;
+    std::vector<uint32_t> seeds;
+    std::vector<uint16_t> slots;
+
+private:
+    std::vector<std::string> names;
+    bool ok;
+};
+
+} // namespace mikado
+
+#endif // MIKADO_TOPIC_TABLE_H
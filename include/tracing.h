@@ -0,0 +1,128 @@
+#ifndef MIKADO_TRACING_H
+#define MIKADO_TRACING_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include <metrics.h>
+#include <utils.h>
+
+namespace mikado
+{
+
+/// Counts of a latency_histogram at one point in time
+struct histogram_snapshot
+{
+    std::vector<uint64_t> counts;
+    uint64_t count = 0;
+    std::chrono::nanoseconds max{};
+
+    /// Smallest latency at least p percent of the recorded ones are not
+    /// above, within the precision of the histogram. 0 if empty.
+    std::chrono::nanoseconds percentile(double p) const;
+
+    histogram_snapshot &operator+=(const histogram_snapshot &);
+};
+
+/// Latencies in nanoseconds, bucketed log-linearly in the manner of an HDR
+/// histogram: values up to 127 ns exactly, larger ones in 64 buckets per
+/// power of two, so a bucket is within 1/64 of its values. Longer than
+/// 2^40 ns, about 18 minutes, counts as that.
+///
+/// Memory is fixed, recording takes no allocation. Counts are relaxed
+/// atomics, so snapshot() may be called from any thread while recording.
+class latency_histogram
+{
+public:
+    static constexpr unsigned linear_bits = 7;
+    static constexpr unsigned max_bits = 40;
+    static constexpr size_t bucket_count = (1 << linear_bits) + (max_bits - linear_bits) * (1 << (linear_bits - 1));
+
+    latency_histogram() = default;
+    latency_histogram(const latency_histogram &) = delete;
+    void operator=(const latency_histogram &) = delete;
+
+    void record(std::chrono::nanoseconds latency);
+    histogram_snapshot snapshot() const;
+    void reset();
+
+    static size_t bucket(uint64_t ns);
+    /// Largest value counted in bucket i
+    static uint64_t highest_in(size_t i);
+
+private:
+    std::array<std::atomic<uint64_t>, bucket_count> counts{};
+    std::atomic<uint64_t> max_ns{0};
+};
+
+struct trace_snapshot
+{
+    /// read completion in Packet_reader or Batch_reader to callback
+    histogram_snapshot arrival_to_callback;
+    /// process_packet() entry to callback
+    histogram_snapshot entry_to_callback;
+    /// stamp() on the publisher to callback, for stamped payloads
+    histogram_snapshot publish_to_callback;
+};
+
+/// Latencies of PUBLISH messages on their way to the callback.
+///
+/// Attached with set_tracer() to a mikado_sm and the reader feeding it, the
+/// reader notes when a read completes, the mikado_sm when process_packet()
+/// is entered, and both times are measured against the moment the callback
+/// is invoked. These notes are plain members: a tracer serves mikado_sms
+/// and readers driven from one thread.
+///
+/// End-to-end, the publisher stamp()s the time into the first bytes of the
+/// payload just before publish(), and a subscriber with
+/// set_stamped_payloads() measures against it. Publisher and subscriber
+/// need to share the steady_clock, i.e. run on the same host.
+///
+/// Like metrics, tracing is compiled out with MIKADO_METRICS 0.
+class tracer
+{
+public:
+    typedef std::chrono::steady_clock clock;
+    static constexpr size_t stamp_size = sizeof(clock::rep);
+
+    tracer() = default;
+    tracer(const tracer &) = delete;
+    void operator=(const tracer &) = delete;
+
+    /// Write the time into the first stamp_size bytes of payload. Returns
+    /// false if it is too small.
+    static bool stamp(gsl::span<byte> payload, clock::time_point t = clock::now());
+    static bool read_stamp(gsl::span<const byte> payload, clock::time_point &t);
+
+    /// Whether received payloads start with a stamp()
+    void set_stamped_payloads(bool);
+
+    trace_snapshot snapshot() const;
+    void reset();
+
+    // Called by the readers and mikado_sm
+    void arrived(clock::time_point t)
+    {
+        arrival = t;
+    }
+    void entered(clock::time_point t)
+    {
+        entry = t;
+    }
+    void delivering(gsl::span<const byte> payload);
+
+private:
+    clock::time_point arrival{}, entry{};
+    bool stamped_payloads = false;
+
+    latency_histogram arrival_to_callback;
+    latency_histogram entry_to_callback;
+    latency_histogram publish_to_callback;
+};
+
+} // namespace mikado
+
+#endif // MIKADO_TRACING_H
@@ -3,22 +3,21 @@
 
 #include <gsl-lite/gsl-lite.hpp>
 
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
 namespace mikado {
 
 typedef uint8_t byte;
 
-/** \brief Copy command bound on output range size
- *
- * Needed, as we use spans as output range for recv. This way we can copy data
- * left vs right
- *
- * TODO: implement memmove() for known lengths
- *
- * taken from https://stackoverflow.com/questions/8432864/strncpy-equivalent-of-stdcopy
- */
+namespace detail {
+
+/// Element by element, for iterators in general
 template<class InputIterator , class OutputIterator>
 size_t copy( InputIterator srcStart , InputIterator srcEnd ,
-             OutputIterator destStart , OutputIterator destEnd )
+             OutputIterator destStart , OutputIterator destEnd , std::false_type )
 {
     size_t items_copied = 0;
     while ( srcStart != srcEnd && destStart != destEnd )
@@ -31,13 +30,58 @@ size_t copy( InputIterator srcStart , InputIterator srcEnd ,
     return items_copied;
 }
 
+/// Pointers to trivially copyable elements: the length is known up front,
+/// so copy all of it at once. memmove, as ranges may overlap.
+template<class T, class U>
+size_t copy( T *srcStart , T *srcEnd , U *destStart , U *destEnd , std::true_type )
+{
+    const auto items = static_cast<size_t>(std::min(srcEnd - srcStart, destEnd - destStart));
+    if (items > 0)
+    {
+        std::memmove(destStart, srcStart, items * sizeof(U));
+    }
+    return items;
+}
+
+template<class InputIterator , class OutputIterator>
+struct is_contiguous_copy : std::integral_constant<bool,
+        std::is_pointer<InputIterator>::value &&
+        std::is_pointer<OutputIterator>::value &&
+        std::is_same<typename std::remove_cv<typename std::remove_pointer<InputIterator>::type>::type,
+                     typename std::remove_pointer<OutputIterator>::type>::value &&
+        std::is_trivially_copyable<typename std::remove_pointer<OutputIterator>::type>::value>
+{
+};
+
+} // namespace detail
+
+/** \brief Copy command bound on output range size
+ *
+ * Needed, as we use spans as output range for recv. This way we can copy data
+ * left vs right
+ *
+ * Pointers, which span iterators are, to trivially copyable elements take a
+ * single memmove() of the bounded length.
+ *
+ * taken from https://stackoverflow.com/questions/8432864/strncpy-equivalent-of-stdcopy
+ */
+template<class InputIterator , class OutputIterator>
+size_t copy( InputIterator srcStart , InputIterator srcEnd ,
+             OutputIterator destStart , OutputIterator destEnd )
+{
+    return detail::copy(srcStart, srcEnd, destStart, destEnd,
+                        detail::is_contiguous_copy<InputIterator, OutputIterator>{});
+}
+
 /** \brief Shorthand for ranges (i.e. spans/arrays/vectors)
  *
+ * Contiguous ranges are passed on as pointers, so they take the memmove()
+ * as well.
  */
 template <class InputRange, class OutputRange>
-size_t copy( InputRange in, OutputRange out)
+size_t copy( const InputRange &in, OutputRange &&out)
 {
-    return copy (std::begin(in), std::end(in), std::begin(out), std::end(out));
+    return copy (in.data(), in.data() + in.size(), out.data(), out.data() + out.size());
 }
 
 constexpr byte msb(uint16_t n)
@@ -50,6 +94,81 @@ constexpr byte lsb(uint16_t n)
     return gsl::narrow_cast<byte>( n & (0xFF));
 }
 
+/** \brief Non-owning view of characters, like C++17's std::string_view
+ *
+ * Converts implicitly from string literals and std::string, so functions
+ * taking a string_ref accept both without a copy to the heap. The characters
+ * must outlive the string_ref.
+ */
+class string_ref
+{
+public:
+    constexpr string_ref() : ptr{""}, length{0}
+    {
+    }
+
+    string_ref(const char *s) : ptr{s}, length{std::strlen(s)}
+    {
+    }
+
+    constexpr string_ref(const char *s, size_t n) : ptr{s}, length{n}
+    {
+    }
+
+    string_ref(const std::string &s) : ptr{s.data()}, length{s.size()}
+    {
+    }
+
+    constexpr const char *data() const
+    {
+        return ptr;
+    }
+
+    constexpr size_t size() const
+    {
+        return length;
+    }
+
+    constexpr bool empty() const
+    {
+        return length == 0;
+    }
+
+    const char *begin() const
+    {
+        return ptr;
+    }
+
+    const char *end() const
+    {
+        return ptr + length;
+    }
+
+    gsl::span<const byte> bytes() const
+    {
+        return gsl::span<const byte>(reinterpret_cast<const byte *>(ptr), length);
+    }
+
+    std::string str() const
+    {
+        return std::string(ptr, length);
+    }
+
+private:
+    const char *ptr;
+    size_t length;
+};
+
+inline bool operator==(string_ref a, string_ref b)
+{
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+inline bool operator!=(string_ref a, string_ref b)
+{
+    return !(a == b);
+}
+
 } // namespace mikado
 
 #endif //MIKADO_UTILS_H
@@ -87,11 +87,26 @@ public:
         return ++it;
     }
 
+    /// Number of bytes in the encoding
+    size_t size() const
+    {
+        size_t n = 1;
+        for (auto v = value >> 7; v != 0; v >>= 7)
+        {
+            ++n;
+        }
+        return n;
+    }
+
 private:
     const typename encoding_iterator::value_type value;
 };
 
-typedef vbi_encoder<uint16_t> vbi;
+typedef vbi_encoder<uint32_t> vbi;
+
+/// Largest value representable in the four bytes MQTT allows for a variable
+/// byte integer.
+constexpr uint32_t vbi_max = 268435455;
 
 /**
  * @brief The vbi_decoder class
@@ -104,19 +119,22 @@ typedef vbi_encoder<uint16_t> vbi;
  */
 class vbi_decoder{
 public:
-    typedef uint16_t value_type;
+    typedef uint32_t value_type;
 
     vbi_decoder() : value{0}, multiplier{0}, more_to_read{true}
     {}
 
+    /// Feed the next byte. Returns false when no further byte may follow,
+    /// i.e. after the fourth byte. If the decoder still wants more after that,
+    /// the encoded value was malformed.
     bool read_byte(byte b);
 
-    explicit operator value_type()
+    explicit operator value_type() const
     {
         return value;
     }
 
-    explicit operator bool()
+    explicit operator bool() const
     {
         return more_to_read;
     }
@@ -0,0 +1,196 @@
+#include "inflight.h"
+
+#include <algorithm>
+
+namespace mikado
+{
+
+namespace
+{
+
+constexpr size_t id_words = 65536 / 64;
+
+size_t lowest_bit(uint64_t w)
+{
+    return static_cast<size_t>(__builtin_ctzll(w));
+}
+
+} // namespace
+
+void packet_ids::allocate()
+{
+    if (used.empty())
+    {
+        used.resize(id_words);
+        // 0 is not a valid identifier
+        used[0] = 1;
+    }
+}
+
+uint16_t packet_ids::acquire()
+{
+    allocate();
+    for (size_t n = 0; n < id_words; ++n)
+    {
+        const auto w = (cursor + n) % id_words;
+        if (~used[w] != 0)
+        {
+            const auto bit = lowest_bit(~used[w]);
+            used[w] |= uint64_t{1} << bit;
+            ++count;
+            cursor = w;
+            return static_cast<uint16_t>(w * 64 + bit);
+        }
+    }
+    return 0;
+}
+
+bool packet_ids::acquire(uint16_t id)
+{
+    if (id == 0 || in_use(id))
+    {
+        return false;
+    }
+    allocate();
+    used[id / 64] |= uint64_t{1} << (id % 64);
+    ++count;
+    return true;
+}
+
+void packet_ids::release(uint16_t id)
+{
+    if (id == 0 || !in_use(id))
+    {
+        return;
+    }
+    used[id / 64] &= ~(uint64_t{1} << (id % 64));
+    --count;
+}
+
+bool packet_ids::in_use(uint16_t id) const
+{
+    return !used.empty() && (used[id / 64] >> (id % 64)) & 1;
+}
+
+size_t packet_ids::size() const
+{
+    return count;
+}
+
+void inflight_store::reserve(size_t window, size_t max_packet_size, packet_ids &ids)
+{
+    for (const auto &s : slots)
+    {
+        ids.release(s.packet_identifier);
+    }
+
+    window = std::min<size_t>(window, 65535);
+    arena.assign(window * max_packet_size, 0);
+    slots.assign(window, slot{});
+    rounds.assign(window, 0);
+    free_slots.assign((window + 63) / 64, 0);
+    for (size_t i = 0; i < window; ++i)
+    {
+        free_slots[i / 64] |= uint64_t{1} << (i % 64);
+    }
+    slot_size = max_packet_size;
+    used = 0;
+}
+
+size_t inflight_store::capacity() const
+{
+    return slots.size();
+}
+
+size_t inflight_store::size() const
+{
+    return used;
+}
+
+bool inflight_store::full() const
+{
+    return used == slots.size();
+}
+
+inflight_store::slot *inflight_store::acquire(packet_ids &ids)
+{
+    const auto word = std::find_if(free_slots.begin(), free_slots.end(), [](uint64_t w) { return w != 0; });
+    if (word == free_slots.end())
+    {
+        return nullptr;
+    }
+    const auto index = static_cast<size_t>(word - free_slots.begin()) * 64 + lowest_bit(*word);
+
+    // The identifiers of a slot are index + 1 + k * capacity, so find() gets
+    // from an identifier to its slot. Take the next one not used elsewhere.
+    const auto n = capacity();
+    const auto generations = (65535 - index - 1) / n + 1;
+    for (size_t tries = 0; tries < generations; ++tries)
+    {
+        auto &round = rounds[index];
+        if (index + 1 + round * n > 65535)
+        {
+            round = 0;
+        }
+        const auto id = static_cast<uint16_t>(index + 1 + round * n);
+        ++round;
+        if (ids.acquire(id))
+        {
+            *word &= ~(uint64_t{1} << (index % 64));
+            ++used;
+
+            auto &s = slots[index];
+            s.packet_identifier = id;
+            s.sequence = next_sequence++;
+            s.packet = gsl::make_span(arena.data() + index * slot_size, slot_size);
+            return &s;
+        }
+    }
+    return nullptr;
+}
+
+inflight_store::slot *inflight_store::find(uint16_t packet_identifier)
+{
+    if (packet_identifier == 0 || slots.empty())
+    {
+        return nullptr;
+    }
+    auto &s = slots[(packet_identifier - 1) % slots.size()];
+    return (s.packet_identifier == packet_identifier) ? &s : nullptr;
+}
+
+bool inflight_store::release(uint16_t packet_identifier, packet_ids &ids)
+{
+    const auto s = find(packet_identifier);
+    if (s == nullptr)
+    {
+        return false;
+    }
+
+    const auto index = static_cast<size_t>(s - slots.data());
+    free_slots[index / 64] |= uint64_t{1} << (index % 64);
+    --used;
+
+    ids.release(packet_identifier);
+    *s = slot{};
+    return true;
+}
+
+std::vector<inflight_store::slot *> inflight_store::in_order()
+{
+    std::vector<slot *> result;
+    for (auto &s : slots)
+    {
+        if (s.packet_identifier != 0)
+        {
+            result.push_back(&s);
+        }
+    }
+    // sequence numbers may wrap, compare by distance
+    std::sort(result.begin(), result.end(), [](const slot *a, const slot *b) {
+        return static_cast<int32_t>(a->sequence - b->sequence) < 0;
+    });
+    return result;
+}
+
+} // namespace mikado
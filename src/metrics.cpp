@@ -0,0 +1,55 @@
+#include <metrics.h>
+
+#include <numeric>
+
+namespace mikado
+{
+
+uint64_t metrics_snapshot::packets_total_in() const
+{
+    return std::accumulate(packets_in.begin(), packets_in.end(), uint64_t{0});
+}
+
+uint64_t metrics_snapshot::packets_total_out() const
+{
+    return std::accumulate(packets_out.begin(), packets_out.end(), uint64_t{0});
+}
+
+double metrics_snapshot::reads_per_packet() const
+{
+    return (packets_read == 0) ? 0.0 : static_cast<double>(reads) / packets_read;
+}
+
+metrics_snapshot metrics::snapshot() const
+{
+    metrics_snapshot s;
+    for (size_t i = 0; i < packets_in.size(); ++i)
+    {
+        s.packets_in[i] = packets_in[i].load(std::memory_order_relaxed);
+        s.packets_out[i] = packets_out[i].load(std::memory_order_relaxed);
+    }
+    s.bytes_in = bytes_in.load(std::memory_order_relaxed);
+    s.bytes_out = bytes_out.load(std::memory_order_relaxed);
+    s.callbacks = callbacks.load(std::memory_order_relaxed);
+    s.callback_time = std::chrono::nanoseconds(callback_ns.load(std::memory_order_relaxed));
+    s.reads = reads.load(std::memory_order_relaxed);
+    s.packets_read = packets_read.load(std::memory_order_relaxed);
+    s.read_errors = read_errors.load(std::memory_order_relaxed);
+    s.errors = errors.load(std::memory_order_relaxed);
+    return s;
+}
+
+void metrics::reset()
+{
+    for (size_t i = 0; i < packets_in.size(); ++i)
+    {
+        packets_in[i].store(0, std::memory_order_relaxed);
+        packets_out[i].store(0, std::memory_order_relaxed);
+    }
+    for (auto c : {&bytes_in, &bytes_out, &callbacks, &callback_ns, &reads, &packets_read, &read_errors, &errors})
+    {
+        c->store(0, std::memory_order_relaxed);
+    }
+}
+
+} // namespace mikado
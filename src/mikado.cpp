@@ -1,4 +1,7 @@
 #include "mikado.h"
+#include "mikado_impl.h"
+
+#include <algorithm>
 
 #include "utils.h"
 #include "packets.h"
@@ -20,8 +23,23 @@ void receiver::consume_byte(byte b)
         break;
 
     case receiver_state::got_type:
+    {
+        const auto may_continue = remaining_length.read_byte(b);
+        if (remaining_length)
+        {
+            // another remaining length byte follows, unless we already
+            // consumed the maximum of four
+            if (!may_continue)
+            {
+                m_state = receiver_state::error;
+                break;
+            }
+            read_until = cursor + 1;
+            break;
+        }
+
         // adjust how far to read
-        read_until = start + 2 + b;
+        read_until = cursor + static_cast<vbi_decoder::value_type>(remaining_length);
 
         if (cursor == read_until)
         {
@@ -31,6 +49,7 @@ void receiver::consume_byte(byte b)
         {
             m_state = receiver_state::msg_incomplete;
         }
+    }
         break;
 
     case receiver_state::msg_incomplete:
@@ -76,6 +95,27 @@ void receiver::advance_until(cbuf_t::iterator target)
 {
     while ((cursor < target) && (m_state != receiver_state::error))
     {
+        if (m_state == receiver_state::msg_incomplete)
+        {
+            // The remaining length is known, so there is nothing to lex in
+            // the body. Skip as far into it as we may in one step.
+            const auto until = std::min(target, read_until);
+            if (until > buf.end())
+            {
+                // trying to read over end of buffer
+                cursor = buf.end();
+                m_state = receiver_state::error;
+                return;
+            }
+
+            cursor = until;
+            if (cursor == read_until)
+            {
+                m_state = receiver_state::msg_complete;
+            }
+            continue;
+        }
+
         advance();
     }
 }
@@ -90,6 +130,7 @@ void receiver::reset()
     m_state = receiver_state::init;
     cursor = start;
     read_until = start + 2;
+    remaining_length = vbi_decoder{};
 }
 
 ptrdiff_t receiver::bytes_to_read() const
@@ -108,253 +149,24 @@ gsl::span<const byte> receiver::content() const
     return gsl::make_span(start, cursor);
 }
 
-mikado_sm::mikado_sm(Connection &_conn, callback_t _cb) : conn(_conn), cb{_cb}
-{
-}
-
-void mikado_sm::request_connect(const std::string &client)
-{
-    const auto msg = connect::Packet{client}.to_span(conn.get_send_buf());
-    conn.send(msg);
-    m_state = state_t::connection_requested;
-}
-
-void mikado_sm::subscribe(const std::string topic)
-{
-    const auto msg = subscribe::Packet{(5 << 8) + 9, topic}.to_span(conn.get_send_buf());
-    conn.send(msg);
-    m_state = state_t::subscribe_requested;
-}
-
-void mikado_sm::publish(const std::string &topic, const std::string &payload,
-                        bool retain)
-{
-    publish(cbuf_t(reinterpret_cast<const byte *>(topic.data()), topic.length()),
-            cbuf_t(reinterpret_cast<const byte *>(payload.data()), payload.length()));
-}
-
-void mikado_sm::publish(gsl::span<const byte> topic, gsl::span<const byte> payload, bool retain)
-{
-    const auto msg = publish::Packet{topic, payload}.to_span(conn.get_send_buf());
-    conn.send(msg);
-}
-
-void mikado_sm::process_packet(gsl::span<const byte> packet_buf)
-{
-    switch (m_state)
-    {
-    case state_t::connection_requested:
-        process_packet_conn_requested(packet_buf);
-        break;
-    case state_t::subscribe_requested:
-        process_packet_subscribe_requested(packet_buf);
-        break;
-    case state_t::connected:
-        process_packet_connected(packet_buf);
-        break;
-    case state_t::ping_await:
-        process_packet_ping_await(packet_buf);
-        break;
-    default:
-        // no state where we expect a packet
-        m_state = state_t::error;
-        break;
-    }
-}
-
-void mikado_sm::send_ping()
+Steady_clock::time_point Steady_clock::now()
 {
-    const auto msg = pingreq::Packet{}.to_span(conn.get_send_buf());
-    conn.send(msg);
-    m_state = state_t::ping_await;
+    return std::chrono::steady_clock::now();
 }
 
-void mikado_sm::send_disconnect()
+Clock &default_clock()
 {
-    const auto msg = disconnect::Packet{}.to_span(conn.get_send_buf());
-    conn.send(msg);
-    m_state = state_t::disconnected;
+    static Steady_clock c;
+    return c;
 }
 
-void mikado_sm::set_callback(callback_t _cb)
+int Connection::send_vectored(cbuf_t head, cbuf_t tail)
 {
-    cb = _cb;
-}
-
-void mikado_sm::reset()
-{
-    m_state = state_t::disconnected;
-}
-
-state_t mikado_sm::state() const
-{
-    return m_state;
-}
-
-void mikado_sm::process_packet_conn_requested(gsl::span<const byte> packet_buf)
-{
-    const auto packet_type = packet_buf[0];
-
-    switch (packet_type)
-    {
-    case packet_type::connack:
-    {
-        auto p = connack::Packet{};
-        const auto r = p.from_span(packet_buf);
-        if (r && p.return_code == connack::result_t::accepted)
-        {
-            m_state = state_t::connected;
-        }
-        else
-        {
-            m_state = state_t::error;
-        }
-    }
-        break;
-
-    default:
-        m_state = state_t::error;
-        break;
-    }
+    return send_copied(*this, head, tail);
 }
 
-void mikado_sm::process_packet_subscribe_requested(gsl::span<const byte> packet_buf)
-{
-    const auto packet_type = packet_buf[0];
-
-    switch (packet_type)
-    {
-    case packet_type::suback:
-    {
-        suback::Packet p{};
-        auto const r = p.from_span(packet_buf);
-        if (r && p.result == suback::result_t::max_QoS_0)
-        {
-            m_state = state_t::connected;
-        }
-        else
-        {
-            m_state = state_t::error;
-        }
-    }
-        break;
-    case packet_type::publish:
-    {
-        const auto r = handle_publish(packet_buf);
-        if(!r)
-        {
-            m_state = state_t::error;
-        }
-    }
-    default:
-        m_state = state_t::error;
-        break;
-    }
-}
-
-bool mikado::mikado_sm::handle_publish(gsl::span<const byte> packet_buf)
-{
-    publish::Packet p{};
-    auto const r = p.from_span(packet_buf);
-    if (r)
-    {
-        cb(p.topic, p.payload);
-        return true;
-    }
-    return false;
-}
-
-void mikado_sm::process_packet_connected(gsl::span<const byte> packet_buf)
-{
-    const auto packet_type = packet_buf[0];
-    switch (packet_type)
-    {
-    case packet_type::publish:
-    {
-        if (handle_publish(packet_buf))
-        {
-        }
-        else
-        {
-            m_state = state_t::error;
-        }
-    }
-        break;
-
-    default:
-        m_state = state_t::error;
-    }
-}
-
-void mikado_sm::process_packet_ping_await(gsl::span<const byte> packet_buf)
-{
-    const auto packet_type = packet_buf[0];
-    switch (packet_type)
-    {
-    case packet_type::publish:
-    {
-        if (handle_publish(packet_buf))
-        {
-        }
-        else
-        {
-            m_state = state_t::error;
-        }
-    }
-        break;
-    case packet_type::pingresp:
-    {
-        if (packet_buf[1] == 0)
-        {
-            m_state = state_t::connected;
-        }
-        else
-        {
-            m_state = state_t::error;
-        }
-    }
-        break;
-    default:
-        m_state = state_t::error;
-        break;
-    }
-}
-
-read_result Packet_reader::read_packet()
-{
-    const auto r = conn.read(
-                buf_t{cursor, static_cast<unsigned long>(rec.bytes_to_read())});
-    if (r < 0)
-    {
-        return read_result::read_error;
-    }
-
-    // if r > 0 -> we have read something and we're okay
-    // if r ==0 -> timeout, we still can continue scanning and check the
-    // state of rec
-
-    cursor += r;
-    rec.advance_until(cursor);
-
-    if (rec.state() == receiver_state::msg_complete)
-    {
-        return read_result::success;
-    }
-    else
-    {
-        return read_result::more_to_read;
-    }
-}
-
-cbuf_t Packet_reader::content() const
-{
-    return rec.content();
-}
-
-void Packet_reader::reset()
-{
-    cursor = read_buffer.begin();
-    rec.reset();
-}
+template class basic_packet_reader<Receiving_Connection>;
+template class basic_batch_reader<Receiving_Connection>;
+template class basic_mikado_sm<Connection>;
 
 }; // namespace mikado
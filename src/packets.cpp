@@ -1,31 +1,62 @@
 #include <packets.h>
 
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 #include "vbi.h"
 #include "utils.h"
 
 namespace mikado
+{
+namespace
 {
 
+    /// Serializes one packet of known remaining length.
+    ///
+    /// The constructor writes the fixed header and checks once that the
+    /// whole packet fits the buffer. The operator<< fill the body without
+    /// any further checks, so check the stream before filling it: it is
+    /// false if the packet cannot be encoded or does not fit.
     struct packet_stream
     {
         typedef gsl::span<byte> buf_t;
         typedef gsl::span<const byte> cbuf_t;
 
-        buf_t buf;
-        buf_t::iterator cursor;
+        byte *start;
+        byte *cursor;
 
-        packet_stream(const byte packet_header, buf_t _buf) : buf{_buf}, cursor{buf.begin() + 2}
+        /// trailing is the size of the end of the body which is sent after
+        /// the content, but not put into the stream.
+        packet_stream(const byte packet_header, const size_t remaining_length, buf_t buf,
+                      const size_t trailing = 0) : start{buf.data()}, cursor{nullptr}
         {
-            buf[0] = packet_header;
+            const auto size = packet_size(remaining_length);
+            if (size == 0 || trailing > remaining_length || size - trailing > buf.size())
+            {
+                return;
+            }
+
+            cursor = start;
+            *cursor++ = packet_header;
+            for (const auto b : vbi(static_cast<uint32_t>(remaining_length)))
+            {
+                *cursor++ = b;
+            }
+        }
+
+        explicit operator bool() const
+        {
+            return cursor != nullptr;
         }
 
         buf_t content()
         {
-            // add remaining_length info when returning content
-            buf[1] = cursor - buf.begin() - 2;
-            return gsl::make_span(buf.begin(), cursor);
+            if (cursor == nullptr)
+            {
+                return buf_t{};
+            }
+            return buf_t{start, cursor};
         }
 
         // put byte in target
@@ -44,51 +75,155 @@ namespace mikado
 
         packet_stream &operator<<(const cbuf_t value)
         {
-            const auto inserted = copy(value.begin(), value.end(),
-                                       cursor, buf.end());
-            cursor += inserted;
+            if (!value.empty())
+            {
+                std::memcpy(cursor, value.data(), value.size());
+                cursor += value.size();
+            }
             return *this;
         }
 
-        packet_stream &operator<<(const std::string &value)
+        packet_stream &operator<<(const string_ref value)
         {
-            const auto inserted = copy(value.begin(), value.end(),
-                                       cursor, buf.end());
-            cursor += inserted;
+            if (!value.empty())
+            {
+                std::memcpy(cursor, value.data(), value.size());
+                cursor += value.size();
+            }
             return *this;
         }
     };
 
+    /// Remaining length of a packet whose string fields do not fit their
+    /// two byte length prefix
+    constexpr size_t not_encodable = SIZE_MAX;
+
+    /// Remaining length taken by a length prefixed string
+    size_t string_length(const size_t size)
+    {
+        return size > UINT16_MAX ? not_encodable : 2 + size;
+    }
+
+    size_t remaining_length(const connect::Packet &p)
+    {
+        const auto client = string_length(p.clientID.size());
+        return client == not_encodable ? not_encodable
+                                       : 2 + sizeof(p.protocol_name) + 1 + 1 + 2 + client;
+    }
+
+    size_t remaining_length(const subscribe::Packet &p)
+    {
+        if (p.topic_filters.empty())
+        {
+            // a SUBSCRIBE without filters is a protocol violation
+            return not_encodable;
+        }
+        size_t length = 2;
+        for (const auto &topic_filter : p.topic_filters)
+        {
+            const auto filter = string_length(topic_filter.size());
+            if (filter == not_encodable)
+            {
+                return not_encodable;
+            }
+            length += filter + 1;
+        }
+        return length;
+    }
+
+    size_t remaining_length(const publish::Packet &p)
+    {
+        const auto topic = string_length(p.topic.size_bytes());
+        if (topic == not_encodable || p.payload.size_bytes() > vbi_max)
+        {
+            return not_encodable;
+        }
+        return topic + (p.QoS > 0 ? 2 : 0) + p.payload.size_bytes();
+    }
+
+} // namespace
+
+    size_t packet_size(const size_t remaining_length)
+    {
+        if (remaining_length > vbi_max)
+        {
+            return 0;
+        }
+        return 1 + vbi(static_cast<uint32_t>(remaining_length)).size() + remaining_length;
+    }
+
     gsl::span<byte> disconnect::Packet::to_span(gsl::span<byte> b)
     {
-        packet_stream s{packet_type::disconnect, b};
+        packet_stream s{packet_type::disconnect, 0, b};
         return s.content();
     }
 
+    size_t disconnect::Packet::size() const
+    {
+        return 2;
+    }
+
 } // namespace mikado
 
 constexpr mikado::byte mikado::connect::Packet::protocol_name[];
 
-mikado::connect::Packet::Packet(const std::string _clientID, const uint16_t _keep_alive, const mikado::byte _flags) : flags{_flags},
-                                                                                                                      keep_alive{_keep_alive}, clientID{_clientID}
+bool mikado::fixed_header::from_span(gsl::span<const mikado::byte> d)
+{
+    if (d.size() < 2)
+    {
+        return false;
+    }
+    type = d[0];
+
+    vbi_decoder length;
+    size_t pos = 1;
+    while (length)
+    {
+        if (pos == d.size() || !length.read_byte(d[pos++]))
+        {
+            break;
+        }
+    }
+    if (length)
+    {
+        // truncated or more than four length bytes
+        return false;
+    }
+
+    remaining_length = static_cast<vbi_decoder::value_type>(length);
+    size = pos;
+    return d.size() - size >= remaining_length;
+}
+
+mikado::connect::Packet::Packet(mikado::string_ref _clientID, const uint16_t _keep_alive, const mikado::byte _flags) : flags{_flags},
+                                                                                                                   keep_alive{_keep_alive}, clientID{_clientID}
 {
 }
 
 gsl::span<mikado::byte> mikado::connect::Packet::to_span(gsl::span<mikado::byte> buffer)
 {
-    packet_stream s{type, buffer};
+    packet_stream s{type, remaining_length(*this), buffer};
+    if (!s)
+    {
+        return {};
+    }
 
     s << static_cast<uint16_t>(sizeof(protocol_name))
       << protocol_name
       << mqtt_protocol_version
       << flags
       << keep_alive
-      << static_cast<uint16_t>(clientID.length())
+      << static_cast<uint16_t>(clientID.size())
       << clientID;
 
     return s.content();
 }
 
+size_t mikado::connect::Packet::size() const
+{
+    return packet_size(remaining_length(*this));
+}
+
 bool mikado::connack::Packet::from_span(gsl::span<const mikado::byte> d)
 {
     if (d[0] != packet_type::connack)
@@ -115,52 +250,112 @@ bool mikado::connack::Packet::from_span(gsl::span<const mikado::byte> d)
     return true;
 }
 
+mikado::subscribe::Packet::Packet()
+{
+}
+
 mikado::subscribe::Packet::Packet(uint16_t _packet_identifier,
-                                  const std::string &_topic_filter,
-                                  mikado::byte _QoS) : packet_identifier{_packet_identifier}, topic_filter{_topic_filter}, QoS{_QoS}
+                                  gsl::span<const mikado::string_ref> _topic_filters,
+                                  mikado::byte _QoS) : packet_identifier{_packet_identifier}, topic_filters(_topic_filters), QoS{_QoS}
 {
 }
 
 gsl::span<mikado::byte> mikado::subscribe::Packet::to_span(gsl::span<mikado::byte> d)
 {
     const uint8_t packet_head = (packet_type::subscribe | 0x2);
-    packet_stream s{packet_head, d};
+    packet_stream s{packet_head, remaining_length(*this), d};
+    if (!s)
+    {
+        return {};
+    }
 
-    s << packet_identifier
-      << static_cast<uint16_t>(topic_filter.length())
-      << topic_filter
-      << QoS;
+    s << packet_identifier;
+    for (const auto &topic_filter : topic_filters)
+    {
+        s << static_cast<uint16_t>(topic_filter.size())
+          << topic_filter
+          << QoS;
+    }
 
     return s.content();
 }
 
-bool mikado::suback::Packet::from_span(gsl::span<const mikado::byte> d)
+size_t mikado::subscribe::Packet::size() const
 {
-    if (d[0] != packet_type::suback)
+    return packet_size(remaining_length(*this));
+}
+
+bool mikado::subscribe::Packet::from_span(gsl::span<const mikado::byte> d)
+{
+    fixed_header h;
+    if (!h.from_span(d) || h.type != (packet_type::subscribe | 0x2) || h.remaining_length < 2 + 3)
     {
         return false;
     }
-    uint8_t remaining_length = d[1];
-    if (remaining_length != 3)
+    auto it = d.begin() + h.size;
+    const auto end = it + h.remaining_length;
+    packet_identifier = it[0] * 256 + it[1];
+    it += 2;
+
+    parsed.clear();
+    topic_filters = {};
+    QoS = 0;
+    while (it != end)
+    {
+        // length, filter and QoS byte
+        if (end - it < 3)
+        {
+            return false;
+        }
+        const auto length = static_cast<size_t>(it[0] * 256 + it[1]);
+        it += 2;
+        if (static_cast<size_t>(end - it) < length + 1 || it[length] > 2)
+        {
+            return false;
+        }
+        parsed.emplace_back(reinterpret_cast<const char *>(it), length);
+        QoS = std::max(QoS, it[length]);
+        it += length + 1;
+    }
+    topic_filters = parsed;
+    return true;
+}
+
+bool mikado::suback::Packet::from_span(gsl::span<const mikado::byte> d)
+{
+    fixed_header h;
+    if (!h.from_span(d) || h.type != packet_type::suback || h.remaining_length < 3)
     {
         return false;
     }
-    packet_identifier = d[2] * 256 + d[3];
+    const auto variable_header = d.begin() + h.size;
+    packet_identifier = variable_header[0] * 256 + variable_header[1];
 
     // we may be passed any byte value, so after conversion to enum class
     // I want to make sure the value is actually a defined enum value.
-    if ((d[4] >= 0 && d[4] <= 2) || d[4] == 0x80)
-    {
-        result = static_cast<result_t>(d[4]);
-    }
-    else
+    const auto codes = gsl::make_span(variable_header + 2, variable_header + h.remaining_length);
+    for (const auto c : codes)
     {
-        return false;
+        if (!(c <= 2 || c == 0x80))
+        {
+            return false;
+        }
     }
+    return_codes = codes;
 
     return true;
 }
 
+mikado::suback::result_t mikado::suback::Packet::result(size_t i) const
+{
+    return static_cast<result_t>(return_codes[i]);
+}
+
+size_t mikado::suback::Packet::size() const
+{
+    return return_codes.size();
+}
+
 mikado::publish::Packet::Packet()
 {
 }
@@ -173,14 +368,46 @@ mikado::publish::Packet::Packet(gsl::span<const mikado::byte> _topic,
 
 gsl::span<mikado::byte> mikado::publish::Packet::to_span(gsl::span<mikado::byte> b)
 {
-    const uint8_t first_byte = (packet_type::publish | QoS << 1 | retain);
-    packet_stream s{first_byte, b};
+    const uint8_t first_byte = (packet_type::publish | dup << 3 | QoS << 1 | retain);
+    packet_stream s{first_byte, remaining_length(*this), b};
+    if (!s)
+    {
+        return {};
+    }
+
     s << (uint16_t)topic.size_bytes()
-      << topic
-      << payload;
+      << topic;
+    if (QoS > 0)
+    {
+        s << packet_identifier;
+    }
+    s << payload;
     return s.content();
 }
 
+gsl::span<mikado::byte> mikado::publish::Packet::header_to_span(gsl::span<mikado::byte> b)
+{
+    const uint8_t first_byte = (packet_type::publish | dup << 3 | QoS << 1 | retain);
+    packet_stream s{first_byte, remaining_length(*this), b, payload.size_bytes()};
+    if (!s)
+    {
+        return {};
+    }
+
+    s << (uint16_t)topic.size_bytes()
+      << topic;
+    if (QoS > 0)
+    {
+        s << packet_identifier;
+    }
+    return s.content();
+}
+
+size_t mikado::publish::Packet::size() const
+{
+    return packet_size(remaining_length(*this));
+}
+
 bool mikado::publish::Packet::from_span(gsl::span<const mikado::byte> d)
 {
     if ((d[0] & 0xF0) != packet_type::publish)
@@ -188,23 +415,83 @@ bool mikado::publish::Packet::from_span(gsl::span<const mikado::byte> d)
         return false;
     }
     retain = (d[0] & 0x01);
-    QoS = (d[0] & 0x6);
-    if (QoS != 0)
+    QoS = (d[0] >> 1) & 0x3;
+    dup = (d[0] & 0x08);
+    if (QoS == 3)
+    {
+        return false;
+    }
+
+    fixed_header h;
+    if (!h.from_span(d) || h.remaining_length < 2)
+    {
+        return false;
+    }
+    const auto variable_header = d.begin() + h.size;
+    const auto end = variable_header + h.remaining_length;
+
+    uint16_t topic_length = variable_header[0] * 256 + variable_header[1];
+    if (topic_length > h.remaining_length - 2)
     {
-        // This parser does not support QoS 1 or 2 and will not deal with a
-        // packet identifier
         return false;
     }
+    topic = gsl::make_span(variable_header + 2, topic_length);
+
+    auto payload_start = topic.end();
+    if (QoS > 0)
+    {
+        if (end - payload_start < 2)
+        {
+            return false;
+        }
+        packet_identifier = payload_start[0] * 256 + payload_start[1];
+        if (packet_identifier == 0)
+        {
+            // MQTT 3.1.1, 2.3.1: non-zero for QoS 1 and 2
+            return false;
+        }
+        payload_start += 2;
+    }
+    payload = gsl::make_span(payload_start, end);
+    return true;
+}
+
+template <mikado::byte header>
+gsl::span<mikado::byte> mikado::ack_packet<header>::to_span(gsl::span<mikado::byte> d)
+{
+    packet_stream s{header, 2, d};
+    if (!s)
+    {
+        return {};
+    }
 
-    uint16_t topic_length = d[2] * 256 + d[3];
-    topic = gsl::make_span(&d[4], topic_length);
-    const auto payload_start = &d[4] + topic_length;
-    payload = gsl::make_span(payload_start, std::end(d));
+    s << packet_identifier;
+    return s.content();
+}
+
+template <mikado::byte header>
+bool mikado::ack_packet<header>::from_span(gsl::span<const mikado::byte> d)
+{
+    if (d.size() < 4 || d[0] != header || d[1] != 2)
+    {
+        return false;
+    }
+    packet_identifier = d[2] * 256 + d[3];
     return true;
 }
 
+template struct mikado::ack_packet<mikado::packet_type::puback>;
+template struct mikado::ack_packet<mikado::packet_type::pubrec>;
+template struct mikado::ack_packet<mikado::packet_type::pubrel | 0x2>;
+template struct mikado::ack_packet<mikado::packet_type::pubcomp>;
+
 gsl::span<mikado::byte> mikado::pingreq::Packet::to_span(gsl::span<mikado::byte> d)
 {
-    packet_stream s{packet_type::pingreq, d};
+    packet_stream s{packet_type::pingreq, 0, d};
     return s.content();
 }
+
+size_t mikado::pingreq::Packet::size() const
+{
+    return 2;
+}
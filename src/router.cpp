@@ -0,0 +1,293 @@
+#include "router.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace mikado
+{
+
+struct router::node
+{
+    typedef std::pair<std::string, std::unique_ptr<node>> child_t;
+
+    /// exact level children, sorted by level
+    std::vector<child_t> children;
+    /// child for the '+' level
+    std::unique_ptr<node> single;
+
+    /// handlers of filters ending at this node
+    std::vector<handler_t> handlers;
+    /// handlers of filters ending in '#' after this node
+    std::vector<handler_t> multi;
+
+    bool unused() const
+    {
+        return children.empty() && !single && handlers.empty() && multi.empty();
+    }
+};
+
+namespace
+{
+
+/// A topic level as a view into a filter or topic
+struct level_t
+{
+    const char *data;
+    size_t size;
+
+    bool operator==(const char *s) const
+    {
+        return size == std::strlen(s) && std::memcmp(data, s, size) == 0;
+    }
+};
+
+int compare(const std::string &s, const level_t &l)
+{
+    const auto r = std::memcmp(s.data(), l.data, std::min(s.size(), l.size));
+    if (r != 0)
+    {
+        return r;
+    }
+    return (s.size() < l.size) ? -1 : (s.size() > l.size);
+}
+
+/// Split s at '/' into levels
+std::vector<level_t> levels(const char *s, size_t size)
+{
+    std::vector<level_t> result;
+    const auto end = s + size;
+    auto begin = s;
+    while (true)
+    {
+        const auto sep = std::find(begin, end, '/');
+        result.push_back(level_t{begin, static_cast<size_t>(sep - begin)});
+        if (sep == end)
+        {
+            break;
+        }
+        begin = sep + 1;
+    }
+    return result;
+}
+
+template <class Children>
+auto find_child(Children &children, const level_t &l) -> decltype(children.begin())
+{
+    return std::lower_bound(children.begin(), children.end(), l,
+                            [](const router::node::child_t &c, const level_t &v) { return compare(c.first, v) < 0; });
+}
+
+} // namespace
+
+router::router() : root{new node}
+{
+}
+
+router::router(router &&) = default;
+router &router::operator=(router &&) = default;
+
+router::~router()
+{
+}
+
+bool router::valid_filter(const std::string &filter)
+{
+    if (filter.empty())
+    {
+        return false;
+    }
+
+    const auto ls = levels(filter.data(), filter.size());
+    for (size_t i = 0; i < ls.size(); ++i)
+    {
+        const auto &l = ls[i];
+        const auto wildcards = std::count_if(l.data, l.data + l.size,
+                                             [](char c) { return c == '+' || c == '#'; });
+        if (wildcards == 0)
+        {
+            continue;
+        }
+        // wildcards must occupy a whole level, '#' only the last one
+        if (l.size != 1 || (l == "#" && i + 1 != ls.size()))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool router::add(const std::string &filter, handler_t handler)
+{
+    if (!valid_filter(filter))
+    {
+        return false;
+    }
+
+    auto n = root.get();
+    for (const auto &l : levels(filter.data(), filter.size()))
+    {
+        if (l == "#")
+        {
+            n->multi.push_back(handler);
+            ++filter_count;
+            return true;
+        }
+
+        if (l == "+")
+        {
+            if (!n->single)
+            {
+                n->single.reset(new node);
+            }
+            n = n->single.get();
+            continue;
+        }
+
+        auto it = find_child(n->children, l);
+        if (it == n->children.end() || compare(it->first, l) != 0)
+        {
+            it = n->children.insert(it, node::child_t{std::string(l.data, l.size),
+                                                      std::unique_ptr<node>{new node}});
+        }
+        n = it->second.get();
+    }
+
+    n->handlers.push_back(handler);
+    ++filter_count;
+    return true;
+}
+
+namespace
+{
+
+/// Remove handlers of the filter given by levels [l, end) below n,
+/// pruning nodes which become unused. Returns the number removed.
+size_t remove_below(router::node &n, const level_t *l, const level_t *end)
+{
+    if (l == end)
+    {
+        const auto removed = n.handlers.size();
+        n.handlers.clear();
+        return removed;
+    }
+
+    if (*l == "#")
+    {
+        const auto removed = n.multi.size();
+        n.multi.clear();
+        return removed;
+    }
+
+    if (*l == "+")
+    {
+        if (!n.single)
+        {
+            return 0;
+        }
+        const auto removed = remove_below(*n.single, l + 1, end);
+        if (n.single->unused())
+        {
+            n.single.reset();
+        }
+        return removed;
+    }
+
+    const auto it = find_child(n.children, *l);
+    if (it == n.children.end() || compare(it->first, *l) != 0)
+    {
+        return 0;
+    }
+    const auto removed = remove_below(*it->second, l + 1, end);
+    if (it->second->unused())
+    {
+        n.children.erase(it);
+    }
+    return removed;
+}
+
+} // namespace
+
+bool router::remove(const std::string &filter)
+{
+    if (!valid_filter(filter))
+    {
+        return false;
+    }
+
+    const auto ls = levels(filter.data(), filter.size());
+    const auto removed = remove_below(*root, ls.data(), ls.data() + ls.size());
+    filter_count -= removed;
+    return removed > 0;
+}
+
+namespace
+{
+
+struct match_context
+{
+    gsl::span<const byte> topic;
+    gsl::span<const byte> payload;
+    /// Topics starting with '$' are not matched by wildcards in the first
+    /// level.
+    bool system_topic;
+};
+
+size_t call(const std::vector<router::handler_t> &handlers, const match_context &c)
+{
+    for (const auto &h : handlers)
+    {
+        h(c.topic, c.payload);
+    }
+    return handlers.size();
+}
+
+/// Match the topic levels from level on against n. level is nullptr once all
+/// levels are consumed, as a topic may end with an empty level.
+size_t match(const router::node &n, const byte *level, bool first, const match_context &c)
+{
+    const bool wildcards = !(first && c.system_topic);
+
+    size_t called = 0;
+    if (wildcards)
+    {
+        called += call(n.multi, c);
+    }
+
+    if (level == nullptr)
+    {
+        return called + call(n.handlers, c);
+    }
+
+    const auto end = c.topic.end();
+    const auto level_end = std::find(level, end, byte{'/'});
+    const auto next = (level_end == end) ? nullptr : level_end + 1;
+
+    const level_t l{reinterpret_cast<const char *>(level), static_cast<size_t>(level_end - level)};
+    const auto it = find_child(n.children, l);
+    if (it != n.children.end() && compare(it->first, l) == 0)
+    {
+        called += match(*it->second, next, false, c);
+    }
+
+    if (n.single && wildcards)
+    {
+        called += match(*n.single, next, false, c);
+    }
+
+    return called;
+}
+
+} // namespace
+
+size_t router::dispatch(gsl::span<const byte> topic, gsl::span<const byte> payload) const
+{
+    const match_context c{topic, payload, !topic.empty() && topic[0] == '$'};
+    return match(*root, topic.data(), true, c);
+}
+
+bool router::empty() const
+{
+    return filter_count == 0;
+}
+
+} // namespace mikado
@@ -0,0 +1,226 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace mikado
+{
+
+namespace
+{
+
+constexpr uint64_t no_tick = std::numeric_limits<uint64_t>::max();
+
+} // namespace
+
+timer::~timer()
+{
+    if (wheel != nullptr)
+    {
+        wheel->cancel(*this);
+    }
+}
+
+bool timer::scheduled() const
+{
+    return wheel != nullptr;
+}
+
+timer::time_point timer::expiry() const
+{
+    return at;
+}
+
+timer_wheel::timer_wheel(duration _resolution, time_point start) : resolution{_resolution}, origin{start}
+{
+    const auto representable = static_cast<uint64_t>((time_point::max() - origin) / resolution);
+    max_tick = std::min(representable, (uint64_t{1} << (slot_bits * levels)) - 1);
+}
+
+timer_wheel::~timer_wheel()
+{
+    for (auto head : buckets)
+    {
+        for (auto t = head; t != nullptr; t = t->next)
+        {
+            t->wheel = nullptr;
+        }
+    }
+}
+
+void timer_wheel::schedule(timer &t, time_point at)
+{
+    if (t.wheel != nullptr)
+    {
+        t.wheel->cancel(t);
+    }
+
+    t.at = at;
+    t.tick = std::min(std::max(tick_of(at, true), std::max(current, expiring) + 1), max_tick);
+    t.wheel = this;
+    link(t);
+    ++count;
+}
+
+void timer_wheel::cancel(timer &t)
+{
+    if (t.wheel != this)
+    {
+        return;
+    }
+
+    unlink(t);
+    t.wheel = nullptr;
+    --count;
+}
+
+size_t timer_wheel::expire(time_point now)
+{
+    if (now < origin)
+    {
+        return 0;
+    }
+
+    const auto target = tick_of(now, false);
+    expiring = target;
+    size_t run = 0;
+    for (auto next = next_tick(); next <= target; next = next_tick())
+    {
+        current = next;
+        for (size_t level = levels - 1; level > 0; --level)
+        {
+            cascade(level);
+        }
+
+        // callbacks may change the slot, take one timer at a time
+        auto &head = buckets[current % slots_per_level];
+        while (head != nullptr)
+        {
+            auto &t = *head;
+            cancel(t);
+            ++run;
+            if (t.callback)
+            {
+                t.callback();
+            }
+        }
+    }
+
+    // nothing is scheduled up to target, so no timer needs to move
+    current = std::max(current, target);
+    return run;
+}
+
+timer_wheel::time_point timer_wheel::next_expiry() const
+{
+    const auto tick = next_tick();
+    if (tick == no_tick)
+    {
+        return time_point::max();
+    }
+    return origin + resolution * static_cast<duration::rep>(tick);
+}
+
+size_t timer_wheel::size() const
+{
+    return count;
+}
+
+uint64_t timer_wheel::tick_of(time_point t, bool round_up) const
+{
+    if (t <= origin)
+    {
+        return 0;
+    }
+
+    const auto since = t - origin;
+    auto ticks = static_cast<uint64_t>(since / resolution);
+    if (round_up && since % resolution != duration{})
+    {
+        ++ticks;
+    }
+    return std::min(ticks, max_tick);
+}
+
+uint64_t timer_wheel::next_tick() const
+{
+    // Timers of a level lie behind all those of the levels below, as they
+    // differ from current in a higher digit. Within a level, slots behind
+    // current's digit are empty.
+    for (size_t level = 0; level < levels; ++level)
+    {
+        const auto shift = slot_bits * level;
+        const auto digit = (current >> shift) % slots_per_level;
+
+        // the slot at current's digit is cascaded already above level 0
+        const auto first = (level == 0) ? digit : digit + 1;
+        const auto candidates = (first < slots_per_level) ? occupied[level] & (~uint64_t{0} << first) : 0;
+        if (candidates != 0)
+        {
+            const auto slot = static_cast<uint64_t>(__builtin_ctzll(candidates));
+            const auto block = current >> (shift + slot_bits) << (shift + slot_bits);
+            return block | (slot << shift);
+        }
+    }
+    return no_tick;
+}
+
+void timer_wheel::link(timer &t)
+{
+    // the lowest level in which t does not share current's digit
+    const auto differing = t.tick ^ current;
+    size_t level = 0;
+    while (level + 1 < levels && (differing >> (slot_bits * (level + 1))) != 0)
+    {
+        ++level;
+    }
+    const auto slot = (t.tick >> (slot_bits * level)) % slots_per_level;
+
+    t.bucket = static_cast<uint16_t>(level * slots_per_level + slot);
+    auto &head = buckets[t.bucket];
+    t.prev = nullptr;
+    t.next = head;
+    if (head != nullptr)
+    {
+        head->prev = &t;
+    }
+    head = &t;
+    occupied[level] |= uint64_t{1} << slot;
+}
+
+void timer_wheel::unlink(timer &t)
+{
+    auto &head = buckets[t.bucket];
+    if (t.prev != nullptr)
+    {
+        t.prev->next = t.next;
+    }
+    else
+    {
+        head = t.next;
+    }
+    if (t.next != nullptr)
+    {
+        t.next->prev = t.prev;
+    }
+    t.prev = t.next = nullptr;
+
+    if (head == nullptr)
+    {
+        occupied[t.bucket / slots_per_level] &= ~(uint64_t{1} << (t.bucket % slots_per_level));
+    }
+}
+
+void timer_wheel::cascade(size_t level)
+{
+    const auto slot = (current >> (slot_bits * level)) % slots_per_level;
+    auto &head = buckets[level * slots_per_level + slot];
+    while (head != nullptr)
+    {
+        auto &t = *head;
+        unlink(t);
+        link(t);
+    }
+}
+
+} // namespace mikado
@@ -0,0 +1,174 @@
+#include <tracing.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace mikado
+{
+
+constexpr unsigned latency_histogram::linear_bits;
+constexpr unsigned latency_histogram::max_bits;
+constexpr size_t latency_histogram::bucket_count;
+constexpr size_t tracer::stamp_size;
+
+namespace
+{
+constexpr uint64_t linear_count = 1 << latency_histogram::linear_bits;
+constexpr uint64_t per_octave = linear_count / 2;
+} // namespace
+
+size_t latency_histogram::bucket(uint64_t ns)
+{
+    if (ns < linear_count)
+    {
+        return static_cast<size_t>(ns);
+    }
+    ns = std::min(ns, (uint64_t{1} << max_bits) - 1);
+
+    // [2^m, 2^(m+1)) splits into per_octave buckets 2^(m-6) wide
+    const unsigned m = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+    const unsigned shift = m - (linear_bits - 1);
+    return static_cast<size_t>(linear_count + (m - linear_bits) * per_octave + ((ns >> shift) - per_octave));
+}
+
+uint64_t latency_histogram::highest_in(size_t i)
+{
+    if (i < linear_count)
+    {
+        return i;
+    }
+    const auto k = i - linear_count;
+    const auto shift = static_cast<unsigned>(k / per_octave) + 1;
+    const auto lowest = (per_octave + k % per_octave) << shift;
+    return lowest + (uint64_t{1} << shift) - 1;
+}
+
+void latency_histogram::record(std::chrono::nanoseconds latency)
+{
+    const auto ns = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(latency.count(), 0));
+    counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    auto seen = max_ns.load(std::memory_order_relaxed);
+    while (ns > seen && !max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+histogram_snapshot latency_histogram::snapshot() const
+{
+    histogram_snapshot s;
+    s.counts.resize(bucket_count);
+    for (size_t i = 0; i < bucket_count; ++i)
+    {
+        s.counts[i] = counts[i].load(std::memory_order_relaxed);
+        s.count += s.counts[i];
+    }
+    s.max = std::chrono::nanoseconds(max_ns.load(std::memory_order_relaxed));
+    return s;
+}
+
+void latency_histogram::reset()
+{
+    for (auto &c : counts)
+    {
+        c.store(0, std::memory_order_relaxed);
+    }
+    max_ns.store(0, std::memory_order_relaxed);
+}
+
+std::chrono::nanoseconds histogram_snapshot::percentile(double p) const
+{
+    if (count == 0)
+    {
+        return std::chrono::nanoseconds{};
+    }
+    const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p / 100 * count)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            // a bucket's upper end may lie beyond anything recorded
+            return std::min(max, std::chrono::nanoseconds(latency_histogram::highest_in(i)));
+        }
+    }
+    return max;
+}
+
+histogram_snapshot &histogram_snapshot::operator+=(const histogram_snapshot &other)
+{
+    counts.resize(std::max(counts.size(), other.counts.size()));
+    for (size_t i = 0; i < other.counts.size(); ++i)
+    {
+        counts[i] += other.counts[i];
+    }
+    count += other.count;
+    max = std::max(max, other.max);
+    return *this;
+}
+
+bool tracer::stamp(gsl::span<byte> payload, clock::time_point t)
+{
+    if (payload.size() < stamp_size)
+    {
+        return false;
+    }
+    const auto rep = t.time_since_epoch().count();
+    std::memcpy(payload.data(), &rep, stamp_size);
+    return true;
+}
+
+bool tracer::read_stamp(gsl::span<const byte> payload, clock::time_point &t)
+{
+    if (payload.size() < stamp_size)
+    {
+        return false;
+    }
+    clock::rep rep;
+    std::memcpy(&rep, payload.data(), stamp_size);
+    t = clock::time_point{clock::duration{rep}};
+    return true;
+}
+
+void tracer::set_stamped_payloads(bool stamped)
+{
+    stamped_payloads = stamped;
+}
+
+void tracer::delivering(gsl::span<const byte> payload)
+{
+    const auto now = clock::now();
+    if (arrival != clock::time_point{})
+    {
+        arrival_to_callback.record(now - arrival);
+    }
+    if (entry != clock::time_point{})
+    {
+        entry_to_callback.record(now - entry);
+    }
+    clock::time_point published;
+    if (stamped_payloads && read_stamp(payload, published))
+    {
+        publish_to_callback.record(now - published);
+    }
+}
+
+trace_snapshot tracer::snapshot() const
+{
+    trace_snapshot s;
+    s.arrival_to_callback = arrival_to_callback.snapshot();
+    s.entry_to_callback = entry_to_callback.snapshot();
+    s.publish_to_callback = publish_to_callback.snapshot();
+    return s;
+}
+
+void tracer::reset()
+{
+    arrival_to_callback.reset();
+    entry_to_callback.reset();
+    publish_to_callback.reset();
+}
+
+} // namespace mikado
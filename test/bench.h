@@ -0,0 +1,180 @@
+#ifndef MIKADO_BENCH_H
+#define MIKADO_BENCH_H
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "counting_allocator.h"
+
+/// Minimal microbenchmark helpers.
+///
+/// A benchmark is a callable doing one operation. run() calls it in batches
+/// until a minimum wall time has passed and reports time per operation,
+/// heap allocations per operation and, if the operation processes a known
+/// amount of data, throughput.
+///
+/// Allocations are counted by replacing the global operator new, see
+/// counting_allocator.h, so this header must be included by exactly one
+/// translation unit of a benchmark.
+namespace bench
+{
+
+using counting_allocator::allocations;
+
+/// Keep the compiler from optimizing away a computed value.
+template <class T>
+inline void do_not_optimize(T const &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct result
+{
+    std::string name;
+    double ns_per_op;
+    double bytes_per_sec;
+    double allocs_per_op;
+};
+
+enum class format
+{
+    text,
+    /// one header line, then a line per benchmark
+    csv,
+    /// one JSON object per line
+    json
+};
+
+struct options
+{
+    format output = format::text;
+    /// run only benchmarks whose name contains this
+    std::string filter;
+};
+
+inline options &settings()
+{
+    static options o;
+    return o;
+}
+
+/// Take --format=text|csv|json and --filter=<part of name> from the
+/// command line. Returns false on anything else, after printing usage.
+inline bool parse_args(int argc, char **argv)
+{
+    auto &o = settings();
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--format=text")
+        {
+            o.output = format::text;
+        }
+        else if (arg == "--format=csv")
+        {
+            o.output = format::csv;
+            std::cout << "name,ns_per_op,bytes_per_sec,allocs_per_op" << std::endl;
+        }
+        else if (arg == "--format=json")
+        {
+            o.output = format::json;
+        }
+        else if (arg.compare(0, 9, "--filter=") == 0)
+        {
+            o.filter = arg.substr(9);
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--format=text|csv|json] [--filter=<name part>]" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void report(const result &r)
+{
+    switch (settings().output)
+    {
+    case format::csv:
+        std::cout << r.name << ',' << std::fixed << std::setprecision(3) << r.ns_per_op << ','
+                  << std::setprecision(0) << r.bytes_per_sec << ','
+                  << std::setprecision(3) << r.allocs_per_op << std::endl;
+        break;
+    case format::json:
+        // names are plain identifiers and slashes, nothing to escape
+        std::cout << "{\"name\": \"" << r.name << "\", "
+                  << std::fixed << std::setprecision(3) << "\"ns_per_op\": " << r.ns_per_op << ", "
+                  << std::setprecision(0) << "\"bytes_per_sec\": " << r.bytes_per_sec << ", "
+                  << std::setprecision(3) << "\"allocs_per_op\": " << r.allocs_per_op << "}" << std::endl;
+        break;
+    case format::text:
+        std::cout << std::left << std::setw(48) << r.name
+                  << std::right << std::setw(12) << std::fixed << std::setprecision(1)
+                  << r.ns_per_op << " ns/op";
+        if (r.bytes_per_sec > 0)
+        {
+            std::cout << std::setw(12) << std::setprecision(1)
+                      << r.bytes_per_sec / (1024 * 1024) << " MiB/s";
+        }
+        if (r.allocs_per_op > 0)
+        {
+            std::cout << std::setw(10) << std::setprecision(2)
+                      << r.allocs_per_op << " allocs/op";
+        }
+        std::cout << std::endl;
+        break;
+    }
+}
+
+/// Run op until min_time has passed. bytes is the amount of data one call
+/// of op processes, or 0 if throughput is meaningless.
+///
+/// Benchmarks filtered out by --filter are not run, their result is all 0.
+template <class Op>
+result run(const std::string &name, size_t bytes, Op op,
+           std::chrono::milliseconds min_time = std::chrono::milliseconds(200))
+{
+    typedef std::chrono::steady_clock clock;
+
+    if (name.find(settings().filter) == std::string::npos)
+    {
+        return result{name, 0, 0, 0};
+    }
+
+    // warm up caches and branch predictors
+    op();
+
+    size_t iterations = 0;
+    size_t batch = 1;
+    const size_t allocated = allocations();
+    const auto start = clock::now();
+    auto elapsed = clock::duration{0};
+    while (elapsed < min_time)
+    {
+        for (size_t i = 0; i < batch; ++i)
+        {
+            op();
+        }
+        iterations += batch;
+        batch *= 2;
+        elapsed = clock::now() - start;
+    }
+
+    // counted before copying name into the result allocates
+    const auto allocs = allocations() - allocated;
+    const double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    result r{name, ns / iterations, 0, static_cast<double>(allocs) / iterations};
+    if (bytes > 0)
+    {
+        r.bytes_per_sec = bytes * iterations / (ns * 1e-9);
+    }
+    report(r);
+    return r;
+}
+
+} // namespace bench
+
+#endif // MIKADO_BENCH_H
@@ -0,0 +1,258 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mikado.h"
+
+#include "bench.h"
+#include "loopback_broker.h"
+
+using namespace mikado;
+
+/// End-to-end throughput and latency through loopback_broker, entirely
+/// offline: a publisher and a subscriber, each a mikado_sm in this thread,
+/// the broker in its own. Every payload carries the time it was published,
+/// the subscriber's tracer measures it against the callback, as well as the
+/// time the packet was read.
+
+namespace
+{
+
+typedef std::chrono::steady_clock clock;
+
+const std::string topic = "bench/e2e";
+constexpr size_t payload_size = 64;
+
+/// Blocking sends, non-blocking reads
+struct fd_connection : public Connection, public Packet_reader::Receiving_Connection
+{
+    explicit fd_connection(int _fd) : fd{_fd}
+    {
+    }
+
+    ~fd_connection()
+    {
+        close(fd);
+    }
+
+    virtual buf_t get_send_buf() override
+    {
+        return send_buffer;
+    }
+
+    virtual int send(cbuf_t data) override
+    {
+        size_t done = 0;
+        while (done < data.size())
+        {
+            const auto r = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (r < 0)
+            {
+                return -1;
+            }
+            done += r;
+        }
+        return static_cast<int>(done);
+    }
+
+    virtual int read(buf_t b) override
+    {
+        const auto r = recv(fd, b.data(), b.size(), MSG_DONTWAIT);
+        if (r > 0)
+        {
+            return static_cast<int>(r);
+        }
+        return (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+
+    int fd;
+    std::array<byte, 4096> send_buffer;
+};
+
+struct client
+{
+    client(int fd, callback_t cb) : conn{fd}, sm{conn, cb}, reader{conn, read_buffer}
+    {
+    }
+
+    void trace(tracer &t)
+    {
+        sm.set_tracer(&t);
+        reader.set_tracer(&t);
+    }
+
+    void receive()
+    {
+        if (reader.drain([this](cbuf_t p) { sm.process_packet(p); }) == read_result::read_error)
+        {
+            throw std::runtime_error("connection to broker lost");
+        }
+    }
+
+    fd_connection conn;
+    mikado_sm sm;
+    std::array<byte, 64 * 1024> read_buffer;
+    Batch_reader reader;
+};
+
+int tcp_connect(uint16_t port)
+{
+    const auto fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+    {
+        throw std::runtime_error("could not connect to loopback broker");
+    }
+    const int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+/// Block until the broker sent something to a or b, rather than spinning
+/// on non-blocking reads and competing with the broker for the CPU
+void wait_readable(const client &a, const client &b)
+{
+    pollfd fds[] = {{a.conn.fd, POLLIN, 0}, {b.conn.fd, POLLIN, 0}};
+    poll(fds, 2, 100);
+}
+
+struct scenario
+{
+    std::string name;
+    link_profile profile;
+    bool tcp;
+    uint8_t QoS;
+    /// messages published and not yet received, at most
+    size_t window;
+    size_t messages;
+};
+
+void report_percentiles(const std::string &name, const histogram_snapshot &h)
+{
+    for (const auto p : {50.0, 99.0, 99.9})
+    {
+        const auto label = (p == 99.9) ? std::string{"p999"} : "p" + std::to_string(static_cast<int>(p));
+        bench::report(bench::result{name + "_" + label, static_cast<double>(h.percentile(p).count()), 0, 0});
+    }
+}
+
+void run(const scenario &s)
+{
+    if (s.name.find(bench::settings().filter) == std::string::npos)
+    {
+        return;
+    }
+
+    loopback_broker broker{s.profile};
+    int publisher_fd, subscriber_fd;
+    if (s.tcp)
+    {
+        const auto port = broker.listen();
+        if (port == 0)
+        {
+            throw std::runtime_error("could not listen on loopback");
+        }
+        publisher_fd = tcp_connect(port);
+        subscriber_fd = tcp_connect(port);
+    }
+    else
+    {
+        publisher_fd = broker.connect_client();
+        subscriber_fd = broker.connect_client();
+    }
+    broker.start();
+
+    size_t received = 0;
+    client subscriber{subscriber_fd, [&received](cbuf_t, cbuf_t) { ++received; }};
+    tracer latencies;
+    latencies.set_stamped_payloads(true);
+    subscriber.trace(latencies);
+    client publisher{publisher_fd, [](cbuf_t, cbuf_t) {}};
+    if (s.QoS > 0)
+    {
+        publisher.sm.set_inflight_window(s.window, 256);
+    }
+
+    subscriber.sm.request_connect("subscriber");
+    subscriber.sm.subscribe(topic);
+    publisher.sm.request_connect("publisher");
+    while (subscriber.sm.state() != state_t::connected || publisher.sm.session() != session_t::connected)
+    {
+        wait_readable(publisher, subscriber);
+        subscriber.receive();
+        publisher.receive();
+    }
+
+    std::vector<byte> payload(payload_size, 'x');
+    const size_t allocated = bench::allocations();
+    const auto start = clock::now();
+    size_t sent = 0;
+    while (received < s.messages)
+    {
+        while (sent < s.messages && sent - received < s.window)
+        {
+            tracer::stamp(payload);
+            if (!publisher.sm.publish(gsl::make_span(reinterpret_cast<const byte *>(topic.data()), topic.size()),
+                                      payload, false, s.QoS))
+            {
+                // in-flight window full, wait for acknowledgements
+                break;
+            }
+            ++sent;
+        }
+        wait_readable(publisher, subscriber);
+        publisher.receive();
+        subscriber.receive();
+    }
+    const double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+    // allocations of the broker are included
+    bench::report(bench::result{s.name + "/throughput", ns / s.messages, payload_size * s.messages / (ns * 1e-9),
+                                static_cast<double>(bench::allocations() - allocated) / s.messages});
+    const auto traced = latencies.snapshot();
+    report_percentiles(s.name + "/latency", traced.publish_to_callback);
+    report_percentiles(s.name + "/read_to_callback", traced.arrival_to_callback);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (!bench::parse_args(argc, argv))
+    {
+        return 1;
+    }
+
+    const link_profile unshaped{};
+    link_profile distant;
+    distant.latency = std::chrono::microseconds(500);
+    link_profile narrow;
+    narrow.bytes_per_sec = 10 * 1024 * 1024;
+
+    const scenario scenarios[] = {
+        {"e2e/socketpair/qos0/window_1", unshaped, false, 0, 1, 5000},
+        {"e2e/socketpair/qos0/window_64", unshaped, false, 0, 64, 50000},
+        {"e2e/socketpair/qos1/window_64", unshaped, false, 1, 64, 50000},
+        {"e2e/tcp/qos0/window_1", unshaped, true, 0, 1, 5000},
+        {"e2e/tcp/qos0/window_64", unshaped, true, 0, 64, 50000},
+        {"e2e/latency_500us/qos0/window_1", distant, false, 0, 1, 1000},
+        {"e2e/latency_500us/qos0/window_64", distant, false, 0, 64, 20000},
+        {"e2e/10MiBps/qos0/window_64", narrow, false, 0, 64, 20000},
+    };
+    for (const auto &s : scenarios)
+    {
+        run(s);
+    }
+    return 0;
+}
@@ -0,0 +1,529 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mikado.h"
+#include "mikado_impl.h"
+
+#include "bench.h"
+
+using namespace mikado;
+
+/// Microbenchmarks of the hot paths: lexing, reading, the codecs and
+/// dispatch in mikado_sm. Run with --format=csv or --format=json for output
+/// to compare between releases.
+
+namespace
+{
+
+const std::vector<byte> topic = {'s', 'e', 'n', 's', 'o', 'r', '/', '1'};
+
+/// A PUBLISH packet carrying payload_size bytes
+std::vector<byte> publish_packet(size_t payload_size, uint8_t QoS = 0)
+{
+    const std::vector<byte> payload(payload_size, 'x');
+    auto p = publish::Packet{topic, payload};
+    p.QoS = QoS;
+    p.packet_identifier = QoS ? 1 : 0;
+    std::vector<byte> packet(p.size());
+    p.to_span(packet);
+    return packet;
+}
+
+/// Build a stream of count PUBLISH packets, each carrying payload_size bytes.
+std::vector<byte> publish_stream(size_t count, size_t payload_size)
+{
+    const auto packet = publish_packet(payload_size);
+    std::vector<byte> stream;
+    for (size_t i = 0; i < count; ++i)
+    {
+        stream.insert(stream.end(), packet.begin(), packet.end());
+    }
+    return stream;
+}
+
+/// Frame all packets in stream, feeding the receiver byte by byte.
+size_t frame_bytewise(cbuf_t stream)
+{
+    size_t packets = 0;
+    auto it = stream.begin();
+    while (it != stream.end())
+    {
+        receiver rec{gsl::make_span(it, stream.end())};
+        while (rec)
+        {
+            rec.advance(rec.bytes_to_read());
+        }
+        it += rec.content().size();
+        ++packets;
+    }
+    return packets;
+}
+
+/// Frame all packets in stream, letting the receiver skip over bodies.
+size_t frame_bulk(cbuf_t stream)
+{
+    size_t packets = 0;
+    auto it = stream.begin();
+    while (it != stream.end())
+    {
+        receiver rec{gsl::make_span(it, stream.end())};
+        auto until = it;
+        while (rec)
+        {
+            until += rec.bytes_to_read();
+            rec.advance_until(until);
+        }
+        it += rec.content().size();
+        ++packets;
+    }
+    return packets;
+}
+
+/// Serves a stream from memory, at most segment bytes per read() as a
+/// socket would.
+struct memory_connection : public Packet_reader::Receiving_Connection
+{
+    memory_connection(cbuf_t _stream, size_t _segment) : stream{_stream}, segment{_segment}
+    {
+    }
+
+    virtual int read(buf_t buf) override
+    {
+        const auto n = std::min({static_cast<size_t>(buf.size()), segment, stream.size() - pos});
+        std::memcpy(buf.data(), stream.data() + pos, n);
+        pos += n;
+        return static_cast<int>(n);
+    }
+
+    cbuf_t stream;
+    size_t segment;
+    size_t pos = 0;
+};
+
+size_t read_packets(cbuf_t stream, size_t segment)
+{
+    memory_connection conn{stream, segment};
+    std::array<byte, 64 * 1024> buf;
+    Packet_reader reader{conn, buf};
+
+    size_t packets = 0;
+    while (conn.pos < stream.size())
+    {
+        if (reader.read_packet() == read_result::success)
+        {
+            ++packets;
+            reader.reset();
+        }
+    }
+    return packets;
+}
+
+size_t batch_read_packets(cbuf_t stream, size_t segment)
+{
+    memory_connection conn{stream, segment};
+    std::array<byte, 64 * 1024> buf;
+    Batch_reader reader{conn, buf};
+
+    size_t packets = 0;
+    while (conn.pos < stream.size())
+    {
+        reader.drain([&packets](cbuf_t) { ++packets; });
+    }
+    return packets;
+}
+
+/// Sends into the void
+struct null_connection : public Connection
+{
+    virtual buf_t get_send_buf() override
+    {
+        return buf;
+    }
+
+    virtual int send(cbuf_t data) override
+    {
+        last = data;
+        return 0;
+    }
+
+    std::array<byte, 64 * 1024> buf;
+    /// the packet sent last, valid until its buffer is reused
+    cbuf_t last;
+};
+
+/// null_connection without virtual functions, for basic_mikado_sm
+struct static_null_connection
+{
+    buf_t get_send_buf()
+    {
+        return buf;
+    }
+
+    int send(cbuf_t data)
+    {
+        last = data;
+        return 0;
+    }
+
+    int send_vectored(cbuf_t head, cbuf_t tail)
+    {
+        return send_copied(*this, head, tail);
+    }
+
+    std::array<byte, 64 * 1024> buf;
+    cbuf_t last;
+};
+
+template <class Packet>
+void bench_ack(const std::string &name)
+{
+    std::array<byte, 4> buf;
+    Packet p{42};
+    const auto wire = std::vector<byte>(p.to_span(buf).begin(), p.to_span(buf).end());
+
+    bench::run(name + "/to_span", wire.size(), [&]() {
+        Packet a{42};
+        bench::do_not_optimize(a.to_span(buf).size());
+    });
+    bench::run(name + "/from_span", wire.size(), [&]() {
+        Packet a;
+        bench::do_not_optimize(a.from_span(wire));
+        bench::do_not_optimize(a.packet_identifier);
+    });
+}
+
+void bench_receiver()
+{
+    const auto large = publish_stream(16, 60 * 1024);
+    const auto tiny = publish_stream(16 * 1024, 16);
+
+    bench::run("receiver/bytewise/large_publish", large.size(),
+               [&]() { bench::do_not_optimize(frame_bytewise(large)); });
+    bench::run("receiver/bulk/large_publish", large.size(),
+               [&]() { bench::do_not_optimize(frame_bulk(large)); });
+    bench::run("receiver/bytewise/tiny_publish", tiny.size(),
+               [&]() { bench::do_not_optimize(frame_bytewise(tiny)); });
+    bench::run("receiver/bulk/tiny_publish", tiny.size(),
+               [&]() { bench::do_not_optimize(frame_bulk(tiny)); });
+}
+
+void bench_readers()
+{
+    const auto large = publish_stream(16, 60 * 1024);
+    const auto tiny = publish_stream(16 * 1024, 16);
+    // a typical TCP segment
+    constexpr size_t segment = 1460;
+
+    bench::run("packet_reader/read_packet/large_publish", large.size(),
+               [&]() { bench::do_not_optimize(read_packets(large, segment)); });
+    bench::run("packet_reader/read_packet/tiny_publish", tiny.size(),
+               [&]() { bench::do_not_optimize(read_packets(tiny, segment)); });
+    bench::run("batch_reader/drain/large_publish", large.size(),
+               [&]() { bench::do_not_optimize(batch_read_packets(large, segment)); });
+    bench::run("batch_reader/drain/tiny_publish", tiny.size(),
+               [&]() { bench::do_not_optimize(batch_read_packets(tiny, segment)); });
+}
+
+void bench_codecs()
+{
+    std::array<byte, 2048> buf;
+
+    auto c = connect::Packet{"bench-client", 60};
+    bench::run("connect/to_span", c.to_span(buf).size(),
+               [&]() { bench::do_not_optimize(c.to_span(buf).size()); });
+
+    const std::vector<byte> connack_wire = {packet_type::connack, 2, 0, 0};
+    bench::run("connack/from_span", connack_wire.size(), [&]() {
+        connack::Packet p;
+        bench::do_not_optimize(p.from_span(connack_wire));
+        bench::do_not_optimize(p.return_code);
+    });
+
+    for (const size_t payload_size : {16, 1024})
+    {
+        const std::vector<byte> payload(payload_size, 'x');
+        const auto wire = publish_packet(payload_size, 1);
+        const auto suffix = "/payload_" + std::to_string(payload_size);
+
+        bench::run("publish/to_span" + suffix, wire.size(), [&]() {
+            auto p = publish::Packet{topic, payload};
+            p.QoS = 1;
+            p.packet_identifier = 1;
+            bench::do_not_optimize(p.to_span(buf).size());
+        });
+        bench::run("publish/header_to_span" + suffix, wire.size() - payload_size, [&]() {
+            auto p = publish::Packet{topic, payload};
+            bench::do_not_optimize(p.header_to_span(buf).size());
+        });
+        bench::run("publish/from_span" + suffix, wire.size(), [&]() {
+            publish::Packet p;
+            bench::do_not_optimize(p.from_span(wire));
+            bench::do_not_optimize(p.payload.size());
+        });
+    }
+
+    const string_ref filters[] = {"sensor/+/temperature", "sensor/+/humidity", "control/#"};
+    auto one = subscribe::Packet{1, gsl::make_span(filters, 1)};
+    bench::run("subscribe/to_span/one_filter", one.to_span(buf).size(),
+               [&]() { bench::do_not_optimize(one.to_span(buf).size()); });
+    auto three = subscribe::Packet{2, filters};
+    bench::run("subscribe/to_span/three_filters", three.to_span(buf).size(),
+               [&]() { bench::do_not_optimize(three.to_span(buf).size()); });
+
+    const std::vector<byte> suback_wire = {packet_type::suback, 5, 0, 2, 0, 1, 0x80};
+    bench::run("suback/from_span/three_codes", suback_wire.size(), [&]() {
+        suback::Packet p;
+        bench::do_not_optimize(p.from_span(suback_wire));
+        bench::do_not_optimize(p.result(2));
+    });
+
+    bench_ack<puback::Packet>("puback");
+    bench_ack<pubrec::Packet>("pubrec");
+    bench_ack<pubrel::Packet>("pubrel");
+    bench_ack<pubcomp::Packet>("pubcomp");
+
+    bench::run("pingreq/to_span", 2,
+               [&]() { bench::do_not_optimize(pingreq::Packet{}.to_span(buf).size()); });
+    bench::run("disconnect/to_span", 2,
+               [&]() { bench::do_not_optimize(disconnect::Packet{}.to_span(buf).size()); });
+}
+
+void bench_vbi()
+{
+    // the largest value of each encoded length
+    const std::array<uint32_t, 4> values = {127, 16383, 2097151, vbi_max};
+    for (size_t n = 0; n < values.size(); ++n)
+    {
+        const auto value = values[n];
+        const auto name = std::to_string(n + 1) + "_bytes";
+
+        std::array<byte, 4> encoded;
+        std::copy(vbi(value).begin(), vbi::end(), encoded.begin());
+
+        bench::run("vbi/encode/" + name, n + 1, [&]() {
+            auto out = encoded.begin();
+            for (const auto b : vbi(value))
+            {
+                *out++ = b;
+            }
+            bench::do_not_optimize(encoded);
+        });
+        bench::run("vbi/decode/" + name, n + 1, [&]() {
+            vbi_decoder d;
+            for (auto it = encoded.begin(); d && it != encoded.end(); ++it)
+            {
+                d.read_byte(*it);
+            }
+            bench::do_not_optimize(vbi_decoder::value_type(d));
+        });
+    }
+}
+
+/// Transport staging header and payload in a send buffer large enough for
+/// the largest payload benchmarked
+struct staging_connection
+{
+    buf_t get_send_buf()
+    {
+        return buf;
+    }
+
+    int send(cbuf_t data)
+    {
+        return data.size();
+    }
+
+    std::vector<byte> buf = std::vector<byte>(256 * 1024 + 64);
+};
+
+void bench_copy()
+{
+    for (const size_t payload_size : {16, 256, 4 * 1024, 64 * 1024, 256 * 1024})
+    {
+        const std::vector<byte> payload(payload_size, 'x');
+        std::vector<byte> out(payload_size + 64);
+        const auto suffix = "/" + std::to_string(payload_size);
+
+        // vector iterators are no pointers, they take the element loop
+        bench::run("copy/bytewise" + suffix, payload_size, [&]() {
+            bench::do_not_optimize(copy(payload.begin(), payload.end(), out.begin(), out.end()));
+        });
+        bench::run("copy/contiguous" + suffix, payload_size, [&]() {
+            bench::do_not_optimize(copy(payload, out));
+        });
+
+        bench::run("publish/to_span/payload" + suffix, payload_size, [&]() {
+            auto p = publish::Packet{topic, payload};
+            bench::do_not_optimize(p.to_span(out).size());
+        });
+
+        staging_connection conn;
+        std::array<byte, 16> header_buf;
+        const auto header = publish::Packet{topic, payload}.header_to_span(header_buf);
+        bench::run("send_copied/payload" + suffix, payload_size, [&]() {
+            bench::do_not_optimize(send_copied(conn, header, payload));
+        });
+    }
+}
+
+void bench_dispatch()
+{
+    const std::vector<byte> connack_wire = {packet_type::connack, 2, 0, 0};
+    const auto publish_wire = publish_packet(16);
+    size_t delivered = 0;
+
+    {
+        null_connection conn;
+        mikado_sm sm{conn, [&delivered](cbuf_t, cbuf_t) { ++delivered; }};
+        sm.request_connect("bench");
+        sm.process_packet(connack_wire);
+
+        bench::run("process_packet/publish/callback", publish_wire.size(),
+                   [&]() { sm.process_packet(publish_wire); });
+
+        sm.subscribe("sensor/+", [&delivered](cbuf_t, cbuf_t) { ++delivered; });
+        bench::run("process_packet/publish/router", publish_wire.size(),
+                   [&]() { sm.process_packet(publish_wire); });
+
+        static const auto table = make_topic_table("sensor/0", "sensor/1", "sensor/2");
+        const std::array<callback_t, 3> handlers = {
+            [&delivered](cbuf_t, cbuf_t) { ++delivered; },
+            [&delivered](cbuf_t, cbuf_t) { ++delivered; },
+            [&delivered](cbuf_t, cbuf_t) { ++delivered; }};
+        sm.set_topic_handlers(table.index(), handlers);
+        bench::run("process_packet/publish/topic_table", publish_wire.size(),
+                   [&]() { sm.process_packet(publish_wire); });
+
+        const std::vector<byte> pingresp_wire = {packet_type::pingresp, 0};
+        bench::run("process_packet/pingresp", pingresp_wire.size(),
+                   [&]() { sm.process_packet(pingresp_wire); });
+    }
+
+    {
+        null_connection conn;
+        mikado_sm sm{conn};
+        sm.request_connect("bench");
+        sm.process_packet(connack_wire);
+        sm.set_inflight_window(16, 128);
+
+        const auto qos1_wire = publish_packet(16, 1);
+        bench::run("process_packet/publish_qos1", qos1_wire.size(),
+                   [&]() { sm.process_packet(qos1_wire); });
+
+        // one message through the window: publish, then its PUBACK
+        const std::vector<byte> payload(16, 'x');
+        const auto id_offset = 2 + 2 + topic.size();
+        std::array<byte, 4> puback_buf;
+        bench::run("publish_qos1/puback_roundtrip", payload.size(), [&]() {
+            sm.publish(topic, payload, false, 1);
+            // identifiers change from message to message, answer the one sent
+            const auto id = static_cast<uint16_t>(conn.last[id_offset] << 8 | conn.last[id_offset + 1]);
+            sm.process_packet(puback::Packet{id}.to_span(puback_buf));
+        });
+    }
+    bench::do_not_optimize(delivered);
+}
+
+/// The ways of handing mikado_sm a callback: assigning one, calling it
+/// directly, and having process_packet() call it. Calls per second are
+/// 1e9 / ns_per_op.
+void bench_callbacks()
+{
+    const std::vector<byte> connack_wire = {packet_type::connack, 2, 0, 0};
+    const auto publish_wire = publish_packet(16);
+    const auto wire_topic = gsl::make_span(publish_wire).subspan(4, topic.size());
+    size_t delivered = 0, bytes = 0, calls = 0;
+
+    // three references, too large for std::function to store inline
+    auto handler = [&delivered, &bytes, &calls](cbuf_t t, cbuf_t p) {
+        ++delivered;
+        bytes += t.size() + p.size();
+        ++calls;
+    };
+
+    callback_t owned;
+    bench::run("callback/std_function/assign", 0, [&]() {
+        owned = handler;
+        bench::do_not_optimize(owned);
+    });
+    callback_ref referenced;
+    bench::run("callback/function_ref/assign", 0, [&]() {
+        referenced = handler;
+        bench::do_not_optimize(referenced);
+    });
+
+    bench::run("callback/direct/call", 0, [&]() {
+        bench::do_not_optimize(handler);
+        handler(wire_topic, wire_topic);
+    });
+    bench::run("callback/std_function/call", 0, [&]() {
+        bench::do_not_optimize(owned);
+        owned(wire_topic, wire_topic);
+    });
+    bench::run("callback/function_ref/call", 0, [&]() {
+        bench::do_not_optimize(referenced);
+        referenced(wire_topic, wire_topic);
+    });
+
+    null_connection conn;
+    mikado_sm sm{conn};
+    sm.request_connect("bench");
+    sm.process_packet(connack_wire);
+    sm.set_callback(handler);
+    bench::run("process_packet/publish/std_function", publish_wire.size(),
+               [&]() { sm.process_packet(publish_wire); });
+    sm.set_callback_ref(handler);
+    bench::run("process_packet/publish/function_ref", publish_wire.size(),
+               [&]() { sm.process_packet(publish_wire); });
+
+    bench::do_not_optimize(delivered + bytes + calls);
+}
+
+/// The send path through the virtual Connection against one bound at
+/// compile time
+template <class Sm, class Conn>
+void bench_transport_binding(const std::string &name)
+{
+    const std::vector<byte> connack_wire = {packet_type::connack, 2, 0, 0};
+    const std::vector<byte> payload(16, 'x');
+
+    Conn conn;
+    Sm sm{conn};
+    sm.request_connect("bench");
+    sm.process_packet(connack_wire);
+    sm.set_inflight_window(16, 128);
+
+    bench::run("publish/qos0/" + name, payload.size(), [&]() { sm.publish(topic, payload); });
+
+    const auto id_offset = 2 + 2 + topic.size();
+    std::array<byte, 4> puback_buf;
+    bench::run("publish_qos1/puback_roundtrip/" + name, payload.size(), [&]() {
+        sm.publish(topic, payload, false, 1);
+        const auto id = static_cast<uint16_t>(conn.last[id_offset] << 8 | conn.last[id_offset + 1]);
+        sm.process_packet(puback::Packet{id}.to_span(puback_buf));
+    });
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (!bench::parse_args(argc, argv))
+    {
+        return 1;
+    }
+
+    bench_receiver();
+    bench_readers();
+    bench_codecs();
+    bench_vbi();
+    bench_copy();
+    bench_dispatch();
+    bench_callbacks();
+    bench_transport_binding<mikado_sm, null_connection>("virtual");
+    bench_transport_binding<basic_mikado_sm<static_null_connection>, static_null_connection>("static");
+    return 0;
+}
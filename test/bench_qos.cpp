@@ -0,0 +1,194 @@
+#include <array>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "mikado.h"
+
+#include "bench.h"
+
+using namespace mikado;
+
+/// Sustained QoS 2 throughput of mikado_sm in both directions, against a
+/// stand-in broker living in the same thread. The broker answers whatever
+/// mikado_sm sends and queues its answers, which are fed back once the
+/// in-flight window is exhausted. What is measured is the client side cost
+/// of the four packet exchange, no network is involved.
+
+constexpr size_t messages_per_op = 1024;
+const std::string topic = "billing/meter/1";
+const std::string payload(64, 'x');
+
+/// Minimal broker side of the QoS 2 flows, as a Connection of mikado_sm.
+///
+/// Answers are all four bytes. They go into a fixed ring, so the broker
+/// does not allocate and allocs/op counts mikado_sm alone.
+struct stand_in_broker : public Connection
+{
+    std::array<byte, 64 * 1024> send_buffer;
+
+    /// room for an answer to each message of an op
+    static constexpr size_t max_answers = 2 * messages_per_op;
+    std::array<std::array<byte, 4>, max_answers> answers;
+    size_t answers_head = 0, answers_tail = 0;
+    size_t completed = 0;
+
+    virtual buf_t get_send_buf() override
+    {
+        return send_buffer;
+    }
+
+    virtual int send(cbuf_t data) override
+    {
+        // with batching, several packets arrive at once
+        while (!data.empty())
+        {
+            fixed_header h;
+            if (!h.from_span(data))
+            {
+                return -1;
+            }
+            const auto packet = data.first(h.size + h.remaining_length);
+            if (!answer(packet))
+            {
+                return -1;
+            }
+            data = data.subspan(packet.size());
+        }
+        return 0;
+    }
+
+    /// false if the answer does not fit the ring
+    bool answer(cbuf_t packet)
+    {
+        const auto type = packet[0] & 0xF0;
+        if (type == packet_type::publish)
+        {
+            publish::Packet p;
+            p.from_span(packet);
+            return queue(pubrec::Packet{p.packet_identifier});
+        }
+        else if (type == packet_type::pubrel)
+        {
+            pubrel::Packet p;
+            p.from_span(packet);
+            ++completed;
+            return queue(pubcomp::Packet{p.packet_identifier});
+        }
+        else if (type == packet_type::pubrec)
+        {
+            pubrec::Packet p;
+            p.from_span(packet);
+            return queue(pubrel::Packet{p.packet_identifier});
+        }
+        else if (type == packet_type::pubcomp)
+        {
+            ++completed;
+        }
+        return true;
+    }
+
+    template <class Packet>
+    bool queue(Packet p)
+    {
+        if (answers_tail - answers_head == max_answers)
+        {
+            return false;
+        }
+        p.to_span(answers[answers_tail % max_answers]);
+        ++answers_tail;
+        return true;
+    }
+
+    void clear_answers()
+    {
+        answers_head = answers_tail = 0;
+    }
+
+    /// Hand all queued answers to sm
+    void deliver(mikado_sm &sm)
+    {
+        while (answers_head != answers_tail)
+        {
+            // copied out, as answering it may queue the next
+            const auto a = answers[answers_head % max_answers];
+            ++answers_head;
+            sm.process_packet(a);
+        }
+    }
+};
+
+void establish(mikado_sm &sm, stand_in_broker &broker)
+{
+    sm.request_connect("bench");
+    sm.process_packet(std::vector<byte>{packet_type::connack, 2, 0, 0});
+    broker.clear_answers();
+}
+
+void bench_publish(size_t window, size_t batch_bytes)
+{
+    stand_in_broker broker;
+    mikado_sm sm{broker};
+    establish(sm, broker);
+    sm.set_inflight_window(window, 128);
+    sm.set_batching(batch_bytes, std::chrono::milliseconds(1));
+
+    const auto name = "qos2/publish/window_" + std::to_string(window) +
+                      (batch_bytes ? "/batched" : "");
+    const auto r = bench::run(name, messages_per_op * payload.size(), [&]() {
+        const auto target = broker.completed + messages_per_op;
+        size_t published = 0;
+        while (broker.completed < target)
+        {
+            while (published < messages_per_op && sm.publish(topic, payload, false, 2))
+            {
+                ++published;
+            }
+            sm.flush();
+            broker.deliver(sm);
+            sm.flush();
+            broker.deliver(sm);
+        }
+    });
+    std::cout << "  " << static_cast<size_t>(messages_per_op * 1e9 / r.ns_per_op) << " msgs/s" << std::endl;
+}
+
+void bench_receive()
+{
+    stand_in_broker broker;
+    mikado_sm sm{broker};
+    establish(sm, broker);
+
+    // the broker's PUBLISH messages, with identifiers cycling through a window
+    std::vector<std::vector<byte>> publishes;
+    for (uint16_t id = 1; id <= messages_per_op; ++id)
+    {
+        auto p = publish::Packet{gsl::make_span(reinterpret_cast<const byte *>(topic.data()), topic.size()),
+                                 gsl::make_span(reinterpret_cast<const byte *>(payload.data()), payload.size())};
+        p.QoS = 2;
+        p.packet_identifier = id;
+        std::vector<byte> buf(p.size());
+        p.to_span(buf);
+        publishes.push_back(buf);
+    }
+
+    const auto r = bench::run("qos2/receive", messages_per_op * payload.size(), [&]() {
+        for (const auto &p : publishes)
+        {
+            sm.process_packet(p);
+        }
+        broker.deliver(sm);
+    });
+    std::cout << "  " << static_cast<size_t>(messages_per_op * 1e9 / r.ns_per_op) << " msgs/s" << std::endl;
+}
+
+int main()
+{
+    for (const auto window : {1, 16, 64})
+    {
+        bench_publish(window, 0);
+    }
+    bench_publish(64, 8 * 1024);
+    bench_receive();
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "mikado.h"
+#include "mikado_util.h"
+#include "uring_connection.h"
+
+#include "bench.h"
+
+namespace m = mikado;
+
+/// Throughput of Uring_connection against the plain recv()/send()
+/// Socket_connection, with many connections publishing (fan-out of writes)
+/// and receiving (fan-in of reads) at once. Peers are the other ends of
+/// socketpairs, served in the same thread.
+
+constexpr size_t connections = 64;
+constexpr size_t packets_per_round = 16;
+const std::vector<m::byte> topic = {'s', 'e', 'n', 's', 'o', 'r', '/', '1'};
+const std::vector<m::byte> payload(64, 'x');
+
+/// Socket_connection logs every send, which is not what we want to measure
+struct quiet
+{
+    quiet()
+    {
+        std::cout.setstate(std::ios::badbit);
+    }
+    ~quiet()
+    {
+        std::cout.clear();
+    }
+};
+
+struct peer_set
+{
+    std::vector<int> fds;
+
+    /// Return our end of a new socketpair
+    int add()
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        {
+            throw std::runtime_error("socketpair failed");
+        }
+        fds.push_back(sv[1]);
+        return sv[0];
+    }
+
+    ~peer_set()
+    {
+        for (const auto fd : fds)
+        {
+            close(fd);
+        }
+    }
+};
+
+std::vector<m::byte> publish_burst()
+{
+    std::vector<m::byte> buf(1024);
+    const auto p = m::publish::Packet{topic, payload}.to_span(buf);
+    std::vector<m::byte> burst;
+    for (size_t i = 0; i < packets_per_round; ++i)
+    {
+        burst.insert(burst.end(), p.begin(), p.end());
+    }
+    return burst;
+}
+
+/// Read everything the peers were sent, returns once bytes arrived at each
+template <class Progress>
+void drain_peers(const peer_set &peers, size_t bytes, Progress progress)
+{
+    std::vector<m::byte> sink(64 * 1024);
+    for (const auto fd : peers.fds)
+    {
+        size_t received = 0;
+        while (received < bytes)
+        {
+            const auto r = recv(fd, sink.data(), sink.size(), MSG_DONTWAIT);
+            if (r > 0)
+            {
+                received += r;
+            }
+            else
+            {
+                progress();
+            }
+        }
+    }
+}
+
+template <class Conn>
+struct session
+{
+    template <class... Args>
+    session(Args &&... args) : conn{std::forward<Args>(args)...}, sm{conn}, reader{conn, read_buffer}
+    {
+    }
+
+    Conn conn;
+    m::mikado_sm sm;
+    std::array<m::byte, 64 * 1024> read_buffer;
+    m::Batch_reader reader;
+};
+
+void bench_socket()
+{
+    peer_set peers;
+    std::vector<std::unique_ptr<session<Socket_connection>>> sessions;
+    for (size_t i = 0; i < connections; ++i)
+    {
+        quiet q;
+        sessions.emplace_back(new session<Socket_connection>{my_socket{peers.add()}});
+        sessions.back()->conn.sock.set_nonblocking();
+    }
+    const auto burst = publish_burst();
+
+    bench::run("transport/socket/publish", connections * burst.size(), [&]() {
+        quiet q;
+        for (auto &s : sessions)
+        {
+            for (size_t i = 0; i < packets_per_round; ++i)
+            {
+                s->sm.publish(topic, payload);
+            }
+        }
+        drain_peers(peers, burst.size(), []() {});
+    });
+
+    bench::run("transport/socket/receive", connections * burst.size(), [&]() {
+        quiet q;
+        for (const auto fd : peers.fds)
+        {
+            send(fd, burst.data(), burst.size(), 0);
+        }
+        for (auto &s : sessions)
+        {
+            size_t packets = 0;
+            while (packets < packets_per_round)
+            {
+                s->reader.drain([&packets](m::cbuf_t) { ++packets; });
+            }
+        }
+    });
+}
+
+void bench_uring()
+{
+    auto ring = Uring::create(connections);
+    if (!ring)
+    {
+        std::cout << "io_uring not available, skipping" << std::endl;
+        return;
+    }
+
+    peer_set peers;
+    std::vector<std::unique_ptr<session<Uring_connection>>> sessions;
+    for (size_t i = 0; i < connections; ++i)
+    {
+        quiet q;
+        sessions.emplace_back(new session<Uring_connection>{my_socket{peers.add()}, ring.get()});
+    }
+    const auto burst = publish_burst();
+
+    size_t rounds = 0;
+    const auto enters_before = ring->enter_count();
+    bench::run("transport/uring/publish", connections * burst.size(), [&]() {
+        for (auto &s : sessions)
+        {
+            for (size_t i = 0; i < packets_per_round; ++i)
+            {
+                s->sm.publish(topic, payload);
+            }
+        }
+        ring->run_once(false);
+        drain_peers(peers, burst.size(), [&ring]() { ring->run_once(false); });
+        ++rounds;
+    });
+    std::cout << "  io_uring_enter() per published packet: " << std::setprecision(3)
+              << double(ring->enter_count() - enters_before) / (rounds * connections * packets_per_round)
+              << std::endl;
+
+    bench::run("transport/uring/receive", connections * burst.size(), [&]() {
+        for (const auto fd : peers.fds)
+        {
+            send(fd, burst.data(), burst.size(), 0);
+        }
+        size_t packets = 0;
+        while (packets < connections * packets_per_round)
+        {
+            ring->run_once(true);
+            for (auto &s : sessions)
+            {
+                while (s->conn.readable())
+                {
+                    s->reader.drain([&packets](m::cbuf_t) { ++packets; });
+                }
+            }
+        }
+    });
+}
+
+int main()
+{
+    bench_socket();
+    bench_uring();
+    return 0;
+}
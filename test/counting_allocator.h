@@ -0,0 +1,170 @@
+#ifndef MIKADO_COUNTING_ALLOCATOR_H
+#define MIKADO_COUNTING_ALLOCATOR_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+/// Replacement of the global operator new and delete counting heap
+/// allocations, for benchmarks and tests checking that a path does not
+/// allocate.
+///
+/// As it defines the replacement functions, this header must be included by
+/// exactly one translation unit of a program.
+namespace counting_allocator
+{
+
+/// Number of allocations so far, by all threads
+inline std::atomic<size_t> &allocations()
+{
+    static std::atomic<size_t> count{0};
+    return count;
+}
+
+inline void *allocate(size_t size) noexcept
+{
+    allocations().fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+} // namespace counting_allocator
+
+// Every form is replaced, so allocation and deallocation always pair up as
+// malloc() and free(). noinline keeps GCC from matching the free() it would
+// inline against the operator new at the call site, which it reports as
+// -Wmismatched-new-delete.
+#if defined(__GNUC__)
+#define COUNTING_ALLOCATOR_NOINLINE __attribute__((noinline))
+#else
+#define COUNTING_ALLOCATOR_NOINLINE
+#endif
+
+COUNTING_ALLOCATOR_NOINLINE void *operator new(size_t size)
+{
+    if (auto p = counting_allocator::allocate(size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+COUNTING_ALLOCATOR_NOINLINE void *operator new[](size_t size)
+{
+    if (auto p = counting_allocator::allocate(size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+COUNTING_ALLOCATOR_NOINLINE void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return counting_allocator::allocate(size);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return counting_allocator::allocate(size);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete[](void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+#if defined(__cpp_aligned_new)
+// Over-aligned types, C++17 and later
+
+COUNTING_ALLOCATOR_NOINLINE void *operator new(size_t size, std::align_val_t al)
+{
+    counting_allocator::allocations().fetch_add(1, std::memory_order_relaxed);
+    void *p = nullptr;
+    if (posix_memalign(&p, static_cast<size_t>(al), size ? size : 1) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+COUNTING_ALLOCATOR_NOINLINE void *operator new[](size_t size, std::align_val_t al)
+{
+    return operator new(size, al);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void *operator new(size_t size, std::align_val_t al, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return operator new(size, al);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+COUNTING_ALLOCATOR_NOINLINE void *operator new[](size_t size, std::align_val_t al, const std::nothrow_t &) noexcept
+{
+    return operator new(size, al, std::nothrow);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete(void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete[](void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete[](void *p, size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+COUNTING_ALLOCATOR_NOINLINE void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+#endif // __cpp_aligned_new
+
+#undef COUNTING_ALLOCATOR_NOINLINE
+
+#endif // MIKADO_COUNTING_ALLOCATOR_H
@@ -0,0 +1,418 @@
+#include "loopback_broker.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+namespace m = mikado;
+
+namespace
+{
+
+void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/// SUBACK granting QoS 0 to count filters
+std::vector<m::byte> suback_packet(uint16_t packet_identifier, size_t count)
+{
+    std::vector<m::byte> p = {m::packet_type::suback};
+    const auto enc = m::vbi(static_cast<uint32_t>(2 + count));
+    std::copy(enc.begin(), enc.end(), std::back_inserter(p));
+    p.push_back(m::msb(packet_identifier));
+    p.push_back(m::lsb(packet_identifier));
+    p.insert(p.end(), count, 0);
+    return p;
+}
+
+template <class Packet>
+std::vector<m::byte> ack(uint16_t packet_identifier)
+{
+    std::vector<m::byte> p(4);
+    Packet{packet_identifier}.to_span(p);
+    return p;
+}
+
+} // namespace
+
+struct loopback_broker::client : public m::Packet_reader::Receiving_Connection
+{
+    explicit client(int _fd) : fd{_fd}, read_buffer(64 * 1024), reader{*this, read_buffer}
+    {
+        set_nonblocking(fd);
+    }
+
+    ~client()
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+    }
+
+    virtual int read(m::buf_t b) override
+    {
+        const auto r = recv(fd, b.data(), b.size(), 0);
+        if (r > 0)
+        {
+            return static_cast<int>(r);
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        // closed by the client, or broken
+        return -1;
+    }
+
+    struct pending
+    {
+        clock::time_point due;
+        std::vector<m::byte> data;
+    };
+
+    int fd;
+    std::vector<m::byte> read_buffer;
+    m::Batch_reader reader;
+
+    /// packets held back for latency, in order of due time
+    std::deque<pending> out;
+    /// bytes being sent, and how many of them are sent already
+    std::vector<m::byte> sending;
+    size_t sent = 0;
+    /// with a bandwidth limit, when the next byte may go out
+    clock::time_point next_send{};
+    /// the socket buffer is full, wait for POLLOUT
+    bool blocked = false;
+};
+
+loopback_broker::loopback_broker(link_profile _profile) : profile(_profile)
+{
+    if (pipe(wake_fds) < 0)
+    {
+        throw std::runtime_error(std::string("Could not create pipe: ") + strerror(errno));
+    }
+}
+
+loopback_broker::~loopback_broker()
+{
+    stop();
+    ::close(wake_fds[0]);
+    ::close(wake_fds[1]);
+    if (listen_fd >= 0)
+    {
+        ::close(listen_fd);
+    }
+}
+
+int loopback_broker::connect_client()
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        throw std::runtime_error(std::string("socketpair failed: ") + strerror(errno));
+    }
+    clients.emplace_back(new client{sv[1]});
+    return sv[0];
+}
+
+uint16_t loopback_broker::listen(uint16_t port)
+{
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        return 0;
+    }
+    const int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    socklen_t length = sizeof(addr);
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        ::listen(listen_fd, 16) < 0 ||
+        getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr), &length) < 0)
+    {
+        ::close(listen_fd);
+        listen_fd = -1;
+        return 0;
+    }
+    set_nonblocking(listen_fd);
+    return ntohs(addr.sin_port);
+}
+
+void loopback_broker::start()
+{
+    running = true;
+    thread = std::thread{[this]() { run(); }};
+}
+
+void loopback_broker::stop()
+{
+    if (!thread.joinable())
+    {
+        return;
+    }
+    running = false;
+    const char c = 0;
+    if (write(wake_fds[1], &c, 1) < 0)
+    {
+        // the thread still notices within its poll timeout
+    }
+    thread.join();
+}
+
+size_t loopback_broker::published() const
+{
+    return m_published;
+}
+
+size_t loopback_broker::forwarded() const
+{
+    return m_forwarded;
+}
+
+void loopback_broker::run()
+{
+    std::vector<pollfd> fds;
+    while (running)
+    {
+        now = clock::now();
+
+        auto wake = now + std::chrono::milliseconds(100);
+        fds.clear();
+        fds.push_back(pollfd{wake_fds[0], POLLIN, 0});
+        fds.push_back(pollfd{listen_fd, POLLIN, 0});
+        for (const auto &c : clients)
+        {
+            if (c->fd < 0)
+            {
+                continue;
+            }
+            wake = std::min(wake, flush(*c));
+            fds.push_back(pollfd{c->fd, static_cast<short>(POLLIN | (c->blocked ? POLLOUT : 0)), 0});
+        }
+
+        const auto wait = std::max(clock::duration{}, wake - now);
+        const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(wait);
+        const timespec timeout{static_cast<time_t>(seconds.count()),
+                               static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(wait - seconds).count())};
+        if (ppoll(fds.data(), fds.size(), &timeout, nullptr) < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        now = clock::now();
+        if (fds[1].revents & POLLIN)
+        {
+            accept_clients();
+        }
+        // clients accepted just now are not in fds, they are read next round
+        for (size_t i = 2; i < fds.size(); ++i)
+        {
+            if (fds[i].revents == 0)
+            {
+                continue;
+            }
+            const auto found = std::find_if(clients.begin(), clients.end(),
+                                            [&fds, i](const std::unique_ptr<client> &c) { return c->fd == fds[i].fd; });
+            if (found == clients.end())
+            {
+                continue;
+            }
+            auto &c = **found;
+            c.blocked = false;
+
+            const auto r = c.reader.drain([this, &c](m::cbuf_t packet) { handle_packet(c, packet); });
+            if (r == m::read_result::read_error)
+            {
+                close(c);
+            }
+        }
+    }
+}
+
+void loopback_broker::accept_clients()
+{
+    for (;;)
+    {
+        const auto fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            return;
+        }
+        const int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        clients.emplace_back(new client{fd});
+    }
+}
+
+void loopback_broker::handle_packet(client &c, m::cbuf_t packet)
+{
+    switch (packet[0] & 0xF0)
+    {
+    case m::packet_type::connect:
+        queue(c, {m::packet_type::connack, 2, 0, 0});
+        break;
+
+    case m::packet_type::subscribe:
+    {
+        m::subscribe::Packet p;
+        if (!p.from_span(packet))
+        {
+            close(c);
+            return;
+        }
+        // Clients are kept until the broker goes, so their routes stay valid
+        auto target = &c;
+        for (const auto &filter : p.topic_filters)
+        {
+            routes.add(filter.str(), [this, target](m::cbuf_t topic, m::cbuf_t payload) {
+                auto forward = m::publish::Packet{topic, payload};
+                std::vector<m::byte> data(forward.size());
+                forward.to_span(data);
+                queue(*target, std::move(data));
+                ++m_forwarded;
+            });
+        }
+        queue(c, suback_packet(p.packet_identifier, p.topic_filters.size()));
+        break;
+    }
+
+    case m::packet_type::publish:
+    {
+        m::publish::Packet p;
+        if (!p.from_span(packet))
+        {
+            close(c);
+            return;
+        }
+        ++m_published;
+        if (p.QoS == 1)
+        {
+            queue(c, ack<m::puback::Packet>(p.packet_identifier));
+        }
+        else if (p.QoS == 2)
+        {
+            queue(c, ack<m::pubrec::Packet>(p.packet_identifier));
+        }
+        routes.dispatch(p.topic, p.payload);
+        break;
+    }
+
+    case m::packet_type::pubrel:
+    {
+        m::pubrel::Packet p;
+        if (p.from_span(packet))
+        {
+            queue(c, ack<m::pubcomp::Packet>(p.packet_identifier));
+        }
+        break;
+    }
+
+    case m::packet_type::pingreq:
+        queue(c, {m::packet_type::pingresp, 0});
+        break;
+
+    case m::packet_type::disconnect:
+        close(c);
+        break;
+
+    default:
+        // acknowledgements of what we forwarded, nothing to do with QoS 0
+        break;
+    }
+}
+
+void loopback_broker::queue(client &c, std::vector<m::byte> data)
+{
+    if (c.fd < 0)
+    {
+        return;
+    }
+    c.out.push_back(client::pending{now + profile.latency, std::move(data)});
+}
+
+loopback_broker::clock::time_point loopback_broker::flush(client &c)
+{
+    for (;;)
+    {
+        if (c.sent == c.sending.size())
+        {
+            // take everything due
+            c.sending.clear();
+            c.sent = 0;
+            while (!c.out.empty() && c.out.front().due <= now)
+            {
+                const auto &d = c.out.front().data;
+                c.sending.insert(c.sending.end(), d.begin(), d.end());
+                c.out.pop_front();
+            }
+            if (c.sending.empty())
+            {
+                return c.out.empty() ? clock::time_point::max() : c.out.front().due;
+            }
+        }
+        if (c.blocked)
+        {
+            return clock::time_point::max();
+        }
+
+        auto chunk = c.sending.size() - c.sent;
+        if (profile.bytes_per_sec > 0)
+        {
+            if (c.next_send > now)
+            {
+                return c.next_send;
+            }
+            // about a millisecond's worth at a time, so shaping is smooth
+            chunk = std::min(chunk, std::max<size_t>(profile.bytes_per_sec / 1000, 1));
+        }
+
+        const auto r = send(c.fd, c.sending.data() + c.sent, chunk, MSG_NOSIGNAL);
+        if (r < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                c.blocked = true;
+                return clock::time_point::max();
+            }
+            close(c);
+            return clock::time_point::max();
+        }
+        c.sent += r;
+        if (profile.bytes_per_sec > 0)
+        {
+            c.next_send = std::max(c.next_send, now) +
+                          std::chrono::duration_cast<clock::duration>(
+                              std::chrono::duration<double>(double(r) / profile.bytes_per_sec));
+        }
+    }
+}
+
+void loopback_broker::close(client &c)
+{
+    if (c.fd >= 0)
+    {
+        ::close(c.fd);
+        c.fd = -1;
+    }
+    c.out.clear();
+    c.sending.clear();
+    c.sent = 0;
+}
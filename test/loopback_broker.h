@@ -0,0 +1,90 @@
+#ifndef MIKADO_LOOPBACK_BROKER_H
+#define MIKADO_LOOPBACK_BROKER_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "mikado.h"
+
+/// Shape of the way from the broker to each client
+struct link_profile
+{
+    /// every packet is held back this long
+    std::chrono::microseconds latency{0};
+    /// 0 is unlimited
+    size_t bytes_per_sec = 0;
+};
+
+/// Minimal MQTT 3.1.1 responder, so end-to-end tests and benchmarks run
+/// without a live broker. Linux only.
+///
+/// Serves clients over socketpairs or loopback TCP from a thread of its own.
+/// Answers CONNECT with CONNACK, SUBSCRIBE with a SUBACK granting QoS 0 and
+/// PINGREQ with PINGRESP, completes the QoS 1 and 2 flows of incoming
+/// PUBLISHes, and forwards every PUBLISH with QoS 0 to all clients with a
+/// matching subscription, the publisher included. Packets are framed by
+/// Batch_reader, parsed and built by the library's codecs and matched by
+/// router.
+///
+/// There are no sessions, retained messages or wills, and nothing is checked
+/// beyond what is needed to frame packets.
+class loopback_broker
+{
+public:
+    explicit loopback_broker(link_profile profile = link_profile{});
+    /// stop()s
+    ~loopback_broker();
+
+    loopback_broker(const loopback_broker &) = delete;
+    void operator=(const loopback_broker &) = delete;
+
+    /// Return the client end of a new socketpair, which the broker serves.
+    /// The caller owns it. Only before start().
+    int connect_client();
+
+    /// Accept clients on 127.0.0.1:port, 0 picks a free port.
+    /// Returns the port, 0 on error. Only before start().
+    uint16_t listen(uint16_t port = 0);
+
+    void start();
+    void stop();
+
+    /// PUBLISH packets received so far
+    size_t published() const;
+    /// PUBLISH packets queued to subscribers so far
+    size_t forwarded() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct client;
+
+    const link_profile profile;
+    int listen_fd = -1;
+    /// written to by stop() to wake up the broker thread
+    int wake_fds[2];
+
+    std::vector<std::unique_ptr<client>> clients;
+    mikado::router routes;
+
+    /// time of the current round of the broker thread
+    clock::time_point now;
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+    std::atomic<size_t> m_published{0}, m_forwarded{0};
+
+    void run();
+    void accept_clients();
+    void handle_packet(client &c, mikado::cbuf_t packet);
+    void queue(client &c, std::vector<mikado::byte> data);
+    /// Send what is due to c. Returns when c needs attention next,
+    /// time_point::max() if it waits for nothing but the socket.
+    clock::time_point flush(client &c);
+    void close(client &c);
+};
+
+#endif // MIKADO_LOOPBACK_BROKER_H
@@ -0,0 +1,88 @@
+#define BOOST_TEST_MODULE allocations test
+#include <boost/test/unit_test.hpp>
+
+#include <array>
+#include <string>
+
+#include "mikado.h"
+
+#include "counting_allocator.h"
+
+using namespace mikado;
+
+/// Allocations made by f
+template <class F>
+size_t allocations_of(F f)
+{
+    const size_t before = counting_allocator::allocations();
+    f();
+    return counting_allocator::allocations() - before;
+}
+
+struct connection_mock : public Connection
+{
+    std::array<byte, 1024> send_buffer;
+    virtual buf_t get_send_buf() override
+    {
+        return send_buffer;
+    }
+
+    virtual int send(cbuf_t data) override
+    {
+        return data.size();
+    }
+};
+
+BOOST_AUTO_TEST_CASE( packet_builders )
+{
+    std::array<byte, 256> buf;
+    const std::string client = "a client id too long for the small string buffer";
+    const string_ref filters[] = {"sensor/+/temperature", "sensor/+/humidity", "control/#"};
+    const std::string topic = "sensor/1/temperature";
+    const std::string payload(100, 'x');
+
+    BOOST_CHECK_EQUAL(allocations_of([&]() {
+                          connect::Packet{client, 60}.to_span(buf);
+                          connect::Packet{"literal"}.to_span(buf);
+                          subscribe::Packet{1, filters, 1}.to_span(buf);
+                          auto p = publish::Packet{string_ref{topic}.bytes(), string_ref{payload}.bytes()};
+                          p.to_span(buf);
+                          p.header_to_span(buf);
+                          puback::Packet{1}.to_span(buf);
+                          pubrel::Packet{1}.to_span(buf);
+                          pingreq::Packet{}.to_span(buf);
+                          disconnect::Packet{}.to_span(buf);
+                      }),
+                      0);
+}
+
+BOOST_AUTO_TEST_CASE( mikado_sm_requests )
+{
+    connection_mock mock;
+    mikado_sm mi{mock};
+    mi.set_inflight_window(4, 256);
+
+    const std::string client = "a client id too long for the small string buffer";
+    const std::string topic = "a topic name too long for the small string buffer";
+    const std::string payload(100, 'x');
+    const string_ref filters[] = {"sensor/+/temperature", "control/#"};
+
+    mi.request_connect(client);
+    mi.process_packet(std::vector<byte>{packet_type::connack, 2, 0, 0});
+    // packet identifiers are allocated on first use, once
+    mi.subscribe("warm/up");
+
+    BOOST_CHECK_EQUAL(allocations_of([&]() {
+                          mi.request_connect(client, 60);
+                          mi.request_connect("literal");
+                          mi.subscribe(topic);
+                          mi.subscribe("sensor/#");
+                          mi.subscribe(filters);
+                          mi.publish(topic, payload);
+                          mi.publish("sensor/1", "literal payload");
+                          mi.publish(topic, payload, false, 1);
+                          mi.send_ping();
+                          mi.send_disconnect();
+                      }),
+                      0);
+}
@@ -0,0 +1,57 @@
+#define BOOST_TEST_MODULE event loop test
+#include <boost/test/unit_test.hpp>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <vector>
+
+#include "event_loop.h"
+
+using namespace mikado;
+
+/// Both ends of a socketpair, the first one for a Socket_connection
+struct socket_pair
+{
+    socket_pair()
+    {
+        BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    }
+
+    ~socket_pair()
+    {
+        close(fds[1]);
+    }
+
+    int fds[2];
+};
+
+BOOST_AUTO_TEST_CASE( session_outlives_loop )
+{
+    socket_pair peers;
+    Socket_connection conn{my_socket{peers.fds[0]}};
+    mikado_sm sm{conn};
+
+    {
+        Event_loop loop;
+        loop.add(conn, sm);
+        sm.request_connect("client", 1);
+        sm.process_packet(std::vector<byte>{packet_type::connack, 2, 0, 0});
+        BOOST_CHECK_EQUAL(loop.size(), 1);
+    }
+
+    // the wheel and session are gone, the mikado_sm must not use them
+    sm.poll();
+    sm.process_packet(std::vector<byte>{packet_type::pingresp, 0});
+    BOOST_CHECK(sm.publish("a/b", "payload"));
+    sm.send_ping();
+    sm.set_ping_timeout(std::chrono::seconds(1));
+
+    // and may join another wheel
+    timer_wheel wheel{std::chrono::milliseconds(1), std::chrono::steady_clock::now()};
+    sm.set_timer_wheel(&wheel);
+    BOOST_CHECK_EQUAL(wheel.size(), 1);
+    sm.set_timer_wheel(nullptr);
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+}
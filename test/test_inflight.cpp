@@ -0,0 +1,109 @@
+#define BOOST_TEST_MODULE inflight test
+#include <boost/test/unit_test.hpp>
+
+#include <set>
+
+#include "inflight.h"
+
+using namespace mikado;
+
+BOOST_AUTO_TEST_CASE( packet_ids_acquire_release )
+{
+    packet_ids ids;
+    BOOST_CHECK(!ids.in_use(1));
+
+    const auto a = ids.acquire();
+    const auto b = ids.acquire();
+    BOOST_CHECK(a != 0);
+    BOOST_CHECK(b != 0);
+    BOOST_CHECK(a != b);
+    BOOST_CHECK(ids.in_use(a));
+    BOOST_CHECK_EQUAL(ids.size(), 2);
+
+    BOOST_CHECK(!ids.acquire(a));
+    BOOST_CHECK(!ids.acquire(0));
+    BOOST_CHECK(ids.acquire(uint16_t{65535}));
+
+    ids.release(a);
+    BOOST_CHECK(!ids.in_use(a));
+    BOOST_CHECK_EQUAL(ids.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE( packet_ids_exhausted )
+{
+    packet_ids ids;
+    std::set<uint16_t> seen;
+    for (size_t i = 0; i < 65535; ++i)
+    {
+        const auto id = ids.acquire();
+        BOOST_REQUIRE(id != 0);
+        seen.insert(id);
+    }
+    BOOST_CHECK_EQUAL(seen.size(), 65535);
+    BOOST_CHECK_EQUAL(ids.acquire(), 0);
+
+    ids.release(4711);
+    BOOST_CHECK_EQUAL(ids.acquire(), 4711);
+}
+
+BOOST_AUTO_TEST_CASE( inflight_window )
+{
+    packet_ids ids;
+    inflight_store store;
+    store.reserve(3, 16, ids);
+    BOOST_CHECK_EQUAL(store.capacity(), 3);
+
+    std::vector<uint16_t> acquired;
+    for (size_t i = 0; i < 3; ++i)
+    {
+        const auto s = store.acquire(ids);
+        BOOST_REQUIRE(s != nullptr);
+        BOOST_CHECK_EQUAL(s->packet.size(), 16);
+        BOOST_CHECK(ids.in_use(s->packet_identifier));
+        acquired.push_back(s->packet_identifier);
+    }
+    BOOST_CHECK(store.full());
+    BOOST_CHECK(store.acquire(ids) == nullptr);
+
+    BOOST_CHECK(store.release(acquired[1], ids));
+    BOOST_CHECK(!store.release(acquired[1], ids));
+    BOOST_CHECK(!ids.in_use(acquired[1]));
+    BOOST_CHECK(store.find(acquired[1]) == nullptr);
+    BOOST_CHECK(store.find(acquired[0]) != nullptr);
+
+    // the freed slot hands out a fresh identifier
+    const auto s = store.acquire(ids);
+    BOOST_REQUIRE(s != nullptr);
+    BOOST_CHECK(s->packet_identifier != acquired[1]);
+    BOOST_CHECK(store.find(s->packet_identifier) == s);
+
+    const auto order = store.in_order();
+    BOOST_REQUIRE_EQUAL(order.size(), 3);
+    BOOST_CHECK_EQUAL(order[0]->packet_identifier, acquired[0]);
+    BOOST_CHECK_EQUAL(order[1]->packet_identifier, acquired[2]);
+    BOOST_CHECK_EQUAL(order[2]->packet_identifier, s->packet_identifier);
+}
+
+BOOST_AUTO_TEST_CASE( inflight_skips_foreign_ids )
+{
+    packet_ids ids;
+    inflight_store store;
+    store.reserve(2, 8, ids);
+
+    // identifiers taken elsewhere, e.g. by a SUBSCRIBE
+    ids.acquire(uint16_t{1});
+    const auto s = store.acquire(ids);
+    BOOST_REQUIRE(s != nullptr);
+    BOOST_CHECK(s->packet_identifier != 1);
+    BOOST_CHECK(store.find(s->packet_identifier) == s);
+    BOOST_CHECK(store.find(1) == nullptr);
+
+    // identifiers cycle through the whole range
+    for (size_t i = 0; i < 70000; ++i)
+    {
+        const auto t = store.acquire(ids);
+        BOOST_REQUIRE(t != nullptr);
+        BOOST_REQUIRE(store.release(t->packet_identifier, ids));
+    }
+    BOOST_CHECK_EQUAL(ids.size(), 2);
+}
@@ -4,6 +4,7 @@
 #include <array>
 
 #include "mikado.h"
+#include "mikado_impl.h"
 
 using namespace mikado;
 
@@ -115,7 +116,7 @@ BOOST_AUTO_TEST_CASE( mikado_subscribe )
         '>',
         packet_type::subscribe | 0x2,
         8, //remaining length
-        5, 9, // packet identifier
+        0, 1, // packet identifier
         0, 3, // length of topic
         'a', '/', 'b', // topic_filter
         0 // QoS
@@ -133,6 +134,29 @@ const std::vector<byte> packet_suback =
     0 // success, maximum QoS 0
 };
 
+BOOST_AUTO_TEST_CASE( subscribe_roundtrip )
+{
+    std::array<byte, 64> buf;
+    const string_ref filters[] = {"a/+", "b/#"};
+    const auto msg = subscribe::Packet{0x1234, filters, 1}.to_span(buf);
+
+    subscribe::Packet p;
+    BOOST_REQUIRE(p.from_span(msg));
+    BOOST_CHECK_EQUAL(p.packet_identifier, 0x1234);
+    BOOST_REQUIRE_EQUAL(p.topic_filters.size(), 2);
+    BOOST_CHECK_EQUAL(p.topic_filters[0].str(), "a/+");
+    BOOST_CHECK_EQUAL(p.topic_filters[1].str(), "b/#");
+    BOOST_CHECK_EQUAL(p.QoS, 1);
+
+    // a filter running past the end of the packet
+    std::vector<byte> broken(msg.begin(), msg.end());
+    broken[5] = 0x20;
+    BOOST_CHECK(!p.from_span(broken));
+    // no filter at all
+    const std::vector<byte> empty = {packet_type::subscribe | 0x2, 2, 0x12, 0x34};
+    BOOST_CHECK(!p.from_span(empty));
+}
+
 BOOST_AUTO_TEST_CASE( mikado_subscribe_confirm )
 {
     connection_mock mock;
@@ -146,6 +170,79 @@ BOOST_AUTO_TEST_CASE( mikado_subscribe_confirm )
     BOOST_CHECK(mi.state() == state_t::connected);
 }
 
+BOOST_AUTO_TEST_CASE( mikado_pipelined_startup )
+{
+    connection_mock mock;
+    auto mi = mikado_sm{mock};
+
+    // CONNECT and SUBSCRIBEs go out without waiting for acknowledgements
+    mi.request_connect("");
+    mi.subscribe("a/b");
+    mi.subscribe("c/d");
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 3);
+    BOOST_CHECK(mi.state() == state_t::connection_requested);
+
+    mi.process_packet(packet_connack);
+    BOOST_CHECK(mi.state() == state_t::subscribe_requested);
+    mi.process_packet(packet_suback);
+    BOOST_CHECK(mi.state() == state_t::subscribe_requested);
+    mi.process_packet(std::vector<byte>{packet_type::suback, 3, 0, 2, 0});
+    BOOST_CHECK(mi.state() == state_t::connected);
+}
+
+BOOST_AUTO_TEST_CASE( mikado_subscribe_many )
+{
+    connection_mock mock;
+    auto mi = mikado_sm{mock};
+
+    std::vector<std::pair<uint16_t, std::vector<suback::result_t>>> subacks;
+    mi.set_suback_callback([&subacks](const suback::Packet &p) {
+        std::vector<suback::result_t> codes;
+        for (size_t i = 0; i < p.size(); ++i)
+        {
+            codes.push_back(p.result(i));
+        }
+        subacks.emplace_back(p.packet_identifier, codes);
+    });
+
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mock.log.clear();
+    const auto first = mi.subscribe(std::vector<std::string>{"a", "b/#"});
+    const auto second = mi.subscribe("c");
+    BOOST_CHECK(first != 0);
+    BOOST_CHECK(second != 0);
+    BOOST_CHECK(first != second);
+
+    const std::vector<byte> ref = {
+        '>', packet_type::subscribe | 0x2, 12, msb(first), lsb(first),
+        0, 1, 'a', 0,
+        0, 3, 'b', '/', '#', 0,
+        '>', packet_type::subscribe | 0x2, 6, msb(second), lsb(second),
+        0, 1, 'c', 0};
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(), ref.begin(), ref.end());
+
+    // acknowledged out of order, one filter refused
+    mi.process_packet(std::vector<byte>{packet_type::suback, 3, msb(second), lsb(second), 0});
+    BOOST_CHECK(mi.state() == state_t::subscribe_requested);
+    mi.process_packet(std::vector<byte>{packet_type::suback, 4, msb(first), lsb(first), 0x80, 1});
+    BOOST_CHECK(mi.state() == state_t::connected);
+
+    BOOST_REQUIRE_EQUAL(subacks.size(), 2);
+    BOOST_CHECK_EQUAL(subacks[0].first, second);
+    BOOST_CHECK_EQUAL(subacks[1].first, first);
+    BOOST_REQUIRE_EQUAL(subacks[1].second.size(), 2);
+    BOOST_CHECK(subacks[1].second[0] == suback::result_t::failure);
+    BOOST_CHECK(subacks[1].second[1] == suback::result_t::max_QoS_1);
+
+    // a SUBACK for no pending SUBSCRIBE is ignored
+    mi.subscribe("d");
+    mi.process_packet(std::vector<byte>{packet_type::suback, 3, 0x12, 0x67, 0});
+    BOOST_CHECK(mi.state() == state_t::subscribe_requested);
+    BOOST_CHECK_EQUAL(subacks.size(), 2);
+}
+
 const std::vector<byte> packet_publish =
 {
     packet_type::publish | 0, // DUP false, QoS 0, Retain false
@@ -212,6 +309,288 @@ BOOST_AUTO_TEST_CASE( mikado_receive_publish_no_payload )
 
 }
 
+BOOST_AUTO_TEST_CASE( mikado_routed_publish )
+{
+    connection_mock mock;
+    callback_mock callback_data;
+    auto cb = [&callback_data](cbuf_t t, cbuf_t p){callback_data(t, p);};
+    auto mi = mikado_sm{mock, cb};
+
+    callback_mock routed_data;
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+    mi.subscribe("a/+", [&routed_data](cbuf_t t, cbuf_t p){routed_data(t, p);});
+    mi.process_packet(packet_suback);
+
+    mi.process_packet(packet_publish);
+    BOOST_CHECK(mi.state() == state_t::connected);
+    BOOST_CHECK(routed_data.called);
+    BOOST_CHECK_EQUAL(routed_data.topic, "a/b");
+    BOOST_CHECK_EQUAL(routed_data.payload, "Hello");
+    // routed messages do not reach the callback
+    BOOST_CHECK(!callback_data.called);
+
+    mi.routes().remove("a/+");
+    mi.process_packet(packet_publish);
+    BOOST_CHECK(callback_data.called);
+}
+
+/// Send buffer shrinkable after connecting
+struct limited_connection_mock : public connection_mock
+{
+    size_t limit = send_buffer.size();
+
+    virtual gsl::span<byte> get_send_buf() override
+    {
+        return gsl::make_span(send_buffer.data(), limit);
+    }
+};
+
+BOOST_AUTO_TEST_CASE( mikado_routed_subscribe_failed )
+{
+    limited_connection_mock mock;
+    callback_mock callback_data;
+    auto cb = [&callback_data](cbuf_t t, cbuf_t p){callback_data(t, p);};
+    auto mi = mikado_sm{mock, cb};
+
+    callback_mock routed_data;
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    // the SUBSCRIBE does not fit, so the handler is not added
+    mock.limit = 4;
+    BOOST_CHECK_EQUAL(mi.subscribe("a/+", [&routed_data](cbuf_t t, cbuf_t p){routed_data(t, p);}), 0);
+    mi.process_packet(packet_publish);
+    BOOST_CHECK(!routed_data.called);
+    BOOST_CHECK(callback_data.called);
+    BOOST_CHECK(!mi.routes().remove("a/+"));
+}
+
+BOOST_AUTO_TEST_CASE( mikado_topic_handlers )
+{
+    connection_mock mock;
+    callback_mock callback_data;
+    auto cb = [&callback_data](cbuf_t t, cbuf_t p){callback_data(t, p);};
+    auto mi = mikado_sm{mock, cb};
+
+    callback_mock exact_data;
+    const topic_table topics{{"x/y", "a/b"}};
+    const callback_t handlers[] = {
+        [](cbuf_t, cbuf_t){},
+        [&exact_data](cbuf_t t, cbuf_t p){exact_data(t, p);}};
+    BOOST_REQUIRE(mi.set_topic_handlers(topics.index(), handlers));
+    BOOST_CHECK(!mi.set_topic_handlers(topics.index(), gsl::make_span(handlers, 1)));
+
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+    mi.process_packet(packet_publish);
+    BOOST_CHECK(exact_data.called);
+    BOOST_CHECK_EQUAL(exact_data.payload, "Hello");
+    BOOST_CHECK(!callback_data.called);
+}
+
+BOOST_AUTO_TEST_CASE( mikado_publish_qos1 )
+{
+    connection_mock mock;
+    auto mi = mikado_sm{mock};
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    // no window, no QoS 1
+    BOOST_CHECK(!mi.publish("a", "x", false, 1));
+    BOOST_CHECK(mi.set_inflight_window(2, 64));
+
+    mock.log.clear();
+    BOOST_CHECK(mi.publish("a", "x", false, 1));
+    BOOST_CHECK(mi.publish("a", "y", false, 1));
+    // window is full, the publishes are pipelined
+    BOOST_CHECK(!mi.publish("a", "z", false, 1));
+    BOOST_CHECK_EQUAL(mi.inflight(), 2);
+    BOOST_CHECK(!mi.set_inflight_window(4, 64));
+    // QoS 0 is not affected
+    BOOST_CHECK(mi.publish("a", "z"));
+
+    const std::vector<byte> ref = {
+        '>', packet_type::publish | 0x2, 6, 0, 1, 'a', 0, 1, 'x',
+        '>', packet_type::publish | 0x2, 6, 0, 1, 'a', 0, 2, 'y',
+        '>', packet_type::publish, 4, 0, 1, 'a', 'z'};
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(), ref.begin(), ref.end());
+
+    const std::vector<byte> puback_2 = {packet_type::puback, 2, 0, 2};
+    mi.process_packet(puback_2);
+    BOOST_CHECK(mi.state() == state_t::connected);
+    BOOST_CHECK_EQUAL(mi.inflight(), 1);
+    BOOST_CHECK(mi.publish("a", "z", false, 1));
+
+    // unacknowledged messages are sent again with DUP after reconnecting
+    mi.reset();
+    mi.request_connect("");
+    mock.log.clear();
+    mi.process_packet(packet_connack);
+    BOOST_CHECK_EQUAL(mi.inflight(), 2);
+    const std::vector<byte> resent = {
+        '>', packet_type::publish | 0xA, 6, 0, 1, 'a', 0, 1, 'x',
+        '>', packet_type::publish | 0xA, 6, 0, 1, 'a', 0, 4, 'z'};
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(), resent.begin(), resent.end());
+}
+
+BOOST_AUTO_TEST_CASE( mikado_receive_qos1 )
+{
+    connection_mock mock;
+    callback_mock callback_data;
+    auto mi = mikado_sm{mock, [&callback_data](cbuf_t t, cbuf_t p){callback_data(t, p);}};
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mock.log.clear();
+    const std::vector<byte> publish_qos1 = {
+        packet_type::publish | 0x2, 10, 0, 3, 'a', '/', 'b', 0x12, 0x34, 'H', 'i', '!'};
+    mi.process_packet(publish_qos1);
+    BOOST_CHECK(mi.state() == state_t::connected);
+    BOOST_CHECK_EQUAL(callback_data.payload, "Hi!");
+
+    const std::vector<byte> ref = {'>', packet_type::puback, 2, 0x12, 0x34};
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(), ref.begin(), ref.end());
+}
+
+BOOST_AUTO_TEST_CASE( mikado_receive_qos1_without_identifier )
+{
+    // packet identifier 0 is malformed for QoS 1 and 2
+    const std::vector<byte> publish_qos1 = {
+        packet_type::publish | 0x2, 10, 0, 3, 'a', '/', 'b', 0, 0, 'H', 'i', '!'};
+    publish::Packet p{};
+    BOOST_CHECK(!p.from_span(publish_qos1));
+    auto publish_qos2 = publish_qos1;
+    publish_qos2[0] = packet_type::publish | 0x4;
+    BOOST_CHECK(!p.from_span(publish_qos2));
+
+    connection_mock mock;
+    callback_mock callback_data;
+    auto mi = mikado_sm{mock, [&callback_data](cbuf_t t, cbuf_t p){callback_data(t, p);}};
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mock.log.clear();
+    mi.process_packet(publish_qos1);
+    BOOST_CHECK(mi.state() == state_t::error);
+    BOOST_CHECK(!callback_data.called);
+    BOOST_CHECK(mock.log.empty());
+}
+
+BOOST_AUTO_TEST_CASE( mikado_publish_qos2 )
+{
+    connection_mock mock;
+    auto mi = mikado_sm{mock};
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+    mi.set_inflight_window(4, 64);
+
+    mock.log.clear();
+    BOOST_CHECK(mi.publish("a", "x", false, 2));
+    BOOST_CHECK(mi.publish("a", "y", false, 2));
+    BOOST_CHECK(!mi.publish("a", "y", false, 3));
+
+    // PUBREC is answered with PUBREL, the message stays in flight
+    mi.process_packet(std::vector<byte>{packet_type::pubrec, 2, 0, 1});
+    BOOST_CHECK(mi.state() == state_t::connected);
+    BOOST_CHECK_EQUAL(mi.inflight(), 2);
+
+    // after reconnecting, message 1 gets its PUBREL again, 2 is resent
+    mi.reset();
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mi.process_packet(std::vector<byte>{packet_type::pubcomp, 2, 0, 1});
+    BOOST_CHECK_EQUAL(mi.inflight(), 1);
+    // PUBCOMP before PUBREC is ignored
+    mi.process_packet(std::vector<byte>{packet_type::pubcomp, 2, 0, 2});
+    BOOST_CHECK_EQUAL(mi.inflight(), 1);
+    mi.process_packet(std::vector<byte>{packet_type::pubrec, 2, 0, 2});
+    mi.process_packet(std::vector<byte>{packet_type::pubcomp, 2, 0, 2});
+    BOOST_CHECK_EQUAL(mi.inflight(), 0);
+    BOOST_CHECK(mi.state() == state_t::connected);
+
+    const std::vector<byte> ref = {
+        '>', packet_type::publish | 0x4, 6, 0, 1, 'a', 0, 1, 'x',
+        '>', packet_type::publish | 0x4, 6, 0, 1, 'a', 0, 2, 'y',
+        '>', packet_type::pubrel | 0x2, 2, 0, 1,
+        // reconnect
+        '>', packet_type::connect, 12, 0, 4, 'M', 'Q', 'T', 'T', 4, 2, 0, 0, 0, 0,
+        '>', packet_type::pubrel | 0x2, 2, 0, 1,
+        '>', packet_type::publish | 0xC, 6, 0, 1, 'a', 0, 2, 'y',
+        '>', packet_type::pubrel | 0x2, 2, 0, 2};
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(), ref.begin(), ref.end());
+}
+
+BOOST_AUTO_TEST_CASE( mikado_receive_qos2 )
+{
+    connection_mock mock;
+    int delivered = 0;
+    auto mi = mikado_sm{mock, [&delivered](cbuf_t, cbuf_t){++delivered;}};
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mock.log.clear();
+    const std::vector<byte> publish_qos2 = {
+        packet_type::publish | 0x4, 8, 0, 3, 'a', '/', 'b', 0, 7, '!'};
+    std::vector<byte> publish_dup = publish_qos2;
+    publish_dup[0] |= 0x8;
+
+    mi.process_packet(publish_qos2);
+    mi.process_packet(publish_dup);
+    BOOST_CHECK_EQUAL(delivered, 1);
+
+    mi.process_packet(std::vector<byte>{packet_type::pubrel | 0x2, 2, 0, 7});
+    BOOST_CHECK(mi.state() == state_t::connected);
+
+    // released, so the identifier may be reused for a new message
+    mi.process_packet(publish_qos2);
+    BOOST_CHECK_EQUAL(delivered, 2);
+
+    const std::vector<byte> ref = {
+        '>', packet_type::pubrec, 2, 0, 7,
+        '>', packet_type::pubrec, 2, 0, 7,
+        '>', packet_type::pubcomp, 2, 0, 7,
+        '>', packet_type::pubrec, 2, 0, 7};
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(), ref.begin(), ref.end());
+}
+
+BOOST_AUTO_TEST_CASE( mikado_publish_while_requests_pending )
+{
+    connection_mock mock;
+    int delivered = 0;
+    auto mi = mikado_sm{mock, [&delivered](cbuf_t, cbuf_t){++delivered;}};
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mi.subscribe("x/y");
+    mi.send_ping();
+    BOOST_CHECK(mi.session() == session_t::connected);
+    BOOST_CHECK_EQUAL(mi.pending_subscribes(), 1);
+    BOOST_CHECK(mi.ping_pending());
+    BOOST_CHECK(mi.state() == state_t::subscribe_requested);
+
+    mi.process_packet(packet_publish);
+    BOOST_CHECK_EQUAL(delivered, 1);
+
+    mi.process_packet(packet_suback);
+    BOOST_CHECK(mi.state() == state_t::ping_await);
+    mi.process_packet(packet_publish);
+    BOOST_CHECK_EQUAL(delivered, 2);
+
+    const std::vector<byte> pingresp = {packet_type::pingresp, 0};
+    mi.process_packet(pingresp);
+    BOOST_CHECK(mi.state() == state_t::connected);
+    // late answers do no harm
+    mi.process_packet(pingresp);
+    BOOST_CHECK(mi.state() == state_t::connected);
+
+    // a server never sends a CONNECT
+    mi.process_packet(std::vector<byte>{packet_type::connect, 0});
+    BOOST_CHECK(mi.session() == session_t::error);
+    BOOST_CHECK(mi.state() == state_t::error);
+}
+
 BOOST_AUTO_TEST_CASE( mikado_set_callback )
 {
     connection_mock mock;
@@ -237,6 +616,103 @@ BOOST_AUTO_TEST_CASE( mikado_set_callback )
     BOOST_CHECK_EQUAL(callback_data.payload, "Hello");
 }
 
+size_t plain_callback_calls = 0;
+void plain_callback(cbuf_t, cbuf_t)
+{
+    ++plain_callback_calls;
+}
+
+BOOST_AUTO_TEST_CASE( mikado_set_callback_ref )
+{
+    connection_mock mock;
+    size_t owned_calls = 0;
+    auto mi = mikado_sm{mock, [&owned_calls](cbuf_t, cbuf_t){ ++owned_calls; }};
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    // referenced, not copied: the handler keeps its state
+    callback_mock callback_data;
+    mi.set_callback_ref(callback_data);
+    mi.process_packet(packet_publish);
+    BOOST_CHECK(callback_data.called);
+    BOOST_CHECK_EQUAL(callback_data.topic, "a/b");
+    BOOST_CHECK_EQUAL(callback_data.payload, "Hello");
+    BOOST_CHECK_EQUAL(owned_calls, 0);
+
+    mi.set_callback_ref(plain_callback);
+    mi.process_packet(packet_publish);
+    BOOST_CHECK_EQUAL(plain_callback_calls, 1);
+
+    // set_callback() takes over again
+    mi.set_callback([&owned_calls](cbuf_t, cbuf_t){ ++owned_calls; });
+    mi.process_packet(packet_publish);
+    BOOST_CHECK_EQUAL(owned_calls, 1);
+    BOOST_CHECK_EQUAL(plain_callback_calls, 1);
+}
+
+/// A transport bound at compile time, no virtual functions
+struct static_connection
+{
+    std::array<byte, 256> send_buffer;
+    std::vector<byte> sent;
+    std::vector<byte> incoming;
+
+    buf_t get_send_buf()
+    {
+        return send_buffer;
+    }
+
+    int send(cbuf_t data)
+    {
+        sent.insert(sent.end(), data.begin(), data.end());
+        return data.size();
+    }
+
+    int send_vectored(cbuf_t head, cbuf_t tail)
+    {
+        return send_copied(*this, head, tail);
+    }
+
+    int read(buf_t b)
+    {
+        const auto n = copy(incoming, b);
+        incoming.erase(incoming.begin(), incoming.begin() + n);
+        return n;
+    }
+};
+
+BOOST_AUTO_TEST_CASE( mikado_static_transport )
+{
+    static_connection conn;
+    callback_mock callback_data;
+    basic_mikado_sm<static_connection> mi{conn, [&callback_data](cbuf_t t, cbuf_t p){callback_data(t, p);}};
+
+    mi.request_connect("client");
+    BOOST_CHECK_EQUAL(conn.sent[0], packet_type::connect);
+
+    conn.incoming = packet_connack;
+    conn.incoming.insert(conn.incoming.end(), packet_publish.begin(), packet_publish.end());
+    std::array<byte, 64> read_buffer;
+    basic_batch_reader<static_connection> reader{conn, read_buffer};
+    reader.drain([&mi](cbuf_t p){ mi.process_packet(p); });
+    BOOST_CHECK(mi.state() == state_t::connected);
+    BOOST_CHECK_EQUAL(callback_data.topic, "a/b");
+    BOOST_CHECK_EQUAL(callback_data.payload, "Hello");
+
+    // the payload goes out through send_vectored()
+    conn.sent.clear();
+    mi.publish("a/b", "Hello");
+    BOOST_CHECK_EQUAL_COLLECTIONS(conn.sent.begin(), conn.sent.end(), packet_publish.begin(), packet_publish.end());
+
+    conn.incoming = packet_publish;
+    basic_packet_reader<static_connection> packets{conn, read_buffer};
+    while (packets.read_packet() != read_result::success)
+    {
+    }
+    const auto read = packets.content();
+    BOOST_CHECK_EQUAL_COLLECTIONS(read.begin(), read.end(), packet_publish.begin(), packet_publish.end());
+}
+
 BOOST_AUTO_TEST_CASE( mikado_callback_calls_publish )
 {
     connection_mock mock;
@@ -292,6 +768,297 @@ BOOST_AUTO_TEST_CASE( mikado_send_publish )
                                   ref.begin(), ref.end());
 }
 
+struct vectored_connection_mock : public connection_mock
+{
+    virtual int send_vectored(gsl::span<const byte> head,
+                              gsl::span<const byte> tail) override
+    {
+        last_tail = tail;
+        return connection_mock::send_vectored(head, tail);
+    }
+
+    gsl::span<const byte> last_tail;
+};
+
+BOOST_AUTO_TEST_CASE( mikado_send_publish_vectored )
+{
+    vectored_connection_mock mock;
+    auto mi = mikado_sm{mock};
+
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mock.log.clear();
+    const std::vector<byte> topic = {'a', '/', 'b'};
+    const std::vector<byte> payload = {'t', 'h', 'i', 's'};
+    mi.publish(topic, payload, true);
+
+    // payload is handed to the connection without being copied before
+    BOOST_CHECK(mock.last_tail.data() == payload.data());
+    BOOST_CHECK_EQUAL(mock.last_tail.size(), payload.size());
+
+    const std::vector<byte> ref =
+    {
+        '>',
+        packet_type::publish | 1, // retain
+        9, //remaining length
+        0, 3, 'a', '/', 'b', //topic
+        't', 'h', 'i', 's' // payload
+    };
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(),
+                                  ref.begin(), ref.end());
+}
+
+BOOST_AUTO_TEST_CASE( mikado_send_publish_larger_than_send_buffer )
+{
+    connection_mock mock;
+    auto mi = mikado_sm{mock};
+
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mock.sent_packet_count = 0;
+    const std::string payload(mock.send_buffer.size(), 'x');
+    BOOST_CHECK(!mi.publish("a/b", payload));
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 0);
+    BOOST_CHECK(mi.state() == state_t::connected);
+}
+
+struct clock_mock : public Clock
+{
+    virtual time_point now() override
+    {
+        return t;
+    }
+
+    time_point t{};
+};
+
+BOOST_AUTO_TEST_CASE( mikado_keep_alive )
+{
+    connection_mock mock;
+    clock_mock clock;
+    auto mi = mikado_sm{mock};
+    mi.set_clock(clock);
+
+    mi.request_connect("", 10);
+    // keep alive is sent in the CONNECT
+    BOOST_CHECK_EQUAL(mock.log[11], 0);
+    BOOST_CHECK_EQUAL(mock.log[12], 10);
+    mi.process_packet(packet_connack);
+    BOOST_CHECK(mi.next_deadline() == clock.t + std::chrono::seconds(10));
+
+    // traffic suppresses the ping
+    clock.t += std::chrono::seconds(8);
+    mi.publish("a", "x");
+    clock.t += std::chrono::seconds(8);
+    mi.poll();
+    BOOST_CHECK_EQUAL(mi.keep_alive_statistics().pings, 0);
+
+    // idle for the interval, ping
+    clock.t += std::chrono::seconds(2);
+    mock.log.clear();
+    mi.poll();
+    const std::vector<byte> ping = {'>', packet_type::pingreq, 0};
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(), ping.begin(), ping.end());
+    BOOST_CHECK(mi.ping_pending());
+    BOOST_CHECK(mi.next_deadline() == clock.t + std::chrono::seconds(10));
+
+    clock.t += std::chrono::milliseconds(35);
+    mi.process_packet(std::vector<byte>{packet_type::pingresp, 0});
+    BOOST_CHECK(!mi.ping_pending());
+    BOOST_CHECK(mi.keep_alive_statistics().last_rtt == std::chrono::milliseconds(35));
+    BOOST_CHECK_EQUAL(mi.keep_alive_statistics().pongs, 1);
+
+    // a missing PINGRESP ends the session
+    mi.set_ping_timeout(std::chrono::seconds(3));
+    clock.t += std::chrono::seconds(10);
+    mi.poll();
+    BOOST_CHECK(mi.ping_pending());
+    clock.t += std::chrono::seconds(2);
+    mi.poll();
+    BOOST_CHECK(mi.session() == session_t::connected);
+    clock.t += std::chrono::seconds(1);
+    mi.poll();
+    BOOST_CHECK(mi.session() == session_t::error);
+    BOOST_CHECK_EQUAL(mi.keep_alive_statistics().timeouts, 1);
+}
+
+BOOST_AUTO_TEST_CASE( mikado_timer_wheel )
+{
+    connection_mock mock;
+    clock_mock clock;
+    timer_wheel wheel{std::chrono::milliseconds(1), clock.t};
+    auto mi = mikado_sm{mock};
+    mi.set_clock(clock);
+    size_t expired = 0;
+    mi.set_timer_wheel(&wheel, [&expired]() { ++expired; });
+
+    mi.request_connect("", 10);
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+    mi.process_packet(packet_connack);
+    BOOST_CHECK_EQUAL(wheel.size(), 1);
+    BOOST_CHECK(wheel.next_expiry() <= clock.t + std::chrono::seconds(10));
+
+    // traffic does not move the timer, it polls early and is armed again
+    clock.t += std::chrono::seconds(8);
+    mi.publish("a", "x");
+    clock.t += std::chrono::seconds(2) - std::chrono::milliseconds(1);
+    BOOST_CHECK_EQUAL(wheel.expire(clock.t), 0);
+    clock.t += std::chrono::milliseconds(1);
+    BOOST_CHECK_EQUAL(wheel.expire(clock.t), 1);
+    BOOST_CHECK_EQUAL(expired, 1);
+    BOOST_CHECK_EQUAL(mi.keep_alive_statistics().pings, 0);
+    BOOST_CHECK_EQUAL(wheel.size(), 1);
+
+    clock.t += std::chrono::seconds(8);
+    wheel.expire(clock.t);
+    BOOST_CHECK(mi.ping_pending());
+    clock.t += std::chrono::seconds(10);
+    wheel.expire(clock.t);
+    BOOST_CHECK(mi.session() == session_t::error);
+
+    mi.set_timer_wheel(nullptr);
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+}
+
+#if MIKADO_METRICS
+BOOST_AUTO_TEST_CASE( mikado_metrics )
+{
+    connection_mock mock;
+    metrics m;
+    auto mi = mikado_sm{mock};
+    mi.set_metrics(&m);
+
+    mi.request_connect("client");
+    mi.process_packet(packet_connack);
+    mi.publish("a", "x");
+    mi.process_packet(packet_publish);
+    mi.process_packet(packet_publish);
+
+    auto s = m.snapshot();
+    BOOST_CHECK_EQUAL(s.packets_out[packet_type::connect >> 4], 1);
+    BOOST_CHECK_EQUAL(s.packets_out[packet_type::publish >> 4], 1);
+    BOOST_CHECK_EQUAL(s.packets_total_out(), 2);
+    BOOST_CHECK_EQUAL(s.bytes_out, 20 + 6);
+    BOOST_CHECK_EQUAL(s.packets_in[packet_type::connack >> 4], 1);
+    BOOST_CHECK_EQUAL(s.packets_in[packet_type::publish >> 4], 2);
+    BOOST_CHECK_EQUAL(s.bytes_in, 4 + 2 * 12);
+    BOOST_CHECK_EQUAL(s.callbacks, 2);
+    BOOST_CHECK_EQUAL(s.errors, 0);
+
+    // a second CONNACK is a protocol error, counted once
+    mi.process_packet(packet_connack);
+    mi.process_packet(packet_connack);
+    BOOST_CHECK(mi.session() == session_t::error);
+    BOOST_CHECK_EQUAL(m.snapshot().errors, 1);
+
+    m.reset();
+    s = m.snapshot();
+    BOOST_CHECK_EQUAL(s.packets_total_in(), 0);
+    BOOST_CHECK_EQUAL(s.bytes_in, 0);
+    BOOST_CHECK_EQUAL(s.errors, 0);
+
+    mi.set_metrics(nullptr);
+    mi.request_connect("client");
+    BOOST_CHECK_EQUAL(m.snapshot().packets_total_out(), 0);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE( mikado_publish_batching )
+{
+    connection_mock mock;
+    auto mi = mikado_sm{mock};
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mock.sent_packet_count = 0;
+    mock.log.clear();
+    mi.set_batching(1024, std::chrono::seconds(1));
+
+    // each of these is 10 bytes on the wire
+    for (int i = 0; i < 3; ++i)
+    {
+        mi.publish("a/b", "this");
+    }
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 0);
+
+    mi.flush();
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 1);
+
+    const std::vector<byte> packet = {
+        packet_type::publish, 9, 0, 3, 'a', '/', 'b', 't', 'h', 'i', 's'
+    };
+    std::vector<byte> ref = {'>'};
+    for (int i = 0; i < 3; ++i)
+    {
+        ref.insert(ref.end(), packet.begin(), packet.end());
+    }
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(),
+                                  ref.begin(), ref.end());
+
+    const auto &stats = mi.batching_stats();
+    BOOST_CHECK_EQUAL(stats.flushes, 1);
+    BOOST_CHECK_EQUAL(stats.packets, 3);
+    BOOST_CHECK_EQUAL(stats.bytes, 3 * packet.size());
+    BOOST_CHECK_EQUAL(stats.max_packets_per_flush, 3);
+}
+
+BOOST_AUTO_TEST_CASE( mikado_publish_batching_thresholds )
+{
+    connection_mock mock;
+    clock_mock clock;
+    auto mi = mikado_sm{mock};
+    mi.set_clock(clock);
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mock.sent_packet_count = 0;
+    mi.set_batching(25, std::chrono::milliseconds(10));
+
+    // size threshold: the third 11 byte packet does not fit any more
+    mi.publish("a/b", "this");
+    mi.publish("a/b", "this");
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 0);
+    mi.publish("a/b", "this");
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 1);
+
+    // time threshold
+    clock.t += std::chrono::milliseconds(5);
+    mi.poll();
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 1);
+    clock.t += std::chrono::milliseconds(5);
+    mi.poll();
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 2);
+
+    // packets larger than the threshold are sent right away
+    mi.publish("a/b", std::string(30, 'x'));
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 3);
+    BOOST_CHECK_EQUAL(mi.batching_stats().flushes, 2);
+}
+
+BOOST_AUTO_TEST_CASE( mikado_publish_batching_keeps_order )
+{
+    connection_mock mock;
+    auto mi = mikado_sm{mock};
+    mi.request_connect("");
+    mi.process_packet(packet_connack);
+
+    mi.set_batching(1024, std::chrono::seconds(1));
+    mi.publish("a/b", "this");
+
+    mock.log.clear();
+    mi.send_ping();
+
+    const std::vector<byte> ref =
+    {
+        '>', packet_type::publish, 9, 0, 3, 'a', '/', 'b', 't', 'h', 'i', 's',
+        '>', packet_type::pingreq, 0
+    };
+    BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(),
+                                  ref.begin(), ref.end());
+}
+
 BOOST_AUTO_TEST_CASE( mikado_send_ping )
 {
     connection_mock mock;
@@ -353,12 +1120,70 @@ BOOST_AUTO_TEST_CASE( mikado_send_disconnect )
     };
 
     mock.log.clear();
-    mi.send_disconnect();
+    BOOST_CHECK(mi.send_disconnect());
     BOOST_CHECK(mi.state() == state_t::disconnected);
     BOOST_CHECK_EQUAL_COLLECTIONS(mock.log.begin(), mock.log.end(),
                                   ref.begin(), ref.end());
 }
 
+/// Send buffer too small for any packet
+struct tiny_connection_mock : public Connection
+{
+    std::array<byte, 1> send_buffer;
+    size_t sent = 0;
+
+    virtual buf_t get_send_buf() override
+    {
+        return send_buffer;
+    }
+
+    virtual int send(cbuf_t data) override
+    {
+        ++sent;
+        return data.size();
+    }
+};
+
+BOOST_AUTO_TEST_CASE( mikado_send_buffer_too_small )
+{
+    tiny_connection_mock mock;
+    auto mi = mikado_sm{mock};
+    const auto state = mi.state();
+    BOOST_CHECK(!mi.request_connect("client"));
+    BOOST_CHECK(mi.state() == state);
+
+    BOOST_CHECK_EQUAL(mi.subscribe("a/b"), 0);
+    BOOST_CHECK(!mi.publish("a/b", "payload"));
+    BOOST_CHECK(!mi.send_ping());
+    BOOST_CHECK(!mi.ping_pending());
+    BOOST_CHECK(!mi.send_disconnect());
+    BOOST_CHECK(mi.state() == state);
+    BOOST_CHECK_EQUAL(mock.sent, 0);
+}
+
+BOOST_AUTO_TEST_CASE( mikado_publish_exceeding_send_buffer )
+{
+    connection_mock mock;
+    clock_mock clock;
+    auto mi = mikado_sm{mock};
+    mi.set_clock(clock);
+    mi.request_connect("", 10);
+    mi.process_packet(packet_connack);
+
+    // the header fits, header and payload do not
+    mock.sent_packet_count = 0;
+    clock.t += std::chrono::seconds(8);
+    const std::string payload(mock.send_buffer.size() - 4, 'x');
+    BOOST_CHECK(!mi.publish("a/b", payload));
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 0);
+
+    // nothing was sent, so the ping is still due
+    clock.t += std::chrono::seconds(2);
+    mi.poll();
+    BOOST_CHECK(mi.ping_pending());
+    BOOST_CHECK_EQUAL(mock.sent_packet_count, 1);
+}
+
 
 BOOST_AUTO_TEST_CASE( incremental_lexing )
 {
@@ -402,6 +1227,62 @@ BOOST_AUTO_TEST_CASE( receiver_len0 )
     BOOST_CHECK(r.state() == receiver_state::msg_complete);
 }
 
+BOOST_AUTO_TEST_CASE( receiver_multibyte_length )
+{
+    // remaining length 200 is encoded as 0xC8 0x01
+    std::vector<byte> msg(3 + 200, 7);
+    msg[0] = 42;
+    msg[1] = 0xC8;
+    msg[2] = 0x01;
+    receiver r(msg);
+
+    r.advance(2);
+    BOOST_CHECK(r.state() == receiver_state::got_type);
+    BOOST_CHECK_EQUAL(r.bytes_to_read(), 1);
+    r.advance();
+    BOOST_CHECK(r.state() == receiver_state::msg_incomplete);
+    BOOST_CHECK_EQUAL(r.bytes_to_read(), 200);
+
+    r.advance(200);
+    BOOST_CHECK(r.state() == receiver_state::msg_complete);
+    BOOST_CHECK_EQUAL(r.content().size(), msg.size());
+}
+
+BOOST_AUTO_TEST_CASE( receiver_length_too_long )
+{
+    const byte msg[] = {42, 0x80, 0x80, 0x80, 0x80, 0x01};
+    receiver r(msg);
+    r.advance(5);
+    BOOST_CHECK(r.state() == receiver_state::error);
+}
+
+BOOST_AUTO_TEST_CASE( receiver_bulk_skip )
+{
+    std::vector<byte> msg(3 + 200, 7);
+    msg[0] = 42;
+    msg[1] = 0xC8;
+    msg[2] = 0x01;
+    receiver r(msg);
+
+    // stop within the body
+    r.advance_until(msg.data() + 100);
+    BOOST_CHECK(r.state() == receiver_state::msg_incomplete);
+    BOOST_CHECK_EQUAL(r.bytes_to_read(), 103);
+
+    r.advance_until(msg.data() + msg.size());
+    BOOST_CHECK(r.state() == receiver_state::msg_complete);
+    BOOST_CHECK_EQUAL(r.content().size(), msg.size());
+}
+
+BOOST_AUTO_TEST_CASE( receiver_bulk_past_end )
+{
+    // two packets back to back, lexing past the first is an error
+    const byte msg[] = {42, 2, 1, 1, 42, 0};
+    receiver r(msg);
+    r.advance_until(std::end(msg));
+    BOOST_CHECK(r.state() == receiver_state::error);
+}
+
 
 struct Receiving_connection_mock : public Packet_reader::Receiving_Connection
 {
@@ -515,3 +1396,311 @@ BOOST_AUTO_TEST_CASE( receive_multiple_packets )
     }
 
 }
+
+struct Stream_connection_mock : public Packet_reader::Receiving_Connection
+{
+    virtual int read(buf_t b) override
+    {
+        const auto incr = copy(cursor, data.end(), b.begin(), b.end());
+        cursor += incr;
+        return incr;
+    }
+
+    std::vector<byte> data;
+    decltype(data)::iterator cursor;
+};
+
+BOOST_AUTO_TEST_CASE( large_publish_roundtrip )
+{
+    // serialize a publish with a payload needing a 3 byte remaining length
+    std::vector<byte> send_buffer(70000);
+    const std::vector<byte> topic = {'a', '/', 'b'};
+    std::vector<byte> payload(65536);
+    for (size_t i = 0; i < payload.size(); ++i)
+    {
+        payload[i] = static_cast<byte>(i);
+    }
+
+    const auto msg = publish::Packet{topic, payload}.to_span(send_buffer);
+    BOOST_REQUIRE_EQUAL(msg.size(), 1 + 3 + 2 + topic.size() + payload.size());
+    BOOST_CHECK_EQUAL(msg[0], packet_type::publish);
+    const std::vector<byte> length_ref = {0x85, 0x80, 0x04}; // 65541
+    BOOST_CHECK_EQUAL_COLLECTIONS(msg.begin() + 1, msg.begin() + 4,
+                                  length_ref.begin(), length_ref.end());
+
+    // lex it back through a Packet_reader
+    Stream_connection_mock mock;
+    mock.data.assign(msg.begin(), msg.end());
+    mock.cursor = mock.data.begin();
+
+    std::vector<byte> read_buf(70000);
+    Packet_reader reader{mock, read_buf};
+    read_result ret;
+    do{
+        ret = reader.read_packet();
+    }while(ret == read_result::more_to_read);
+    BOOST_REQUIRE(ret == read_result::success);
+    BOOST_CHECK_EQUAL(reader.content().size(), msg.size());
+
+    publish::Packet p;
+    BOOST_REQUIRE(p.from_span(reader.content()));
+    BOOST_CHECK_EQUAL_COLLECTIONS(p.topic.begin(), p.topic.end(),
+                                  topic.begin(), topic.end());
+    BOOST_CHECK_EQUAL_COLLECTIONS(p.payload.begin(), p.payload.end(),
+                                  payload.begin(), payload.end());
+}
+
+BOOST_AUTO_TEST_CASE( packet_exceeds_read_buffer )
+{
+    Stream_connection_mock mock;
+    mock.data = {packet_type::publish, 0xC8, 0x01};
+    mock.data.resize(3 + 200);
+    mock.cursor = mock.data.begin();
+
+    std::array<byte, 100> read_buf;
+    Packet_reader reader{mock, read_buf};
+    read_result ret;
+    do{
+        ret = reader.read_packet();
+    }while(ret == read_result::more_to_read);
+    BOOST_CHECK(ret == read_result::read_error);
+}
+
+BOOST_AUTO_TEST_CASE( publish_too_large_for_send_buffer )
+{
+    std::array<byte, 140> send_buffer;
+    const std::vector<byte> topic = {'a'};
+    const std::vector<byte> payload(135);
+
+    // fits with a one byte remaining length, but not with two
+    const auto msg = publish::Packet{topic, payload}.to_span(send_buffer);
+    BOOST_CHECK_EQUAL(msg.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( packet_sizes )
+{
+    std::vector<byte> buf(200);
+    const string_ref filters[] = {"a/+", "b/#"};
+    const std::vector<byte> topic = {'a', '/', 'b'};
+    const std::vector<byte> payload(130);
+
+    connect::Packet c{"client"};
+    subscribe::Packet s{1, filters};
+    publish::Packet p{topic, payload};
+    BOOST_CHECK_EQUAL(c.size(), c.to_span(buf).size());
+    BOOST_CHECK_EQUAL(s.size(), s.to_span(buf).size());
+    BOOST_CHECK_EQUAL(p.size(), p.to_span(buf).size());
+    BOOST_CHECK_EQUAL(p.size(), 1 + 2 + 2 + topic.size() + payload.size());
+    BOOST_CHECK_EQUAL(p.size() - payload.size(), p.header_to_span(buf).size());
+    p.QoS = 1;
+    BOOST_CHECK_EQUAL(p.size(), p.to_span(buf).size());
+    BOOST_CHECK_EQUAL(puback::Packet::size(), puback::Packet{1}.to_span(buf).size());
+    BOOST_CHECK_EQUAL(pingreq::Packet{}.size(), pingreq::Packet{}.to_span(buf).size());
+    BOOST_CHECK_EQUAL(disconnect::Packet{}.size(), disconnect::Packet{}.to_span(buf).size());
+
+    BOOST_CHECK_EQUAL(packet_size(0), 2);
+    BOOST_CHECK_EQUAL(packet_size(127), 129);
+    BOOST_CHECK_EQUAL(packet_size(128), 131);
+    BOOST_CHECK_EQUAL(packet_size(vbi_max), 1 + 4 + vbi_max);
+    BOOST_CHECK_EQUAL(packet_size(vbi_max + 1), 0);
+}
+
+BOOST_AUTO_TEST_CASE( packets_rejected_instead_of_truncated )
+{
+    const std::vector<byte> sentinel(64, 0xAA);
+
+    // one byte short of each packet, the byte behind the buffer untouched
+    connect::Packet c{"client"};
+    auto buf = sentinel;
+    BOOST_CHECK(c.to_span(gsl::make_span(buf.data(), c.size() - 1)).empty());
+    BOOST_CHECK_EQUAL(buf[c.size() - 1], 0xAA);
+
+    const string_ref filters[] = {"a/+", "b/#"};
+    subscribe::Packet s{1, filters};
+    buf = sentinel;
+    BOOST_CHECK(s.to_span(gsl::make_span(buf.data(), s.size() - 1)).empty());
+    BOOST_CHECK_EQUAL(buf[s.size() - 1], 0xAA);
+
+    buf = sentinel;
+    BOOST_CHECK(puback::Packet{1}.to_span(gsl::make_span(buf.data(), 3)).empty());
+    BOOST_CHECK_EQUAL(buf[3], 0xAA);
+
+    // strings longer than their two byte length prefix allows
+    const std::string too_long(70000, 'x');
+    std::vector<byte> large(80000);
+    BOOST_CHECK_EQUAL(connect::Packet{too_long}.size(), 0);
+    BOOST_CHECK(connect::Packet{too_long}.to_span(large).empty());
+    const string_ref long_filter[] = {too_long};
+    BOOST_CHECK_EQUAL((subscribe::Packet{1, long_filter}.size()), 0);
+    BOOST_CHECK_EQUAL((subscribe::Packet{1, {}}.size()), 0);
+    const publish::Packet p{string_ref{too_long}.bytes(), {}};
+    BOOST_CHECK_EQUAL(p.size(), 0);
+
+    connection_mock mock;
+    mikado_sm mi{mock};
+    BOOST_CHECK(!mi.request_connect(too_long));
+    BOOST_CHECK(!mi.publish(too_long, "payload"));
+    BOOST_CHECK_EQUAL(mi.subscribe(too_long), 0);
+
+    // slots large enough for the topic, so only its length prefix rejects it
+    BOOST_REQUIRE(mi.set_inflight_window(1, 80000));
+    BOOST_CHECK(!mi.publish(too_long, "payload", false, 1));
+    BOOST_CHECK_EQUAL(mi.inflight(), 0);
+    BOOST_CHECK(mi.publish("a/b", "payload", false, 1));
+    BOOST_CHECK_EQUAL(mi.inflight(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( copy_bounded )
+{
+    const std::vector<byte> src = {1, 2, 3, 4, 5};
+    std::array<byte, 3> short_out{};
+    std::vector<byte> long_out(8, 0);
+
+    // contiguous ranges, bounded by the shorter one
+    BOOST_CHECK_EQUAL(copy(src, short_out), 3);
+    BOOST_CHECK_EQUAL_COLLECTIONS(short_out.begin(), short_out.end(), src.begin(), src.begin() + 3);
+    BOOST_CHECK_EQUAL(copy(src, long_out), 5);
+    BOOST_CHECK_EQUAL_COLLECTIONS(long_out.begin(), long_out.begin() + 5, src.begin(), src.end());
+    BOOST_CHECK_EQUAL(long_out[5], 0);
+    BOOST_CHECK_EQUAL(copy(gsl::span<const byte>{}, long_out), 0);
+
+    // element by element for other iterators
+    std::vector<byte> out(8, 0);
+    BOOST_CHECK_EQUAL(copy(src.begin(), src.end(), out.begin(), out.begin() + 2), 2);
+    BOOST_CHECK_EQUAL(out[1], 2);
+    BOOST_CHECK_EQUAL(out[2], 0);
+
+    // overlapping, as when moving unread data to the front of a buffer
+    std::vector<byte> buf = {0, 0, 1, 2, 3};
+    BOOST_CHECK_EQUAL(copy(buf.data() + 2, buf.data() + 5, buf.data(), buf.data() + 5), 3);
+    const std::vector<byte> moved = {1, 2, 3, 2, 3};
+    BOOST_CHECK_EQUAL_COLLECTIONS(buf.begin(), buf.end(), moved.begin(), moved.end());
+}
+
+struct Chunked_connection_mock : public Packet_reader::Receiving_Connection
+{
+    virtual int read(buf_t b) override
+    {
+        ++read_count;
+        const auto chunk = gsl::make_span(&*cursor, std::min<size_t>(
+                                              max_chunk, data.end() - cursor));
+        const auto incr = copy(chunk, b);
+        cursor += incr;
+        return incr;
+    }
+
+    std::vector<byte> data;
+    decltype(data)::iterator cursor;
+    size_t max_chunk = 1024;
+    int read_count = 0;
+};
+
+BOOST_AUTO_TEST_CASE( batch_reader_single_read )
+{
+    Chunked_connection_mock mock;
+    mock.data = {
+        0, 2, 1, 1,
+        1, 3, 2, 2, 2,
+        2, 0
+    };
+    mock.cursor = mock.data.begin();
+
+    std::array<byte, 64> buf;
+    Batch_reader reader{mock, buf};
+
+    std::vector<size_t> sizes;
+    const auto ret = reader.drain([&sizes](cbuf_t p){sizes.push_back(p.size());});
+    BOOST_CHECK(ret == read_result::more_to_read);
+    BOOST_CHECK_EQUAL(mock.read_count, 1);
+
+    const std::vector<size_t> ref = {4, 5, 2};
+    BOOST_CHECK_EQUAL_COLLECTIONS(sizes.begin(), sizes.end(), ref.begin(), ref.end());
+}
+
+BOOST_AUTO_TEST_CASE( batch_reader_partial_tail )
+{
+    // packets of increasing size, delivered in awkward chunks through a
+    // buffer too small to hold all of them
+    Chunked_connection_mock mock;
+    for (byte i = 0; i < 20; ++i)
+    {
+        mock.data.push_back(i);
+        mock.data.push_back(i);
+        mock.data.insert(mock.data.end(), i, i);
+    }
+    mock.cursor = mock.data.begin();
+    mock.max_chunk = 7;
+
+    std::array<byte, 32> buf;
+    Batch_reader reader{mock, buf};
+
+    byte expected = 0;
+    read_result ret;
+    do{
+        ret = reader.drain([&expected](cbuf_t p){
+            BOOST_CHECK_EQUAL(p[0], expected);
+            BOOST_CHECK_EQUAL(p.size(), expected + 2u);
+            ++expected;
+        });
+    }while(ret == read_result::more_to_read && mock.cursor != mock.data.end());
+    BOOST_CHECK_EQUAL(expected, 20);
+}
+
+BOOST_AUTO_TEST_CASE( batch_reader_packet_too_large )
+{
+    Chunked_connection_mock mock;
+    mock.data = {0, 40};
+    mock.data.resize(42);
+    mock.cursor = mock.data.begin();
+
+    std::array<byte, 32> buf;
+    Batch_reader reader{mock, buf};
+
+    read_result ret;
+    do{
+        ret = reader.drain([](cbuf_t){ BOOST_FAIL("unexpected packet"); });
+    }while(ret == read_result::more_to_read);
+    BOOST_CHECK(ret == read_result::read_error);
+}
+
+#if MIKADO_METRICS
+BOOST_AUTO_TEST_CASE( reader_metrics )
+{
+    Chunked_connection_mock mock;
+    mock.data = {
+        0, 2, 1, 1,
+        1, 3, 2, 2, 2,
+        2, 0
+    };
+    mock.cursor = mock.data.begin();
+    mock.max_chunk = 3;
+
+    metrics m;
+    std::array<byte, 64> buf;
+    Batch_reader reader{mock, buf};
+    reader.set_metrics(&m);
+    while (mock.cursor != mock.data.end())
+    {
+        reader.drain([](cbuf_t){});
+    }
+    auto s = m.snapshot();
+    BOOST_CHECK_EQUAL(s.reads, 4);
+    BOOST_CHECK_EQUAL(s.packets_read, 3);
+    BOOST_CHECK_CLOSE(s.reads_per_packet(), 4.0 / 3, 1e-9);
+
+    // Packet_reader needs a read for the fixed header and one for the body
+    m.reset();
+    mock.cursor = mock.data.begin();
+    mock.max_chunk = 1024;
+    std::array<byte, 64> buf2;
+    Packet_reader packets{mock, buf2};
+    packets.set_metrics(&m);
+    while (packets.read_packet() != read_result::success)
+    {
+    }
+    s = m.snapshot();
+    BOOST_CHECK_EQUAL(s.reads, 2);
+    BOOST_CHECK_EQUAL(s.packets_read, 1);
+    BOOST_CHECK_EQUAL(s.read_errors, 0);
+}
+#endif
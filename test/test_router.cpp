@@ -0,0 +1,111 @@
+#define BOOST_TEST_MODULE router test
+#include <boost/test/unit_test.hpp>
+
+#include <map>
+
+#include "router.h"
+
+using namespace mikado;
+
+gsl::span<const byte> as_span(const std::string &s)
+{
+    return gsl::span<const byte>(reinterpret_cast<const byte *>(s.data()), s.size());
+}
+
+/// Counts calls per filter
+struct route_log
+{
+    std::map<std::string, int> calls;
+
+    router::handler_t handler(const std::string &filter)
+    {
+        return [this, filter](gsl::span<const byte>, gsl::span<const byte>) { ++calls[filter]; };
+    }
+};
+
+BOOST_AUTO_TEST_CASE( valid_filters )
+{
+    BOOST_CHECK(router::valid_filter("a/b/c"));
+    BOOST_CHECK(router::valid_filter("#"));
+    BOOST_CHECK(router::valid_filter("+"));
+    BOOST_CHECK(router::valid_filter("a/+/c/#"));
+    BOOST_CHECK(router::valid_filter("/"));
+
+    BOOST_CHECK(!router::valid_filter(""));
+    BOOST_CHECK(!router::valid_filter("a/#/c"));
+    BOOST_CHECK(!router::valid_filter("a/b#"));
+    BOOST_CHECK(!router::valid_filter("a+/b"));
+}
+
+BOOST_AUTO_TEST_CASE( exact_match )
+{
+    router r;
+    route_log log;
+    BOOST_CHECK(r.empty());
+    r.add("a/b", log.handler("a/b"));
+    r.add("a/c", log.handler("a/c"));
+    BOOST_CHECK(!r.empty());
+
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("a/b"), as_span("x")), 1);
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("a"), as_span("x")), 0);
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("a/b/c"), as_span("x")), 0);
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("a/bb"), as_span("x")), 0);
+
+    BOOST_CHECK_EQUAL(log.calls["a/b"], 1);
+    BOOST_CHECK_EQUAL(log.calls["a/c"], 0);
+}
+
+BOOST_AUTO_TEST_CASE( wildcards )
+{
+    router r;
+    route_log log;
+    for (const auto f : {"sport/tennis/+", "sport/#", "+/tennis/#", "#", "+/+", "/+"})
+    {
+        BOOST_REQUIRE(r.add(f, log.handler(f)));
+    }
+
+    // '#' includes the parent level
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("sport"), as_span("")), 2); // sport/#, #
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("sport/tennis/player1"), as_span("")), 4);
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("sport/tennis"), as_span("")), 4); // sport/#, +/tennis/#, #, +/+
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("/finance"), as_span("")), 3); // #, +/+, /+
+
+    BOOST_CHECK_EQUAL(log.calls["sport/tennis/+"], 1);
+    BOOST_CHECK_EQUAL(log.calls["sport/#"], 3);
+    BOOST_CHECK_EQUAL(log.calls["+/tennis/#"], 2);
+    BOOST_CHECK_EQUAL(log.calls["#"], 4);
+    BOOST_CHECK_EQUAL(log.calls["+/+"], 2);
+    BOOST_CHECK_EQUAL(log.calls["/+"], 1);
+}
+
+BOOST_AUTO_TEST_CASE( system_topics )
+{
+    router r;
+    route_log log;
+    r.add("#", log.handler("#"));
+    r.add("+/monitor", log.handler("+/monitor"));
+    r.add("$SYS/#", log.handler("$SYS/#"));
+
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("$SYS/monitor"), as_span("")), 1);
+    BOOST_CHECK_EQUAL(log.calls["$SYS/#"], 1);
+}
+
+BOOST_AUTO_TEST_CASE( remove_filter )
+{
+    router r;
+    route_log log;
+    r.add("a/+", log.handler("a/+"));
+    r.add("a/+", log.handler("a/+"));
+    r.add("a/b", log.handler("a/b"));
+
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("a/b"), as_span("")), 3);
+
+    BOOST_CHECK(r.remove("a/+"));
+    BOOST_CHECK(!r.remove("a/+"));
+    BOOST_CHECK(!r.remove("x/y"));
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("a/b"), as_span("")), 1);
+
+    BOOST_CHECK(r.remove("a/b"));
+    BOOST_CHECK(r.empty());
+    BOOST_CHECK_EQUAL(r.dispatch(as_span("a/b"), as_span("")), 0);
+}
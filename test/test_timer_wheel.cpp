@@ -0,0 +1,189 @@
+#define BOOST_TEST_MODULE timer wheel test
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "timer_wheel.h"
+
+using namespace mikado;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+typedef timer_wheel::time_point time_point;
+
+const time_point start{seconds(1000)};
+
+BOOST_AUTO_TEST_CASE( expire_in_order )
+{
+    timer_wheel wheel{milliseconds(1), start};
+    BOOST_CHECK(wheel.next_expiry() == time_point::max());
+
+    std::vector<int> fired;
+    timer a{[&]() { fired.push_back(1); }};
+    timer b{[&]() { fired.push_back(2); }};
+    timer c{[&]() { fired.push_back(3); }};
+    wheel.schedule(a, start + milliseconds(30));
+    wheel.schedule(b, start + milliseconds(10));
+    wheel.schedule(c, start + milliseconds(20));
+    BOOST_CHECK_EQUAL(wheel.size(), 3);
+    BOOST_CHECK(wheel.next_expiry() == start + milliseconds(10));
+
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(9)), 0);
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(25)), 2);
+    BOOST_CHECK(!b.scheduled());
+    BOOST_CHECK(a.scheduled());
+    BOOST_CHECK(wheel.next_expiry() == start + milliseconds(30));
+
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(30)), 1);
+    const std::vector<int> expected = {2, 3, 1};
+    BOOST_CHECK_EQUAL_COLLECTIONS(fired.begin(), fired.end(), expected.begin(), expected.end());
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( cancel_and_reschedule )
+{
+    timer_wheel wheel{milliseconds(1), start};
+    int fired = 0;
+    timer t{[&]() { ++fired; }};
+
+    wheel.schedule(t, start + seconds(5));
+    wheel.cancel(t);
+    BOOST_CHECK(!t.scheduled());
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+    BOOST_CHECK(wheel.next_expiry() == time_point::max());
+
+    // scheduling again moves the timer
+    wheel.schedule(t, start + seconds(5));
+    wheel.schedule(t, start + seconds(2));
+    BOOST_CHECK_EQUAL(wheel.size(), 1);
+    BOOST_CHECK(t.expiry() == start + seconds(2));
+    wheel.expire(start + seconds(10));
+    BOOST_CHECK_EQUAL(fired, 1);
+
+    {
+        timer gone;
+        wheel.schedule(gone, start + seconds(20));
+    }
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( far_ahead )
+{
+    timer_wheel wheel{milliseconds(1), start};
+    int fired = 0;
+    timer t{[&]() { ++fired; }};
+
+    // passes through several levels on its way down
+    const auto at = start + std::chrono::hours(30) + milliseconds(7);
+    wheel.schedule(t, at);
+
+    // lower bounds only, until close enough
+    auto now = start;
+    size_t wakeups = 0;
+    while (fired == 0)
+    {
+        const auto next = wheel.next_expiry();
+        BOOST_REQUIRE(next <= at);
+        now = next;
+        wheel.expire(now);
+        BOOST_REQUIRE(++wakeups < 10);
+    }
+    BOOST_CHECK(now == at);
+
+    // due already, runs on the next tick
+    wheel.schedule(t, start);
+    BOOST_CHECK_EQUAL(wheel.expire(now), 0);
+    BOOST_CHECK_EQUAL(wheel.expire(now + milliseconds(1)), 1);
+}
+
+BOOST_AUTO_TEST_CASE( callbacks_reschedule )
+{
+    timer_wheel wheel{milliseconds(10), start};
+    std::vector<time_point> runs;
+    timer t;
+    t.callback = [&]() {
+        runs.push_back(t.expiry());
+        wheel.schedule(t, t.expiry() + milliseconds(100));
+    };
+    wheel.schedule(t, start + milliseconds(100));
+
+    // periods missed are caught up one per expire()
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(450)), 1);
+    BOOST_CHECK(t.expiry() == start + milliseconds(200));
+    BOOST_CHECK(wheel.next_expiry() == start + milliseconds(460));
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(450)), 0);
+    for (int i = 0; i < 3; ++i)
+    {
+        BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(460 + 10 * i)), 1);
+    }
+    BOOST_CHECK_EQUAL(runs.size(), 4);
+    BOOST_CHECK(runs.back() == start + milliseconds(400));
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(490)), 0);
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(500)), 1);
+
+    // resolution rounds expiries up
+    wheel.schedule(t, start + milliseconds(555));
+    BOOST_CHECK(wheel.next_expiry() == start + milliseconds(560));
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(559)), 0);
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(560)), 1);
+}
+
+BOOST_AUTO_TEST_CASE( callback_reschedules_into_the_past )
+{
+    timer_wheel wheel{milliseconds(1), start};
+    size_t runs = 0;
+    timer t;
+    t.callback = [&]() {
+        ++runs;
+        wheel.schedule(t, start);
+    };
+    wheel.schedule(t, start + milliseconds(1));
+
+    // due again at once, but not run again in the same expire()
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(100)), 1);
+    BOOST_CHECK_EQUAL(runs, 1);
+    BOOST_CHECK(t.scheduled());
+    BOOST_CHECK(wheel.next_expiry() == start + milliseconds(101));
+    BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(101)), 1);
+    BOOST_CHECK_EQUAL(runs, 2);
+}
+
+BOOST_AUTO_TEST_CASE( many_timers )
+{
+    timer_wheel wheel{milliseconds(1), start};
+    std::mt19937 rng{17};
+    std::uniform_int_distribution<int> delay{0, 3600 * 1000};
+
+    std::vector<time_point> fired;
+    std::vector<std::unique_ptr<timer>> timers;
+    for (int i = 0; i < 5000; ++i)
+    {
+        timers.emplace_back(new timer);
+        auto &t = *timers.back();
+        t.callback = [&fired, &t]() { fired.push_back(t.expiry()); };
+        wheel.schedule(t, start + milliseconds(1 + delay(rng)));
+    }
+    for (size_t i = 0; i < timers.size(); i += 2)
+    {
+        wheel.cancel(*timers[i]);
+    }
+    BOOST_CHECK_EQUAL(wheel.size(), 2500);
+
+    // wake only when something could be due, never after it
+    auto now = start;
+    while (wheel.size() > 0)
+    {
+        now = wheel.next_expiry();
+        const auto before = fired.size();
+        wheel.expire(now);
+        for (auto i = before; i < fired.size(); ++i)
+        {
+            BOOST_REQUIRE(fired[i] == now);
+        }
+    }
+    BOOST_CHECK_EQUAL(fired.size(), 2500);
+    BOOST_CHECK(std::is_sorted(fired.begin(), fired.end()));
+}
@@ -0,0 +1,67 @@
+#define BOOST_TEST_MODULE topic table test
+#include <boost/test/unit_test.hpp>
+
+#include "topic_table.h"
+
+using namespace mikado;
+
+gsl::span<const byte> as_span(const std::string &s)
+{
+    return gsl::span<const byte>(reinterpret_cast<const byte *>(s.data()), s.size());
+}
+
+#if __cplusplus >= 201402L
+constexpr auto static_topics = make_topic_table("sensor/1/temp", "sensor/1/hum", "sensor/2/temp", "$SYS/uptime");
+static_assert(static_topics.valid(), "topic table could not be built");
+#endif
+
+BOOST_AUTO_TEST_CASE( static_table )
+{
+#if __cplusplus >= 201402L
+    const auto &t = static_topics;
+#else
+    const auto t = make_topic_table("sensor/1/temp", "sensor/1/hum", "sensor/2/temp", "$SYS/uptime");
+#endif
+    BOOST_REQUIRE(t.valid());
+    const auto index = t.index();
+    BOOST_CHECK_EQUAL(index.size(), 4);
+
+    BOOST_CHECK_EQUAL(index.find(as_span("sensor/1/temp")), 0);
+    BOOST_CHECK_EQUAL(index.find(as_span("sensor/1/hum")), 1);
+    BOOST_CHECK_EQUAL(index.find(as_span("sensor/2/temp")), 2);
+    BOOST_CHECK_EQUAL(index.find(as_span("$SYS/uptime")), 3);
+
+    BOOST_CHECK(index.find(as_span("sensor/1/tem")) == topic_index::npos);
+    BOOST_CHECK(index.find(as_span("sensor/3/temp")) == topic_index::npos);
+    BOOST_CHECK(index.find(as_span("")) == topic_index::npos);
+}
+
+BOOST_AUTO_TEST_CASE( runtime_table )
+{
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 500; ++i)
+    {
+        names.push_back("building/" + std::to_string(i % 7) + "/room/" + std::to_string(i));
+    }
+    const topic_table t{names};
+    BOOST_REQUIRE(t.valid());
+
+    const auto index = t.index();
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        BOOST_CHECK_EQUAL(index.find(as_span(names[i])), i);
+    }
+    BOOST_CHECK(index.find(as_span("building/0/room/500")) == topic_index::npos);
+    BOOST_CHECK(index.find(as_span("building/0/room/")) == topic_index::npos);
+}
+
+BOOST_AUTO_TEST_CASE( empty_and_duplicate )
+{
+    const topic_table empty{std::vector<std::string>{}};
+    BOOST_CHECK(empty.valid());
+    BOOST_CHECK(empty.index().find(as_span("a")) == topic_index::npos);
+    BOOST_CHECK(topic_index{}.find(as_span("a")) == topic_index::npos);
+
+    const topic_table duplicate{{"a/b", "c", "a/b"}};
+    BOOST_CHECK(!duplicate.valid());
+}
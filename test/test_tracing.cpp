@@ -0,0 +1,153 @@
+#define BOOST_TEST_MODULE tracing test
+#include <boost/test/unit_test.hpp>
+
+#include <array>
+#include <thread>
+#include <vector>
+
+#include "mikado.h"
+
+using namespace mikado;
+using std::chrono::nanoseconds;
+using std::chrono::microseconds;
+
+BOOST_AUTO_TEST_CASE( histogram_buckets )
+{
+    // exact below 128 ns
+    for (uint64_t ns = 0; ns < 128; ++ns)
+    {
+        BOOST_CHECK_EQUAL(latency_histogram::bucket(ns), ns);
+        BOOST_CHECK_EQUAL(latency_histogram::highest_in(ns), ns);
+    }
+
+    // above, each value lies in its bucket, within 1/64
+    for (uint64_t ns = 128; ns < (uint64_t{1} << 40); ns = ns * 9 / 8 + 1)
+    {
+        const auto i = latency_histogram::bucket(ns);
+        BOOST_REQUIRE_LT(i, latency_histogram::bucket_count);
+        BOOST_CHECK_GE(latency_histogram::highest_in(i), ns);
+        BOOST_CHECK_LT(latency_histogram::highest_in(i - 1), ns);
+        BOOST_CHECK_LE(latency_histogram::highest_in(i) - ns, ns / 64);
+    }
+
+    // too long for the histogram counts in the last bucket
+    BOOST_CHECK_EQUAL(latency_histogram::bucket(uint64_t{1} << 50), latency_histogram::bucket_count - 1);
+}
+
+BOOST_AUTO_TEST_CASE( histogram_percentiles )
+{
+    latency_histogram h;
+    BOOST_CHECK(h.snapshot().percentile(50) == nanoseconds(0));
+
+    for (int i = 1; i <= 1000; ++i)
+    {
+        h.record(microseconds(i));
+    }
+    const auto s = h.snapshot();
+    BOOST_CHECK_EQUAL(s.count, 1000);
+    BOOST_CHECK(s.max == microseconds(1000));
+
+    const auto within = [](nanoseconds measured, nanoseconds expected) {
+        return measured >= expected && measured - expected <= expected / 64;
+    };
+    BOOST_CHECK(within(s.percentile(50), microseconds(500)));
+    BOOST_CHECK(within(s.percentile(99), microseconds(990)));
+    BOOST_CHECK(within(s.percentile(99.9), microseconds(999)));
+    BOOST_CHECK(s.percentile(100) == microseconds(1000));
+
+    auto merged = s;
+    merged += s;
+    BOOST_CHECK_EQUAL(merged.count, 2000);
+    BOOST_CHECK(merged.percentile(50) == s.percentile(50));
+
+    h.reset();
+    BOOST_CHECK_EQUAL(h.snapshot().count, 0);
+}
+
+BOOST_AUTO_TEST_CASE( histogram_snapshot_while_recording )
+{
+    latency_histogram h;
+    std::thread writer{[&h]() {
+        for (int i = 0; i < 100000; ++i)
+        {
+            h.record(nanoseconds(i % 1000));
+        }
+    }};
+    uint64_t last = 0;
+    for (int i = 0; i < 100; ++i)
+    {
+        const auto count = h.snapshot().count;
+        BOOST_CHECK_GE(count, last);
+        last = count;
+    }
+    writer.join();
+    BOOST_CHECK_EQUAL(h.snapshot().count, 100000);
+}
+
+#if MIKADO_METRICS
+struct connection_mock : public Connection, public Packet_reader::Receiving_Connection
+{
+    std::array<byte, 256> send_buffer;
+    virtual buf_t get_send_buf() override
+    {
+        return send_buffer;
+    }
+
+    virtual int send(cbuf_t buf) override
+    {
+        return buf.size();
+    }
+
+    virtual int read(buf_t b) override
+    {
+        const auto n = copy(incoming, b);
+        incoming.erase(incoming.begin(), incoming.begin() + n);
+        return n;
+    }
+
+    std::vector<byte> incoming;
+};
+
+BOOST_AUTO_TEST_CASE( tracer_stages )
+{
+    connection_mock conn;
+    tracer t;
+    t.set_stamped_payloads(true);
+
+    std::array<byte, 256> read_buffer;
+    Batch_reader reader{conn, read_buffer};
+    reader.set_tracer(&t);
+
+    const auto delay = microseconds(200);
+    mikado_sm sm{conn};
+    sm.set_tracer(&t);
+    sm.request_connect("");
+    sm.process_packet(std::vector<byte>{packet_type::connack, 2, 0, 0});
+
+    const std::string topic = "a";
+    std::array<byte, tracer::stamp_size + 2> payload{};
+    BOOST_CHECK(!tracer::stamp(gsl::make_span(payload).first(4)));
+    BOOST_CHECK(tracer::stamp(payload, tracer::clock::now() - delay));
+    publish::Packet p{gsl::make_span(reinterpret_cast<const byte *>(topic.data()), topic.size()), payload};
+    conn.incoming.resize(p.size());
+    p.to_span(conn.incoming);
+
+    reader.drain([&sm](cbuf_t packet) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        sm.process_packet(packet);
+    });
+
+    const auto s = t.snapshot();
+    BOOST_CHECK_EQUAL(s.arrival_to_callback.count, 1);
+    BOOST_CHECK_EQUAL(s.entry_to_callback.count, 1);
+    BOOST_CHECK_EQUAL(s.publish_to_callback.count, 1);
+    // the stages nest: published before read, read before process_packet()
+    BOOST_CHECK_GE(s.arrival_to_callback.max.count(), microseconds(100).count());
+    BOOST_CHECK_LT(s.entry_to_callback.max.count(), s.arrival_to_callback.max.count());
+    BOOST_CHECK_GE(s.publish_to_callback.max.count(), (delay + microseconds(100)).count());
+
+    // other packets are not traced
+    sm.process_packet(std::vector<byte>{packet_type::pingresp, 0});
+    BOOST_CHECK_EQUAL(t.snapshot().entry_to_callback.count, 1);
+}
+#endif
@@ -98,3 +98,38 @@ BOOST_AUTO_TEST_CASE ( decode_multiple_digits )
     BOOST_CHECK(!d);
     BOOST_CHECK_EQUAL(vbi_decoder::value_type(d), 16384);
 }
+
+BOOST_AUTO_TEST_CASE ( decode_four_digits )
+{
+    vbi_decoder d;
+    const auto in = {0xFF, 0xFF, 0xFF, 0x7F};
+    for (const auto b : in)
+    {
+        d.read_byte(b);
+    }
+    BOOST_CHECK(!d);
+    BOOST_CHECK_EQUAL(vbi_decoder::value_type(d), vbi_max);
+}
+
+BOOST_AUTO_TEST_CASE ( decode_too_many_digits )
+{
+    vbi_decoder d;
+    const auto in = {0x80, 0x80, 0x80};
+    for (const auto b : in)
+    {
+        BOOST_CHECK(d.read_byte(b));
+    }
+    // a fourth byte with continuation bit is malformed
+    BOOST_CHECK(!d.read_byte(0x80));
+    BOOST_CHECK(d);
+}
+
+BOOST_AUTO_TEST_CASE ( encoded_size )
+{
+    BOOST_CHECK_EQUAL(vbi(0).size(), 1);
+    BOOST_CHECK_EQUAL(vbi(127).size(), 1);
+    BOOST_CHECK_EQUAL(vbi(128).size(), 2);
+    BOOST_CHECK_EQUAL(vbi(16383).size(), 2);
+    BOOST_CHECK_EQUAL(vbi(16384).size(), 3);
+    BOOST_CHECK_EQUAL(vbi(vbi_max).size(), 4);
+}